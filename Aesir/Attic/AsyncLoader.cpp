@@ -0,0 +1,158 @@
+#include "stdwx.h"
+#include "AsyncLoader.h"
+#include "TileLoader.h"
+#include <algorithm>
+#include <exception>
+#include <boost/bind.hpp>
+using namespace boost;
+using namespace std;
+
+AsyncLoader::Task *AsyncLoader::Queue(TileIdentifier tileIdentifier, TileGraphic *tileGraphic,
+	int priority, bool indexed) {
+	vector<Task *> tasks;
+	QueueBatch(vector<TileIdentifier>(1, tileIdentifier), vector<TileGraphic *>(1, tileGraphic),
+		priority, indexed, tasks);
+	return tasks[0];
+}
+void AsyncLoader::QueueBatch(const vector<TileIdentifier> &tileIdentifiers,
+	const vector<TileGraphic *> &tileGraphics, int priority, bool indexed, vector<Task *> &tasks) {
+	tasks.resize(tileIdentifiers.size());
+	if(tasks.empty()) return;
+	if(workers.size() == 0) Start();
+	{
+		// The batch goes in under one lock, so its tasks lie next to each other in the queue
+		boost::mutex::scoped_lock lock(queueMutex);
+		++lastBatch;
+		for(uint32 i = 0; i < tasks.size(); ++i) {
+			Task *task = tasks[i] = new Task(tileIdentifiers[i], tileGraphics[i], priority, indexed, lastBatch);
+			task->position = pending.insert(make_pair(priority, task));
+			task->queued = true;
+		}
+	}
+	pendingEvents.notify_one();
+}
+void AsyncLoader::Promote(Task *task, int priority) {
+	boost::mutex::scoped_lock lock(queueMutex);
+	if(!task->queued || priority >= task->priority) return; // Don't allow clients to demote tasks
+	pending.erase(task->position);
+	task->priority = priority;
+	task->position = pending.insert(make_pair(priority, task));
+}
+void AsyncLoader::Cancel(Task *task) {
+	{
+		boost::mutex::scoped_lock lock(queueMutex);
+		if(task->queued) {
+			pending.erase(task->position);
+			delete task;
+			return;
+		}
+	}
+	// A worker has the task, or it's waiting to be popped; whoever sees it next frees it
+	task->cancelled = true;
+}
+AsyncLoader::Task *AsyncLoader::PopCompleted() {
+	while(true) {
+		if(ready.empty()) {
+			// Take the whole list at once; it comes out newest first, so flip it around
+			for(Task *list = completed.exchange(0, boost::memory_order_acquire); list; list = list->next)
+				ready.push_front(list);
+			if(ready.empty()) return 0;
+		}
+		Task *task = ready.front();
+		ready.pop_front();
+		if(!task->cancelled) return task;
+		delete task; // The tile was cancelled while it was being decoded
+	}
+}
+void AsyncLoader::Start() {
+	// Leave a core for the UI thread
+	uint32 count = max<int>(1, int(boost::thread::hardware_concurrency()) - 1);
+	for(uint32 i = 0; i < count; ++i)
+		workers.create_thread(boost::bind(&AsyncLoader::WorkerThread, this));
+}
+void AsyncLoader::WorkerThread() {
+	vector<Task *> tasks;
+	while(true) {
+		tasks.clear();
+		{
+			/* Get the most urgent tile from the queue, and the rest of its batch that is still
+			 * waiting behind it; a task that was promoted has left its batch's place */
+			boost::mutex::scoped_lock lock(queueMutex);
+			while(!kill && pending.empty()) pendingEvents.wait(lock);
+			if(kill) return;
+			PendingQueue::iterator i = pending.begin();
+			uint32 batch = i->second->batch;
+			do {
+				i->second->queued = false;
+				tasks.push_back(i->second);
+				pending.erase(i++);
+			} while(i != pending.end() && i->second->batch == batch && tasks.size() < MAX_BATCH);
+			if(!pending.empty()) pendingEvents.notify_one(); // Another worker can take what's left
+		}
+		Decode(tasks);
+		// Push the tasks onto the completion list
+		for(vector<Task *>::iterator i = tasks.begin(); i != tasks.end(); ++i) {
+			Task *task = *i, *head = completed.load(boost::memory_order_relaxed);
+			do task->next = head;
+			while(!completed.compare_exchange_weak(head, task, boost::memory_order_release, boost::memory_order_relaxed));
+		}
+	}
+}
+void AsyncLoader::Decode(const vector<Task *> &tasks) {
+	vector<Task *> live;
+	vector<TileIdentifier> tileIdentifiers;
+	for(vector<Task *>::const_iterator i = tasks.begin(); i != tasks.end(); ++i) {
+		if((*i)->cancelled) continue;
+		live.push_back(*i);
+		tileIdentifiers.push_back((*i)->tileIdentifier);
+	}
+	if(live.empty()) return;
+	vector<TileLoader::DecodedTile> tiles;
+	vector<uint32> pixels;
+	vector<uint8> indices;
+	try {
+		bool indexed = live[0]->indexed; // The same for the whole batch
+		if(indexed) tileLoader.DecodeIndexedBatch(tileIdentifiers, tiles, indices);
+		else tileLoader.DecodeBatch(tileIdentifiers, tiles, pixels);
+		for(uint32 i = 0; i < live.size(); ++i) {
+			Task *task = live[i];
+			const TileLoader::DecodedTile &tile = tiles[i];
+			uint32 pixelCount = tile.width * tile.height;
+			task->width = tile.width;
+			task->height = tile.height;
+			task->palette = tile.palette;
+			if(pixelCount == 0) continue;
+			if(indexed) task->indices.assign(&indices[tile.offset], &indices[tile.offset] + pixelCount);
+			else task->pixels.assign(&pixels[tile.offset], &pixels[tile.offset] + pixelCount);
+		}
+	} catch(std::exception &) {
+		if(live.size() > 1) {
+			// Find the broken tile, so that the rest of the batch still comes out
+			for(vector<Task *>::iterator i = live.begin(); i != live.end(); ++i)
+				Decode(vector<Task *>(1, *i));
+			return;
+		}
+		// A broken tile is uploaded as an empty one rather than taking the thread down
+		live[0]->width = live[0]->height = 0;
+		live[0]->pixels.clear();
+		live[0]->indices.clear();
+	}
+}
+void AsyncLoader::Stop() {
+	{
+		// Kill the workers
+		boost::mutex::scoped_lock lock(queueMutex);
+		kill = true;
+	}
+	pendingEvents.notify_all();
+	workers.join_all();
+}
+AsyncLoader::~AsyncLoader() {
+	Stop();
+	for(PendingQueue::iterator i = pending.begin(); i != pending.end(); ++i) delete i->second;
+	for(deque<Task *>::iterator i = ready.begin(); i != ready.end(); ++i) delete *i;
+	for(Task *list = completed.load(), *next; list; list = next) {
+		next = list->next;
+		delete list;
+	}
+}
@@ -0,0 +1,86 @@
+#pragma once
+#include <map>
+#include <deque>
+#include <vector>
+#include <utility>
+#include <boost/atomic.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/condition.hpp>
+#include <boost/thread/mutex.hpp>
+class TileGraphic;
+typedef std::pair<uint32, int> TileIdentifier;
+
+/* Decodes tiles on a pool of worker threads, so that the UI thread never has to wait on the
+ * disk. Tiles are queued with a priority, where lower values are decoded first (as in the C#
+ * TaskThread); a queued tile can be promoted or cancelled. Tiles queued as a batch are decoded
+ * together, by one worker, with a single TileLoader::DecodeBatch, so that they're read grouped by
+ * archive and in file order, as far as they're still waiting together. Decoded tiles are pushed onto a
+ * lock-free completion list, which the GL thread drains with PopCompleted, since only the GL
+ * thread may upload into the texture atlas. */
+class AsyncLoader {
+public:
+	static const uint32 MAX_BATCH = 256; // The most tiles that a worker takes at once
+	struct Task;
+	typedef std::multimap<int, Task *> PendingQueue;
+	struct Task {
+		TileIdentifier tileIdentifier;
+		TileGraphic *tileGraphic; // The graphic that is waiting on this task
+		int priority;
+		bool indexed; // Whether to leave the tile as palette indices rather than expand it
+		uint32 width, height;
+		std::vector<uint32> pixels; // The decoded RGBA pixels, filled in by a worker
+		std::vector<uint8> indices; // Or the palette indices, for an indexed task
+		const uint32 *palette; // The palette that the indices go through
+	private:
+		friend class AsyncLoader;
+		inline Task(TileIdentifier tileIdentifier_, TileGraphic *tileGraphic_, int priority_,
+			bool indexed_, uint32 batch_) : tileIdentifier(tileIdentifier_), tileGraphic(tileGraphic_),
+			priority(priority_), indexed(indexed_), width(0), height(0), palette(0), batch(batch_),
+			next(0), queued(false), cancelled(false) { }
+		uint32 batch; // Tasks queued together share a batch number
+		Task *next; // The next task in the completion list
+		PendingQueue::iterator position; // Where the task is in the pending queue, if queued
+		bool queued; // Whether the task is still in the pending queue; guarded by queueMutex
+		boost::atomic<bool> cancelled;
+	};
+	// Queue a tile to be decoded. The task belongs to the loader until PopCompleted hands it out.
+	Task *Queue(TileIdentifier tileIdentifier, TileGraphic *tileGraphic, int priority,
+		bool indexed = false);
+	/* Queue many tiles to be decoded together; tasks[i] is the task of tileIdentifiers[i], and
+	 * gets the pixels of tileGraphics[i]. Each task can still be promoted or cancelled on its own. */
+	void QueueBatch(const std::vector<TileIdentifier> &tileIdentifiers,
+		const std::vector<TileGraphic *> &tileGraphics, int priority, bool indexed,
+		std::vector<Task *> &tasks);
+	// Move a queued task up to a lower priority value; tasks are never demoted
+	void Promote(Task *task, int priority);
+	/* Cancel a task. The task must not be used afterwards; if a worker is decoding it, the
+	 * loader frees it once the worker is done. */
+	void Cancel(Task *task);
+	/* Get the next task that has finished decoding, or 0 if there are none. Only the GL thread
+	 * may call this; the caller deletes the task once it has uploaded it. */
+	Task *PopCompleted();
+	inline bool HasCompleted() const { return !ready.empty() || completed.load() != 0; }
+	inline uint32 GetPendingCount() { // The number of tiles waiting for a worker
+		boost::mutex::scoped_lock lock(queueMutex);
+		return pending.size();
+	}
+	/* Stop the workers and wait for them to finish the tiles they're on; nothing is decoded after
+	 * this. The tasks stay where they are, to be cancelled or freed as usual. */
+	void Stop();
+	inline AsyncLoader() : lastBatch(0), completed(0), kill(false) { }
+	~AsyncLoader();
+private:
+	void Start(); // Spin up the workers; this happens on the first Queue
+	void WorkerThread();
+	// Decode tasks taken off the queue together, or one by one if one of them is broken
+	static void Decode(const std::vector<Task *> &tasks);
+	boost::thread_group workers;
+	boost::mutex queueMutex;
+	boost::condition pendingEvents;
+	PendingQueue pending; // Tasks of equal priority are kept in the order they were queued
+	uint32 lastBatch; // The batch number given out last; guarded by queueMutex
+	// Tasks that workers have finished, pushed and popped without locking
+	boost::atomic<Task *> completed;
+	std::deque<Task *> ready; // Completed tasks taken off of the list, in order; GL thread only
+	bool kill; // Guarded by queueMutex
+};
@@ -1,5 +1,6 @@
 #pragma once
 #include <wx/glcanvas.h>
+#include "SpriteBatch.h"
 
 class BasicCanvas : public wxGLCanvas {
 public:
@@ -8,6 +9,8 @@ public:
 	BasicCanvas(wxWindow *parent, bool main);
 	// Derived classes override this to implement custom drawing
 	virtual void Render() { }
+protected:
+	SpriteBatch spriteBatch; // For drawing tiles in Render
 private:
 	wxScrollBar *horizontalScroll, *verticalScroll;
 	void Resize(int width, int height);
@@ -0,0 +1,58 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <ostream>
+#include <algorithm>
+#include <GL/osmesa.h>
+#include <boost/chrono.hpp>
+
+// What the benchmark files share: the clock, and the report that they all print to
+typedef boost::chrono::high_resolution_clock Clock;
+inline double MicrosecondsSince(Clock::time_point start) {
+	return boost::chrono::duration<double, boost::micro>(Clock::now() - start).count(); }
+
+class Report {
+public:
+	inline Report(std::ostream &out_) : out(out_) { }
+	/* Print a benchmark: the time each sample took, and how many items each sample processed.
+	 * Extra fields go in as they are, starting with a comma. */
+	void Print(const std::string &name, std::vector<double> &latencies, double itemsPerSample,
+		const std::string &extra = std::string()) {
+		if(latencies.empty()) return;
+		std::sort(latencies.begin(), latencies.end());
+		double total = 0;
+		for(std::vector<double>::iterator i = latencies.begin(); i != latencies.end(); ++i) total += *i;
+		char line[512];
+		sprintf(line, "{\"benchmark\":\"%s\",\"samples\":%u,\"items_per_second\":%.1f,"
+			"\"mean_us\":%.3f,\"p50_us\":%.3f,\"p90_us\":%.3f,\"p99_us\":%.3f,\"max_us\":%.3f%s}",
+			name.c_str(), uint32(latencies.size()), itemsPerSample * latencies.size() / (total / 1e6),
+			total / latencies.size(), Percentile(latencies, 0.5), Percentile(latencies, 0.9),
+			Percentile(latencies, 0.99), latencies.back(), extra.c_str());
+		out << line << std::endl;
+	}
+	// Print what count tiles cost to keep resident, expanded and as indices
+	void PrintResidency(const std::string &name, uint32 count, uint32 rgbaBytes, uint32 indexedBytes) {
+		char line[512];
+		sprintf(line, "{\"benchmark\":\"%s\",\"tiles\":%u,\"rgba_bytes_per_tile\":%.1f,"
+			"\"indexed_bytes_per_tile\":%.1f,\"reduction\":%.2f}", name.c_str(), count,
+			double(rgbaBytes) / count, double(indexedBytes) / count,
+			indexedBytes?double(rgbaBytes) / indexedBytes:0);
+		out << line << std::endl;
+	}
+private:
+	static double Percentile(const std::vector<double> &sorted, double fraction) {
+		return sorted[std::min<size_t>(sorted.size() - 1, size_t(fraction * sorted.size()))]; }
+	std::ostream &out;
+};
+
+// MapBench.cpp; BenchMap saves and opens a map under dataPath too
+void BenchMap(Report &report, const std::string &dataPath, uint32 iterations);
+void BenchMapEdit(Report &report, uint32 iterations);
+void BenchMapIndex(Report &report, uint32 iterations);
+void BenchMapLayers(Report &report, uint32 iterations);
+// JournalBench.cpp
+void BenchMapJournal(Report &report, uint32 iterations);
+// RenderBench.cpp; these resize the context's buffer to a full screen
+void BenchRender(Report &report, OSMesaContext context, uint32 iterations);
+void BenchMapRender(Report &report, OSMesaContext context, uint32 iterations);
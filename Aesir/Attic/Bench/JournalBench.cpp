@@ -0,0 +1,57 @@
+#include "stdwx.h"
+#include "Bench.h"
+#include "../MapDocument.h"
+#include <cstdio>
+#include <vector>
+#include <algorithm>
+#include <exception>
+using namespace std;
+
+void BenchMapJournal(Report &report, uint32 iterations) {
+	// A 400x250 stamp, 100000 cells, over a painted map, as one step that is undone and redone
+	const int width = 400, height = 250;
+	MapDocument mapDocument;
+	for(int y = 0; y < height; ++y)
+		for(int x = 0; x < width; ++x) mapDocument.InsertTile(x, y, (x + y) % 64);
+	mapDocument.GetJournal().Clear();
+	vector<double> records, undos, redos;
+	Clock::time_point start = Clock::now();
+	mapDocument.GetJournal().BeginStep();
+	for(int y = 0; y < height; ++y)
+		for(int x = 0; x < width; ++x) mapDocument.InsertTile(x, y, 64 + (x * 3 + y) % 64);
+	mapDocument.GetJournal().EndStep();
+	records.push_back(MicrosecondsSince(start));
+	uint32 journalBytes = mapDocument.GetJournal().GetMemoryBytes();
+	char extra[160];
+	sprintf(extra, ",\"journal_bytes\":%u,\"bytes_per_edit\":%.2f", journalBytes,
+		double(journalBytes) / (width * height));
+	report.Print("journal_record_stamp", records, width * height, extra);
+	for(uint32 i = 0; i < max<uint32>(1, iterations / 100); ++i) {
+		start = Clock::now();
+		mapDocument.Undo();
+		undos.push_back(MicrosecondsSince(start));
+		if(mapDocument.GetTile(width - 1, height - 1) != (width - 1 + height - 1) % 64)
+			throw exception("Undo didn't put the map back");
+		start = Clock::now();
+		mapDocument.Redo();
+		redos.push_back(MicrosecondsSince(start));
+	}
+	report.Print("journal_undo_stamp", undos, width * height);
+	report.Print("journal_redo_stamp", redos, width * height);
+	// Short drags, one step each, into a history capped at a megabyte
+	mapDocument.GetJournal().SetMemoryCap(1 << 20);
+	vector<double> drags;
+	uint32 seed = 1;
+	for(uint32 i = 0; i < iterations; ++i) {
+		seed = seed * 1664525 + 1013904223;
+		int x = (seed >> 8) % width, y = (seed >> 4) % height;
+		start = Clock::now();
+		mapDocument.GetJournal().BeginStep();
+		for(int j = 0; j < 64; ++j) mapDocument.InsertTile(x + j, y + j / 8, (i + j) % 64);
+		mapDocument.GetJournal().EndStep();
+		drags.push_back(MicrosecondsSince(start));
+	}
+	sprintf(extra, ",\"steps_kept\":%u,\"journal_bytes\":%u", mapDocument.GetJournal().GetStepCount(),
+		mapDocument.GetJournal().GetMemoryBytes());
+	report.Print("journal_record_drag", drags, 64, extra);
+}
@@ -0,0 +1,333 @@
+#include "stdwx.h"
+#include "Bench.h"
+#include "../MapDocument.h"
+#include <cmath>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <exception>
+#include <boost/thread/thread.hpp>
+#include <boost/filesystem/operations.hpp>
+using namespace std;
+
+static void BenchMapFile(Report &report, const string &path, uint32 iterations) {
+	// A 4096x4096 map, saved, opened again and looked around in a screen at a time
+	const int side = 4096;
+	MapDocument mapDocument;
+	mapDocument.GetJournal().SetMemoryCap(0); // Nothing here is undone
+	for(int y = 0; y < side; ++y)
+		for(int x = 0; x < side; ++x) mapDocument.InsertTile(x, y, ((x / 7) ^ (y / 5)) % 64);
+	vector<double> saves, opens, views, updates;
+	Clock::time_point start = Clock::now();
+	mapDocument.Save(path);
+	saves.push_back(MicrosecondsSince(start));
+	uint32 chunks = mapDocument.GetChunkCount();
+	char extra[128];
+	sprintf(extra, ",\"chunks\":%u,\"file_bytes\":%u,\"memory_bytes\":%u", chunks,
+		uint32(boost::filesystem::file_size(path)), mapDocument.GetMemoryBytes());
+	report.Print("map_save_full", saves, chunks, extra);
+	for(uint32 i = 0; i < max<uint32>(1, iterations / 100); ++i) {
+		start = Clock::now();
+		mapDocument.Open(path);
+		opens.push_back(MicrosecondsSince(start));
+	}
+	sprintf(extra, ",\"memory_bytes\":%u", mapDocument.GetMemoryBytes());
+	report.Print("map_open", opens, 1, extra);
+	// Pan over the whole map, a screen of 40x23 cells at a time
+	uint32 seed = 1, peakChunks = 0, peakBytes = 0;
+	for(uint32 i = 0; i < iterations; ++i) {
+		seed = seed * 1664525 + 1013904223;
+		int x = (seed >> 8) % (side - 40), y = (seed >> 4) % (side - 23);
+		start = Clock::now();
+		mapDocument.LoadArea(wxRect(x, y, 40, 23));
+		views.push_back(MicrosecondsSince(start));
+		peakChunks = max(peakChunks, mapDocument.GetChunkCount());
+		peakBytes = max(peakBytes, mapDocument.GetMemoryBytes());
+	}
+	sprintf(extra, ",\"peak_resident_chunks\":%u,\"peak_memory_bytes\":%u", peakChunks, peakBytes);
+	report.Print("map_load_view", views, 1, extra);
+	// Touch a few cells here and there, then save; only their chunks are written
+	for(uint32 i = 0; i < max<uint32>(1, iterations / 100); ++i) {
+		for(int j = 0; j < 16; ++j) {
+			seed = seed * 1664525 + 1013904223;
+			mapDocument.InsertTile((seed >> 8) % side, (seed >> 4) % side, seed % 64);
+		}
+		start = Clock::now();
+		mapDocument.Save(path);
+		updates.push_back(MicrosecondsSince(start));
+	}
+	sprintf(extra, ",\"file_bytes\":%u", uint32(boost::filesystem::file_size(path)));
+	report.Print("map_save_incremental", updates, 16, extra);
+	mapDocument.DeleteContents();
+	boost::filesystem::remove(path);
+}
+void BenchMap(Report &report, const string &dataPath, uint32 iterations) {
+	// A million cells painted as one block, then as a thousand islands spread over a huge map
+	const int side = 1000, islandSide = 32, islands = 1000, spread = 1 << 20;
+	MapDocument dense, sparse;
+	vector<double> inserts;
+	for(int y = 0; y < side; ++y) {
+		Clock::time_point start = Clock::now();
+		for(int x = 0; x < side; ++x) dense.InsertTile(x, y, (x + y) % 64);
+		inserts.push_back(MicrosecondsSince(start));
+	}
+	char extra[128];
+	sprintf(extra, ",\"cells\":%u,\"chunks\":%u,\"memory_bytes\":%u", uint32(side * side),
+		dense.GetChunkCount(), dense.GetMemoryBytes());
+	report.Print("map_insert_dense", inserts, side, extra);
+	inserts.clear();
+	uint32 seed = 1;
+	vector<pair<int, int> > corners;
+	for(int i = 0; i < islands; ++i) {
+		seed = seed * 1664525 + 1013904223;
+		int left = int(seed >> 12) % spread - spread / 2;
+		seed = seed * 1664525 + 1013904223;
+		int top = int(seed >> 12) % spread - spread / 2;
+		corners.push_back(make_pair(left, top));
+		Clock::time_point start = Clock::now();
+		for(int y = 0; y < islandSide; ++y)
+			for(int x = 0; x < islandSide; ++x) sparse.InsertTile(left + x, top + y, i % 64);
+		inserts.push_back(MicrosecondsSince(start));
+	}
+	// A dense array over the same bounds would need spread * spread cells
+	sprintf(extra, ",\"cells\":%u,\"chunks\":%u,\"memory_bytes\":%u,\"bounding_box_cells\":%.0f",
+		uint32(islands * islandSide * islandSide), sparse.GetChunkCount(), sparse.GetMemoryBytes(),
+		double(spread) * spread);
+	report.Print("map_insert_sparse", inserts, islandSide * islandSide, extra);
+	// Lookups that jump around, so that the last chunk is rarely the right one
+	vector<double> lookups;
+	uint32 found = 0;
+	for(uint32 i = 0; i < iterations; ++i) {
+		Clock::time_point start = Clock::now();
+		for(int j = 0; j < 1000; ++j) {
+			seed = seed * 1664525 + 1013904223;
+			const pair<int, int> &corner = corners[(seed >> 8) % islands];
+			if(sparse.GetTile(corner.first + (seed & 31), corner.second + ((seed >> 5) & 31)) !=
+				MapDocument::NO_TILE) ++found;
+		}
+		lookups.push_back(MicrosecondsSince(start));
+	}
+	if(found != iterations * 1000) throw exception("A painted cell went missing from the map");
+	report.Print("map_lookup_sparse", lookups, 1000);
+	// The chunks under a 1920x1080 screen of 48 pixel tiles, wherever it's scrolled to
+	vector<double> regions;
+	uint32 visited = 0;
+	for(uint32 i = 0; i < iterations; ++i) {
+		seed = seed * 1664525 + 1013904223;
+		int x = (seed >> 8) % side, y = (seed >> 4) % side;
+		Clock::time_point start = Clock::now();
+		for(MapDocument::ChunkIterator chunk(dense, wxRect(x - 20, y - 12, 40, 23)); !chunk.IsDone(); ++chunk)
+			visited += chunk->GetCount();
+		regions.push_back(MicrosecondsSince(start));
+	}
+	sprintf(extra, ",\"cells_in_chunks\":%.1f", double(visited) / iterations);
+	report.Print("map_region_query", regions, 1, extra);
+	BenchMapFile(report, dataPath + "bench.nme", iterations);
+}
+void BenchMapEdit(Report &report, uint32 iterations) {
+	// A 1000x1000 region painted a cell at a time and then by each of the bulk edits, in turn
+	const int side = 1000;
+	const uint32 pattern[16] = { 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16 };
+	vector<double> cells, fills, stamps, floods, undos;
+	for(uint32 i = 0; i < max<uint32>(1, iterations / 100); ++i) {
+		MapDocument mapDocument;
+		Clock::time_point start = Clock::now();
+		mapDocument.GetJournal().BeginStep();
+		for(int y = 0; y < side; ++y)
+			for(int x = 0; x < side; ++x) mapDocument.InsertTile(x, y, 20 + i % 2);
+		mapDocument.GetJournal().EndStep();
+		cells.push_back(MicrosecondsSince(start));
+		start = Clock::now();
+		mapDocument.FillRect(wxRect(0, 0, side, side), 30 + i % 2);
+		fills.push_back(MicrosecondsSince(start));
+		start = Clock::now();
+		mapDocument.PaintPattern(wxRect(0, 0, side, side), pattern, 4, 4);
+		stamps.push_back(MicrosecondsSince(start));
+		// Flood the stamp's 1 tiles back over with 0 through a ring of walls, so the fill has to wind
+		mapDocument.FillRect(wxRect(0, 0, side, side), 1);
+		for(int ring = 2; ring < side / 2; ring += 4) {
+			mapDocument.FillRect(wxRect(ring, ring, side - ring * 2, 1), 2);
+			mapDocument.FillRect(wxRect(ring + 1, side - ring - 1, side - ring * 2 - 1, 1), 2);
+		}
+		start = Clock::now();
+		mapDocument.FloodFill(0, 0, 3, wxRect(0, 0, side, side));
+		floods.push_back(MicrosecondsSince(start));
+		start = Clock::now();
+		mapDocument.Undo();
+		undos.push_back(MicrosecondsSince(start));
+	}
+	char extra[64];
+	sprintf(extra, ",\"cores\":%u", boost::thread::hardware_concurrency());
+	report.Print("map_edit_cells", cells, side * side, extra);
+	report.Print("map_edit_fill_rect", fills, side * side, extra);
+	report.Print("map_edit_paint_pattern", stamps, side * side, extra);
+	report.Print("map_edit_flood_fill", floods, 1, extra);
+	report.Print("map_edit_undo_flood", undos, 1, extra);
+}
+void BenchMapIndex(Report &report, uint32 iterations) {
+	// A 1000x1000 region of 256 tiles, with a rare tile in a few of its cells
+	const int side = 1000, rare = 1000;
+	MapDocument mapDocument;
+	mapDocument.GetJournal().SetMemoryCap(0);
+	uint32 seed = 1;
+	for(int y = 0; y < side; ++y) {
+		for(int x = 0; x < side; ++x) {
+			seed = seed * 1664525 + 1013904223;
+			mapDocument.InsertTile(x, y, (seed >> 8) % 256);
+		}
+	}
+	for(int i = 0; i < 16; ++i) mapDocument.InsertTile(i * 61, i * 59, rare);
+	vector<double> counts, scans, finds, replaces, stats, edits, fills;
+	Clock::time_point start = Clock::now();
+	mapDocument.GetTileCount(0);
+	counts.push_back(MicrosecondsSince(start));
+	vector<wxPoint> cells;
+	vector<pair<uint32, uint64> > tileCounts;
+	for(uint32 i = 0; i < max<uint32>(1, iterations / 100); ++i) {
+		// What finding the rare tile would cost without the index
+		start = Clock::now();
+		cells.clear();
+		for(int y = 0; y < side; ++y)
+			for(int x = 0; x < side; ++x) if(mapDocument.GetTile(x, y) == rare) cells.push_back(wxPoint(x, y));
+		scans.push_back(MicrosecondsSince(start));
+		start = Clock::now();
+		mapDocument.FindTile(rare, cells);
+		finds.push_back(MicrosecondsSince(start));
+		if(cells.size() != 16) throw exception("FindTile missed the rare tile");
+		start = Clock::now();
+		mapDocument.ReplaceTile(rare, rare + 1);
+		mapDocument.ReplaceTile(rare + 1, rare);
+		replaces.push_back(MicrosecondsSince(start) / 2);
+		start = Clock::now();
+		mapDocument.GetTileCounts(tileCounts);
+		stats.push_back(MicrosecondsSince(start));
+	}
+	// A bulk edit over part of the map, which recounts each chunk it covers once
+	for(uint32 i = 0; i < max<uint32>(1, iterations / 100); ++i) {
+		start = Clock::now();
+		mapDocument.FillRect(wxRect(0, 0, side / 2, side / 2), 300 + i % 2);
+		fills.push_back(MicrosecondsSince(start));
+	}
+	// Single cell edits, which keep the counts up to date as they go
+	for(uint32 i = 0; i < iterations; ++i) {
+		seed = seed * 1664525 + 1013904223;
+		start = Clock::now();
+		mapDocument.InsertTile((seed >> 8) % side, (seed >> 4) % side, seed % 256);
+		edits.push_back(MicrosecondsSince(start));
+	}
+	char extra[160];
+	sprintf(extra, ",\"index_bytes\":%u,\"index_bytes_per_chunk\":%.1f,\"tiles\":%u", mapDocument.GetIndexBytes(),
+		double(mapDocument.GetIndexBytes()) / mapDocument.GetChunkCount(), uint32(tileCounts.size()));
+	report.Print("map_index_count", counts, side * side, extra);
+	report.Print("map_index_scan_rare", scans, side * side);
+	report.Print("map_index_find_rare", finds, 16);
+	report.Print("map_index_replace_rare", replaces, 16);
+	report.Print("map_index_tile_counts", stats, tileCounts.size());
+	report.Print("map_index_insert_tile", edits, 1);
+	report.Print("map_index_fill_rect", fills, side / 2 * side / 2);
+}
+void BenchMapLayers(Report &report, uint32 iterations) {
+	/* A 1000x1000 region with a floor, an object on one cell in eight, and one cell in four that
+	 * can't be crossed, gone over the way a render pass or an analysis would: every cell's
+	 * passability, and every object tile. The same passes run over the cells kept the other way,
+	 * as one struct per cell with its own stack of object tiles, for comparison. */
+	const int side = 1000;
+	const uint32 objectCount = 64;
+	struct Cell {
+		uint32 tile;
+		vector<uint32> object; // From the cell upwards
+		uint8 passability;
+	};
+	vector<Cell> cells(side * side);
+	MapDocument mapDocument;
+	mapDocument.GetJournal().SetMemoryCap(0);
+	vector<uint16> objects(objectCount);
+	uint32 seed = 1;
+	for(uint32 i = 0; i < objectCount; ++i) {
+		uint32 stack[4], height = 1 + i % 4;
+		for(uint32 j = 0; j < height; ++j) stack[j] = i * 4 + j;
+		objects[i] = mapDocument.GetObjects().Add(stack, height);
+	}
+	uint64 objectTiles = 0;
+	uint32 objectCells = 0;
+	for(int y = 0; y < side; ++y) {
+		for(int x = 0; x < side; ++x) {
+			Cell &cell = cells[y * side + x];
+			seed = seed * 1664525 + 1013904223;
+			cell.tile = (seed >> 8) % 256;
+			cell.passability = ((seed >> 16) % 4 == 0)?1:MapDocument::PASSABLE;
+			mapDocument.InsertTile(x, y, cell.tile);
+			if(cell.passability != MapDocument::PASSABLE) mapDocument.SetPassability(x, y, cell.passability);
+			if((seed >> 20) % 8 == 0) {
+				uint16 object = objects[(seed >> 12) % objectCount];
+				const uint32 *tiles = mapDocument.GetObjects().GetTiles(object);
+				cell.object.assign(tiles, tiles + mapDocument.GetObjects().GetHeight(object));
+				mapDocument.InsertObject(x, y, object);
+				objectTiles += cell.object.size();
+				++objectCells;
+			}
+		}
+	}
+	const ObjectTable &objectTable = mapDocument.GetObjects();
+	const uint32 cellsPerChunk = MapDocument::CHUNK_SIZE * MapDocument::CHUNK_SIZE;
+	const wxRect area(0, 0, side, side);
+	vector<double> layerBlocked, layerObjects, cellBlocked, cellObjects;
+	uint64 blocked[2] = { 0, 0 }, sums[2] = { 0, 0 };
+	for(uint32 i = 0; i < max<uint32>(1, iterations / 100); ++i) {
+		// Each chunk's passability, straight through
+		Clock::time_point start = Clock::now();
+		uint64 count = 0;
+		for(MapDocument::ChunkIterator j(mapDocument, area); !j.IsDone(); ++j) {
+			const uint8 *passability = j->GetPassability();
+			for(uint32 k = 0; k < cellsPerChunk; ++k) count += (passability[k] != MapDocument::PASSABLE);
+		}
+		layerBlocked.push_back(MicrosecondsSince(start));
+		blocked[0] = count;
+		// Each chunk's objects, through the shared table
+		start = Clock::now();
+		uint64 sum = 0;
+		for(MapDocument::ChunkIterator j(mapDocument, area); !j.IsDone(); ++j) {
+			const uint16 *objects = j->GetObjects();
+			for(uint32 k = 0; k < cellsPerChunk; ++k) {
+				if(objects[k] == MapDocument::NO_OBJECT) continue;
+				const uint32 *tiles = objectTable.GetTiles(objects[k]);
+				for(uint32 l = objectTable.GetHeight(objects[k]); l-- != 0; ) sum += tiles[l];
+			}
+		}
+		layerObjects.push_back(MicrosecondsSince(start));
+		sums[0] = sum;
+		start = Clock::now();
+		count = 0;
+		for(vector<Cell>::const_iterator j = cells.begin(); j != cells.end(); ++j)
+			count += (j->passability != MapDocument::PASSABLE);
+		cellBlocked.push_back(MicrosecondsSince(start));
+		blocked[1] = count;
+		start = Clock::now();
+		sum = 0;
+		for(vector<Cell>::const_iterator j = cells.begin(); j != cells.end(); ++j)
+			for(vector<uint32>::const_iterator k = j->object.begin(); k != j->object.end(); ++k) sum += *k;
+		cellObjects.push_back(MicrosecondsSince(start));
+		sums[1] = sum;
+	}
+	if(blocked[0] != blocked[1] || sums[0] != sums[1]) throw exception("The layers don't match the cells");
+	// What each pass has to bring in from memory, in cache lines of 64 bytes
+	const double cellCount = double(side) * side;
+	double layerBytes = sizeof(uint32) + sizeof(uint16) + sizeof(uint8),
+		cellBytes = sizeof(Cell) + double(objectTiles) * sizeof(uint32) / cellCount;
+	char extra[256];
+	sprintf(extra, ",\"bytes_per_cell\":%.2f,\"lines_per_pass\":%.0f", layerBytes,
+		ceil(cellCount * sizeof(uint8) / 64));
+	report.Print("map_layers_passability", layerBlocked, cellCount, extra);
+	sprintf(extra, ",\"bytes_per_cell\":%.2f,\"lines_per_pass\":%.0f", cellBytes,
+		ceil(cellCount * sizeof(Cell) / 64));
+	report.Print("map_cells_passability", cellBlocked, cellCount, extra);
+	sprintf(extra, ",\"object_tiles\":%u,\"lines_per_pass\":%.0f", uint32(objectTiles),
+		ceil(cellCount * sizeof(uint16) / 64 + double(objectTable.GetCount()) * 4 * sizeof(uint32) / 64));
+	report.Print("map_layers_objects", layerObjects, cellCount, extra);
+	// Each stack of object tiles is an allocation of its own, at least a line apart from the next
+	sprintf(extra, ",\"object_tiles\":%u,\"lines_per_pass\":%.0f", uint32(objectTiles),
+		ceil(cellCount * sizeof(Cell) / 64) + objectCells);
+	report.Print("map_cells_objects", cellObjects, cellCount, extra);
+}
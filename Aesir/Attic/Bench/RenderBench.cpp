@@ -0,0 +1,112 @@
+#include "stdwx.h"
+#include "Bench.h"
+#include "../TileLoader.h"
+#include "../TileManager.h"
+#include "../SpriteBatch.h"
+#include "../MapDocument.h"
+#include "../MapRenderer.h"
+#include <cstdio>
+#include <vector>
+#include <algorithm>
+#include <exception>
+using namespace std;
+
+// Point the context at a fresh width x height buffer, and set it up to draw in pixels
+static void BeginScreen(OSMesaContext context, vector<uint8> &frameBuffer, int width, int height) {
+	frameBuffer.resize(width * height * 4);
+	if(!OSMesaMakeCurrent(context, &frameBuffer[0], GL_UNSIGNED_BYTE, width, height))
+		throw exception("Couldn't resize the OSMesa buffer");
+	glViewport(0, 0, width, height);
+	glMatrixMode(GL_PROJECTION);
+	glLoadIdentity();
+	glOrtho(0, width, height, 0, -1, 1);
+	glMatrixMode(GL_MODELVIEW);
+	glEnable(GL_TEXTURE_2D);
+}
+void BenchRender(Report &report, OSMesaContext context, uint32 iterations) {
+	// A tile chooser that fills a 1920x1080 screen, drawn tile by tile and then as a batch
+	const int width = 1920, height = 1080, cellSize = 50, columns = width / cellSize,
+		rows = height / cellSize + 1;
+	vector<uint8> frameBuffer;
+	BeginScreen(context, frameBuffer, width, height);
+	vector<TileHandle> handles;
+	for(int i = 0; i < columns * rows; ++i)
+		handles.push_back(tileManager.Request(i % TileLoader::numTiles[TypeTile], TypeTile));
+	uint32 frames = max<uint32>(1, iterations / 20);
+	vector<double> immediate, batched;
+	for(uint32 i = 0; i < frames; ++i) {
+		tileManager.UploadCompleted();
+		Clock::time_point start = Clock::now();
+		glClear(GL_COLOR_BUFFER_BIT);
+		for(int j = 0; j < columns * rows; ++j) {
+			// Every eighth tile is tinted, as if it were selected
+			if(j % 8 == 0) glColor3f(0.5, 0.5, 0.5);
+			else glColor3f(1, 1, 1);
+			handles[j]->Render((j % columns) * cellSize, (j / columns) * cellSize);
+		}
+		textureAtlas.Unbind();
+		glFinish();
+		immediate.push_back(MicrosecondsSince(start));
+	}
+	SpriteBatch spriteBatch;
+	for(uint32 i = 0; i < frames; ++i) {
+		tileManager.UploadCompleted();
+		Clock::time_point start = Clock::now();
+		glClear(GL_COLOR_BUFFER_BIT);
+		spriteBatch.Begin();
+		for(int j = 0; j < columns * rows; ++j) {
+			spriteBatch.Draw(handles[j], (j % columns) * cellSize, (j / columns) * cellSize,
+				(j % 8 == 0)?SpriteBatch::MakeTint(0x80, 0x80, 0x80):uint32(SpriteBatch::WHITE));
+		}
+		spriteBatch.End();
+		textureAtlas.Unbind();
+		glFinish();
+		batched.push_back(MicrosecondsSince(start));
+	}
+	char extra[64];
+	sprintf(extra, ",\"draw_calls_per_frame\":%u", uint32(columns * rows));
+	report.Print("render_chooser_immediate", immediate, 1, extra);
+	sprintf(extra, ",\"draw_calls_per_frame\":%u", spriteBatch.GetStats().drawCalls);
+	report.Print("render_chooser_batched", batched, 1, extra);
+}
+void BenchMapRender(Report &report, OSMesaContext context, uint32 iterations) {
+	// Pan diagonally across a small map and a huge one; a frame should cost the same on both
+	const int width = 1920, height = 1080, sides[2] = { 256, 8192 };
+	vector<uint8> frameBuffer;
+	BeginScreen(context, frameBuffer, width, height);
+	// Load the tiles up front, so that every frame below is drawn from resident tiles
+	uint32 tileCount = min<uint32>(256, TileLoader::numTiles[TypeTile]);
+	vector<TileHandle> handles;
+	for(uint32 i = 0; i < tileCount; ++i) handles.push_back(tileManager.Request(i, TypeTile));
+	for(int i = 0; i < 2; ++i) {
+		int side = sides[i];
+		MapDocument mapDocument;
+		mapDocument.GetJournal().SetMemoryCap(0);
+		for(int y = 0; y < side; ++y)
+			for(int x = 0; x < side; ++x) mapDocument.InsertTile(x, y, (x * 7 + y * 3) % tileCount);
+		MapRenderer mapRenderer;
+		vector<double> frames;
+		uint32 chunks = 0, listed = 0, rebuilt = 0;
+		int travel = side * MapRenderer::CELL_SIZE - width;
+		for(uint32 j = 0; j < iterations; ++j) {
+			int offset = int(uint64(j) * 8 % travel);
+			tileManager.UploadCompleted();
+			Clock::time_point start = Clock::now();
+			glClear(GL_COLOR_BUFFER_BIT);
+			mapRenderer.Render(mapDocument, wxRect(offset, offset * height / width, width, height));
+			glFinish();
+			frames.push_back(MicrosecondsSince(start));
+			const MapRenderer::Stats &stats = mapRenderer.GetStats();
+			chunks += stats.chunks;
+			listed += stats.listed;
+			rebuilt += stats.rebuilt;
+		}
+		char name[64], extra[160];
+		sprintf(name, "map_render_pan_%d", side);
+		sprintf(extra, ",\"map_chunks\":%u,\"chunks_per_frame\":%.1f,\"listed_per_frame\":%.1f,"
+			"\"rebuilt_per_frame\":%.2f", uint32(side / MapDocument::CHUNK_SIZE) * (side / MapDocument::CHUNK_SIZE),
+			double(chunks) / iterations, double(listed) / iterations, double(rebuilt) / iterations);
+		report.Print(name, frames, 1, extra);
+		mapRenderer.Clear();
+	}
+}
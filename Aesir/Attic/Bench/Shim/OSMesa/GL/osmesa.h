@@ -0,0 +1,10 @@
+#pragma once
+/* The part of OSMesa that the benchmark uses, for when Mesa was built without it, as newer
+ * versions are. OSMesaEGL.cpp puts it on top of a surfaceless EGL display instead. */
+#include <GL/gl.h>
+
+#define OSMESA_RGBA GL_RGBA
+typedef void *OSMesaContext;
+OSMesaContext OSMesaCreateContext(GLenum format, OSMesaContext sharelist);
+GLboolean OSMesaMakeCurrent(OSMesaContext context, void *buffer, GLenum type, GLsizei width, GLsizei height);
+void OSMesaDestroyContext(OSMesaContext context);
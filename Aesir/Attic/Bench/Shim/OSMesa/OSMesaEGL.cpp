@@ -0,0 +1,45 @@
+#include <GL/osmesa.h>
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+
+/* OSMesa on a surfaceless EGL display, which Mesa has without a window system. The frames go
+ * to a pbuffer of the same size rather than into the caller's buffer; the benchmark only times
+ * them and never reads the pixels back. There's one display and one surface at a time. */
+static EGLDisplay display = EGL_NO_DISPLAY;
+static EGLConfig config;
+static EGLSurface surface = EGL_NO_SURFACE;
+
+OSMesaContext OSMesaCreateContext(GLenum format, OSMesaContext sharelist) {
+	if(display == EGL_NO_DISPLAY) {
+		PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay =
+			(PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+		if(!getPlatformDisplay) return 0;
+		display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, 0);
+		if(display == EGL_NO_DISPLAY || !eglInitialize(display, 0, 0)) return 0;
+	}
+	const EGLint attributes[] = { EGL_SURFACE_TYPE, EGL_PBUFFER_BIT, EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+		EGL_RED_SIZE, 8, EGL_GREEN_SIZE, 8, EGL_BLUE_SIZE, 8, EGL_ALPHA_SIZE, 8, EGL_NONE };
+	EGLint count;
+	if(!eglChooseConfig(display, attributes, &config, 1, &count) || count == 0) return 0;
+	if(!eglBindAPI(EGL_OPENGL_API)) return 0;
+	EGLContext context = eglCreateContext(display, config, sharelist?(EGLContext)sharelist:EGL_NO_CONTEXT, 0);
+	return (context == EGL_NO_CONTEXT)?0:context;
+}
+GLboolean OSMesaMakeCurrent(OSMesaContext context, void *buffer, GLenum type, GLsizei width, GLsizei height) {
+	const EGLint attributes[] = { EGL_WIDTH, width, EGL_HEIGHT, height, EGL_NONE };
+	EGLSurface resized = eglCreatePbufferSurface(display, config, attributes);
+	if(resized == EGL_NO_SURFACE) return GL_FALSE;
+	if(!eglMakeCurrent(display, resized, resized, (EGLContext)context)) {
+		eglDestroySurface(display, resized);
+		return GL_FALSE;
+	}
+	if(surface != EGL_NO_SURFACE) eglDestroySurface(display, surface);
+	surface = resized;
+	return GL_TRUE;
+}
+void OSMesaDestroyContext(OSMesaContext context) {
+	eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+	if(surface != EGL_NO_SURFACE) eglDestroySurface(display, surface);
+	surface = EGL_NO_SURFACE;
+	eglDestroyContext(display, (EGLContext)context);
+}
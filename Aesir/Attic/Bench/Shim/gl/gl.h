@@ -0,0 +1,3 @@
+#pragma once
+// The sources spell the path as MSVC lets them
+#include <GL/gl.h>
@@ -0,0 +1,79 @@
+#pragma once
+/* Stands in for the editor's precompiled header when the benchmark is built without wxWidgets,
+ * on compilers other than MSVC. It brings in the library headers that the sources use, then
+ * the few wx classes that the tile and map code touches, as far as the benchmark needs them:
+ * the timer never fires, there are no windows to refresh and messages go to stderr. */
+#include <map>
+#include <deque>
+#include <string>
+#include <vector>
+#include <utility>
+#include <fstream>
+#include <ostream>
+#include <iostream>
+#include <algorithm>
+#include <exception>
+#include <stdexcept>
+#include <cmath>
+#include <cstdio>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <boost/atomic.hpp>
+#include <boost/bind.hpp>
+#include <boost/chrono.hpp>
+#include <boost/format.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/multi_array.hpp>
+#include <boost/filesystem/operations.hpp>
+#include <boost/iostreams/device/mapped_file.hpp>
+#include <boost/thread/condition.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/once.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/tss.hpp>
+#include "Global.h"
+
+class wxStopWatch {
+public:
+	inline wxStopWatch() { Start(); }
+	inline void Start() { start = boost::chrono::steady_clock::now(); }
+	inline long Time() const {
+		return long(boost::chrono::duration_cast<boost::chrono::milliseconds>(
+			boost::chrono::steady_clock::now() - start).count()); }
+private:
+	boost::chrono::steady_clock::time_point start;
+};
+class wxGLContext {
+public:
+	inline void SetCurrent() { } // The benchmark keeps its one context current itself
+};
+class wxWindow {
+public:
+	inline void Refresh(bool eraseBackground = true) { }
+};
+class wxCmdLineParser;
+class wxApp {
+public:
+	virtual ~wxApp() { }
+};
+class wxEvtHandler { };
+class wxTimerEvent { };
+class wxTimer {
+public:
+	inline wxTimer(wxEvtHandler *owner, int id) { }
+	inline void Start(int milliseconds) { }
+	inline void Stop() { }
+};
+class wxInitializer { };
+#define wxLogVerbose(...) ((void)0)
+#define DECLARE_EVENT_TABLE()
+#define BEGIN_EVENT_TABLE(theClass, baseClass)
+#define EVT_TIMER(id, function)
+#define END_EVENT_TABLE()
+#define DECLARE_DYNAMIC_CLASS(name)
+#define IMPLEMENT_DYNAMIC_CLASS(name, baseClass)
+
+/* MSVC's std::exception takes a message, and the sources throw it that way; elsewhere that's
+ * what runtime_error is for. Every standard header has to be in before this. */
+#define exception(message) runtime_error(message)
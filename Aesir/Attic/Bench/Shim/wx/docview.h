@@ -0,0 +1,54 @@
+#pragma once
+#include <string>
+#include <cstdio>
+
+class wxString : public std::string {
+public:
+	inline wxString(const char *text = "") : std::string(text) { }
+	inline const char *mb_str() const { return c_str(); }
+	inline bool IsEmpty() const { return empty(); }
+};
+class wxPoint {
+public:
+	inline wxPoint(int x_ = 0, int y_ = 0) : x(x_), y(y_) { }
+	int x, y;
+};
+class wxRect {
+public:
+	inline wxRect(int x_ = 0, int y_ = 0, int width_ = 0, int height_ = 0) : x(x_), y(y_), width(width_), height(height_) { }
+	inline int GetLeft() const { return x; }
+	inline int GetTop() const { return y; }
+	inline int GetRight() const { return x + width - 1; }
+	inline int GetBottom() const { return y + height - 1; }
+	inline int GetWidth() const { return width; }
+	inline int GetHeight() const { return height; }
+	int x, y, width, height;
+};
+class wxObject { };
+class wxView;
+class wxCommandProcessor {
+public:
+	virtual ~wxCommandProcessor() { }
+	virtual bool Undo() { return false; }
+	virtual bool Redo() { return false; }
+	virtual bool CanUndo() const { return false; }
+	virtual bool CanRedo() const { return false; }
+};
+class wxDocument {
+public:
+	inline wxDocument() : modified(false) { }
+	virtual ~wxDocument() { }
+	virtual bool OnOpenDocument(const wxString &filename) { return false; }
+	virtual bool OnSaveDocument(const wxString &filename) { return false; }
+	virtual bool OnSaveModified() { return true; }
+	virtual bool DeleteContents() { return true; }
+	virtual wxCommandProcessor *OnCreateCommandProcessor() { return 0; }
+	virtual void Modify(bool modified_) { modified = modified_; }
+	inline bool IsModified() const { return modified; }
+	inline void SetFilename(const wxString &filename, bool notifyViews = false) { }
+	inline void SetDocumentSaved(bool saved = true) { }
+	inline void UpdateAllViews(wxView *sender = 0, wxObject *hint = 0) { } // There are none
+private:
+	bool modified;
+};
+inline void wxMessageBox(const std::string &message) { fprintf(stderr, "%s\n", message.c_str()); }
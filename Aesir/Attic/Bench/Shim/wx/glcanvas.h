@@ -0,0 +1,2 @@
+#pragma once
+// The benchmark drives no canvases; wxGLContext is in stdwx.h
@@ -0,0 +1,2 @@
+#pragma once
+// wxInitializer is in stdwx.h
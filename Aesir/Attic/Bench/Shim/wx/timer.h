@@ -0,0 +1,2 @@
+#pragma once
+// wxTimer is in stdwx.h, and never fires
@@ -0,0 +1,128 @@
+#include "stdwx.h"
+#include "SyntheticData.h"
+#include "../TileLoader.h"
+#include <vector>
+#include <cstring>
+#include <fstream>
+#include <utility>
+#include <exception>
+#include <algorithm>
+#include <boost/format.hpp>
+using namespace boost;
+using namespace std;
+
+namespace {
+// A small xorshift generator, so that the output doesn't depend on the C library's rand()
+class SyntheticRandom {
+public:
+	inline SyntheticRandom(uint32 seed) : state(seed?seed:0x9E3779B9) { }
+	inline uint32 Next() {
+		state ^= state << 13;
+		state ^= state >> 17;
+		state ^= state << 5;
+		return state;
+	}
+	inline uint32 Next(uint32 low, uint32 high) { return low + Next() % (high - low + 1); }
+private:
+	uint32 state;
+};
+typedef vector<uint8> Buffer;
+template<class T> inline void Put(Buffer &buffer, T value) {
+	buffer.insert(buffer.end(), (const uint8 *)&value, (const uint8 *)&value + sizeof(T)); }
+inline void PutZeros(Buffer &buffer, uint32 count) { buffer.insert(buffer.end(), count, 0); }
+typedef vector<pair<string, Buffer> > ArchiveContents;
+// Lay the files out the way operator >>(MappedReader &, ArchiveHeader &) expects
+void WriteArchive(const string &path, const ArchiveContents &contents) {
+	uint32 count = contents.size() + 1; // The last entry marks the end of the archive
+	uint32 offset = 4 + count * (4 + 13);
+	Buffer header;
+	Put<uint32>(header, count);
+	for(uint32 i = 0; i <= contents.size(); ++i) {
+		Put<uint32>(header, offset);
+		char name[13];
+		memset(name, 0, sizeof(name));
+		if(i < contents.size()) {
+			strncpy(name, contents[i].first.c_str(), 12);
+			offset += contents[i].second.size();
+		}
+		header.insert(header.end(), name, name + 13);
+	}
+	ofstream out(path.c_str(), ios::binary | ios::trunc);
+	if(!out) throw exception("Couldn't create a synthetic archive");
+	out.write((const char *)&header[0], header.size());
+	for(ArchiveContents::const_iterator i = contents.begin(); i != contents.end(); ++i)
+		if(!i->second.empty()) out.write((const char *)&i->second[0], i->second.size());
+}
+Buffer MakePaletteSet(SyntheticRandom &random, uint32 count) {
+	Buffer buffer;
+	Put<uint8>(buffer, uint8(count));
+	PutZeros(buffer, 3);
+	for(uint32 i = 0; i < count; ++i) {
+		buffer.insert(buffer.end(), "DLPalette", "DLPalette" + 9);
+		PutZeros(buffer, 15);
+		Put<uint8>(buffer, 0); // A palette type that is followed by seven bytes of padding
+		PutZeros(buffer, 7);
+		for(int j = 0; j < 256; ++j) Put<uint32>(buffer, random.Next() & 0x00FFFFFF);
+	}
+	return buffer;
+}
+Buffer MakePaletteTable(SyntheticRandom &random, uint32 tileCount, uint32 paletteCount) {
+	Buffer buffer;
+	Put<uint16>(buffer, uint16(tileCount));
+	PutZeros(buffer, 2);
+	for(uint32 i = 0; i < tileCount; ++i) {
+		Put<uint8>(buffer, uint8(random.Next() % paletteCount));
+		Put<uint8>(buffer, 0);
+	}
+	return buffer;
+}
+/* An EPF file: the 12 byte header, then the pixel data, then the tile information. Offsets are
+ * relative to the end of the header. Objects get trimmed bounds, as they do in the real data. */
+Buffer MakeGraphics(SyntheticRandom &random, uint32 tileCount, int tileType) {
+	Buffer pixels, info;
+	for(uint32 i = 0; i < tileCount; ++i) {
+		uint16 width = 48, height = 48;
+		if(tileType == TypeObject) {
+			width = uint16(random.Next(8, 48));
+			height = uint16(random.Next(8, 48));
+		}
+		uint32 startOffset = pixels.size();
+		for(uint32 j = 0; j < uint32(width) * height; ++j) pixels.push_back(uint8(random.Next()));
+		Put<uint16>(info, 0); Put<uint16>(info, 0); // left, top
+		Put<uint16>(info, width); Put<uint16>(info, height); // right, bottom
+		Put<uint32>(info, startOffset);
+		Put<uint32>(info, uint32(pixels.size()));
+	}
+	Buffer buffer;
+	Put<uint16>(buffer, uint16(tileCount));
+	Put<uint16>(buffer, 48); Put<uint16>(buffer, 48); Put<uint16>(buffer, 0);
+	Put<uint32>(buffer, uint32(pixels.size())); // The tile information follows the pixels
+	buffer.insert(buffer.end(), pixels.begin(), pixels.end());
+	buffer.insert(buffer.end(), info.begin(), info.end());
+	return buffer;
+}
+}
+
+void GenerateSyntheticData(const string &dataPath, const SyntheticParams &params) {
+	if(params.paletteCount == 0 || params.paletteCount > 255)
+		throw exception("There must be between 1 and 255 palettes");
+	SyntheticRandom random(params.seed);
+	ArchiveContents mainContents;
+	for(int i = 0; i < 2; ++i) {
+		uint32 tileCount = params.tilesPerArchive[i] * TileLoader::GetArchiveCount(i);
+		if(tileCount > 0xFFFF) throw exception("Too many tiles for a palette table");
+		string typeName(TileLoader::GetTypeName(i));
+		mainContents.push_back(make_pair(typeName + ".pal", MakePaletteSet(random, params.paletteCount)));
+		mainContents.push_back(make_pair(typeName + ".tbl",
+			MakePaletteTable(random, tileCount, params.paletteCount)));
+	}
+	WriteArchive(dataPath + "tile.dat", mainContents);
+	for(int i = 0; i < 2; ++i) {
+		for(uint32 j = 0; j < TileLoader::GetArchiveCount(i); ++j) {
+			string fileName = (format("%1%%2%") % TileLoader::GetTypeName(i) % j).str();
+			ArchiveContents contents(1, make_pair(fileName + ".epf",
+				MakeGraphics(random, params.tilesPerArchive[i], i)));
+			WriteArchive(dataPath + fileName + ".dat", contents);
+		}
+	}
+}
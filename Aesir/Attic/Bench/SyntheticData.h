@@ -0,0 +1,18 @@
+#pragma once
+#include <string>
+
+/* Writes a made up NexusTK data directory that TileLoader can read: tile.dat with the .pal and
+ * .tbl files of both tile types, and every tileN.dat and tilecN.dat archive with an EPF file of
+ * random pixels inside. The same parameters always produce the same bytes, so results taken on
+ * different machines can be compared. */
+struct SyntheticParams {
+	uint32 tilesPerArchive[2]; // Per tile type; the .tbl format caps a type at 65535 tiles
+	uint32 paletteCount; // Per tile type, at most 255
+	uint32 seed;
+	inline SyntheticParams() : paletteCount(32), seed(1) {
+		tilesPerArchive[0] = 1024;
+		tilesPerArchive[1] = 1024;
+	}
+};
+// Generate the data files into dataPath, which must exist and end with a slash
+void GenerateSyntheticData(const std::string &dataPath, const SyntheticParams &params);
@@ -0,0 +1,280 @@
+#include "stdwx.h"
+#include <wx/init.h>
+#include "Bench.h"
+#include "SyntheticData.h"
+#include "../TileLoader.h"
+#include "../TileCache.h"
+#include "../TileManager.h"
+#include "../PaletteExpander.h"
+#include "../PipelineStats.h"
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+#include <exception>
+using namespace std;
+
+/* Headless benchmarks for the tile pipeline, run against synthetic data made by
+ * GenerateSyntheticData. GL work goes to an OSMesa context, so no display is needed. Every
+ * benchmark prints one JSON object per line with its throughput and latency percentiles. The
+ * editor's globals live in MapEditor.cpp, which isn't linked in here; mainContext stays 0, so
+ * the loader uploads through whatever context is current. After the benchmarks, the pipeline's
+ * stats are printed as one more line, under "stats". The tile benchmarks are here; the map,
+ * journal and render ones are in MapBench.cpp, JournalBench.cpp and RenderBench.cpp. */
+wxGLContext *mainContext = 0;
+
+namespace {
+// A deterministic spread of tile indices, so that runs can be compared with each other
+vector<TileIdentifier> PickTiles(uint32 count, int tileType, uint32 seed) {
+	vector<TileIdentifier> tileIdentifiers;
+	for(uint32 i = 0; i < count; ++i) {
+		seed = seed * 1664525 + 1013904223;
+		tileIdentifiers.push_back(TileIdentifier((seed >> 8) % TileLoader::numTiles[tileType], tileType));
+	}
+	return tileIdentifiers;
+}
+
+void BenchInit(Report &report, const string &dataPath, uint32 iterations) {
+	vector<double> latencies;
+	for(uint32 i = 0; i < iterations; ++i) {
+		TileLoader *loader = new TileLoader;
+		loader->SetDataPath(dataPath);
+		loader->EnableCache(false);
+		Clock::time_point start = Clock::now();
+		loader->Init();
+		latencies.push_back(MicrosecondsSince(start));
+		delete loader;
+	}
+	report.Print("init", latencies, 1);
+	// The warm start, out of a cache built from the same data
+	TileCache::Build(tileLoader, tileLoader.GetCachePath());
+	latencies.clear();
+	for(uint32 i = 0; i < iterations; ++i) {
+		TileLoader *loader = new TileLoader;
+		loader->SetDataPath(dataPath);
+		Clock::time_point start = Clock::now();
+		loader->Init();
+		latencies.push_back(MicrosecondsSince(start));
+		if(!loader->IsCached()) throw exception("The tile cache wasn't used");
+		delete loader;
+	}
+	report.Print("init_cached", latencies, 1);
+}
+void BenchDecode(Report &report, uint32 iterations) {
+	vector<TileLoader::DecodedTile> tiles;
+	vector<uint32> staging;
+	for(int tileType = 0; tileType < 2; ++tileType) {
+		const char *names[2][2] = { { "decode_tile", "decode_tile_batch64" },
+			{ "decode_object", "decode_object_batch64" } };
+		vector<TileIdentifier> picks = PickTiles(iterations * 64, tileType, 7);
+		vector<double> single, batched;
+		for(uint32 i = 0; i < iterations; ++i) {
+			vector<TileIdentifier> one(1, picks[i]);
+			Clock::time_point start = Clock::now();
+			tileLoader.DecodeBatch(one, tiles, staging);
+			single.push_back(MicrosecondsSince(start));
+			vector<TileIdentifier> batch(picks.begin() + i * 64, picks.begin() + (i + 1) * 64);
+			start = Clock::now();
+			tileLoader.DecodeBatch(batch, tiles, staging);
+			batched.push_back(MicrosecondsSince(start));
+		}
+		report.Print(names[tileType][0], single, 1);
+		report.Print(names[tileType][1], batched, 64);
+	}
+}
+void BenchExpandPalette(Report &report, uint32 iterations) {
+	// A kernel that disagrees would never be picked, but it would be a bug all the same
+	if(const char *kernel = VerifyPaletteKernels())
+		throw exception((string("The ") + kernel + " palette kernel disagrees with the scalar one").c_str());
+	const uint32 count = 48 * 48;
+	vector<uint8> indices(count);
+	vector<uint32> pixels(count), lut(256);
+	for(uint32 i = 0; i < count; ++i) indices[i] = uint8(i * 31);
+	for(uint32 i = 0; i < 256; ++i) lut[i] = i * 0x01010101;
+	vector<double> scalar, dispatched;
+	for(uint32 i = 0; i < iterations; ++i) {
+		Clock::time_point start = Clock::now();
+		ExpandPaletteScalar(&indices[0], &pixels[0], count, &lut[0]);
+		scalar.push_back(MicrosecondsSince(start));
+		start = Clock::now();
+		ExpandPalette(&indices[0], &pixels[0], count, &lut[0]);
+		dispatched.push_back(MicrosecondsSince(start));
+	}
+	report.Print("expand_palette_scalar", scalar, count);
+	report.Print(string("expand_palette_") + GetPaletteKernelName(), dispatched, count);
+}
+void BenchLoad(Report &report, uint32 iterations) {
+	vector<TileIdentifier> picks = PickTiles(iterations * 64, TypeTile, 11);
+	vector<TextureAtlas::Slot> slots;
+	vector<TileLoader::TileMetrics> metrics;
+	vector<double> single, batched;
+	for(uint32 i = 0; i < iterations; ++i) {
+		uint32 width, height;
+		Clock::time_point start = Clock::now();
+		TextureAtlas::Slot slot = tileLoader.Load(picks[i], width, height);
+		glFinish();
+		single.push_back(MicrosecondsSince(start));
+		textureAtlas.Remove(slot);
+		vector<TileIdentifier> batch(picks.begin() + i * 64, picks.begin() + (i + 1) * 64);
+		start = Clock::now();
+		tileLoader.LoadBatch(batch, slots, metrics);
+		glFinish();
+		batched.push_back(MicrosecondsSince(start));
+		for(vector<TextureAtlas::Slot>::iterator j = slots.begin(); j != slots.end(); ++j)
+			textureAtlas.Remove(*j);
+	}
+	report.Print("load_tile", single, 1);
+	report.Print("load_tile_batch64", batched, 64);
+}
+void BenchRequest(Report &report, uint32 iterations) {
+	// Misses: every request is for a tile that isn't resident, so it goes all the way to GL
+	uint32 missCount = min<uint32>(iterations, TileLoader::numTiles[TypeTile]);
+	vector<TileHandle> handles;
+	vector<double> misses, hits;
+	tileManager.Flush();
+	for(uint32 i = 0; i < missCount; ++i) {
+		Clock::time_point start = Clock::now();
+		handles.push_back(tileManager.Request(i, TypeTile));
+		misses.push_back(MicrosecondsSince(start));
+	}
+	report.Print("request_miss", misses, 1);
+	// Hits: the same tiles again, while the handles above keep them resident
+	for(uint32 i = 0; i < iterations; ++i) {
+		Clock::time_point start = Clock::now();
+		TileHandle handle = tileManager.Request(i % missCount, TypeTile);
+		hits.push_back(MicrosecondsSince(start));
+	}
+	report.Print("request_hit", hits, 1);
+	/* Revivals: the handles are gone, but the tiles stay resident within the budget, so
+	 * requesting them again only takes them back off the LRU list */
+	handles.clear();
+	vector<double> revivals;
+	for(uint32 i = 0; i < missCount; ++i) {
+		Clock::time_point start = Clock::now();
+		TileHandle handle = tileManager.Request(i, TypeTile);
+		revivals.push_back(MicrosecondsSince(start));
+	}
+	report.Print("request_revive", revivals, 1);
+	// Time the flush that frees everything
+	vector<double> flush;
+	Clock::time_point start = Clock::now();
+	tileManager.Flush();
+	flush.push_back(MicrosecondsSince(start));
+	report.Print("flush", flush, missCount);
+}
+void BenchResidency(Report &report, uint32 iterations) {
+	// Load the same tiles expanded and as indices, and compare what it costs to keep them resident
+	const char *names[2][2] = { { "request_miss_tile", "request_miss_tile_indexed" },
+		{ "request_miss_object", "request_miss_object_indexed" } };
+	for(int tileType = 0; tileType < 2; ++tileType) {
+		uint32 count = min<uint32>(iterations, TileLoader::numTiles[tileType]);
+		if(count == 0) continue;
+		uint32 residentBytes[2];
+		for(int indexed = 0; indexed < 2; ++indexed) {
+			tileManager.Flush();
+			tileManager.SetResidency(indexed?TileManager::RESIDENCY_INDEXED:TileManager::RESIDENCY_RGBA);
+			vector<TileHandle> handles;
+			vector<double> misses;
+			for(uint32 i = 0; i < count; ++i) {
+				Clock::time_point start = Clock::now();
+				handles.push_back(tileManager.Request(i, tileType));
+				misses.push_back(MicrosecondsSince(start));
+			}
+			report.Print(names[tileType][indexed], misses, 1);
+			TileManager::Stats stats = tileManager.GetStats();
+			residentBytes[indexed] = stats.textureBytes + stats.memoryBytes;
+			if(!indexed) continue;
+			// The first draw of an indexed tile expands it into the working set
+			vector<double> draws;
+			for(uint32 i = 0; i < count; ++i) {
+				Clock::time_point start = Clock::now();
+				handles[i]->Render(0, 0);
+				draws.push_back(MicrosecondsSince(start));
+			}
+			glFinish();
+			textureAtlas.Unbind();
+			report.Print(tileType?"draw_expand_object":"draw_expand_tile", draws, 1);
+		}
+		report.PrintResidency(tileType?"residency_object":"residency_tile",
+			count, residentBytes[0], residentBytes[1]);
+	}
+	tileManager.Flush();
+	tileManager.SetResidency(TileManager::RESIDENCY_RGBA);
+}
+
+void Usage() {
+	fprintf(stderr,
+		"usage: TileBench generate <data directory> [--tiles n] [--objects n] [--palettes n] [--seed n]\n"
+		"       TileBench run <data directory> [--iterations n] [--output file] [--trace file]\n");
+	exit(2);
+}
+}
+
+int main(int argc, char **argv) {
+	if(argc < 3) Usage();
+	string command(argv[1]), dataPath(argv[2]);
+	if(dataPath[dataPath.size() - 1] != '/') dataPath += '/';
+	SyntheticParams params;
+	uint32 iterations = 1000;
+	string outputPath, tracePath;
+	for(int i = 3; i + 1 < argc; i += 2) {
+		string option(argv[i]);
+		uint32 value = strtoul(argv[i + 1], 0, 10);
+		if(option == "--tiles") params.tilesPerArchive[TypeTile] = value;
+		else if(option == "--objects") params.tilesPerArchive[TypeObject] = value;
+		else if(option == "--palettes") params.paletteCount = value;
+		else if(option == "--seed") params.seed = value;
+		else if(option == "--iterations") iterations = max<uint32>(1, value);
+		else if(option == "--output") outputPath = argv[i + 1];
+		else if(option == "--trace") tracePath = argv[i + 1];
+		else Usage();
+	}
+	try {
+		if(command == "generate") {
+			GenerateSyntheticData(dataPath, params);
+			return 0;
+		}
+		if(command != "run") Usage();
+		wxInitializer initializer; // For the stopwatches and timers that the loader uses
+		vector<uint8> frameBuffer(64 * 64 * 4);
+		OSMesaContext context = OSMesaCreateContext(OSMESA_RGBA, 0);
+		if(!context || !OSMesaMakeCurrent(context, &frameBuffer[0], GL_UNSIGNED_BYTE, 64, 64))
+			throw exception("Couldn't create an OSMesa context");
+		ofstream outputFile;
+		if(!outputPath.empty()) outputFile.open(outputPath.c_str());
+		ostream &out = outputPath.empty()?cout:outputFile;
+		Report report(out);
+		if(!tracePath.empty()) pipelineStats.StartTrace(tracePath);
+		tileLoader.SetDataPath(dataPath);
+		tileLoader.EnableCache(false);
+		tileLoader.Init();
+		BenchInit(report, dataPath, max<uint32>(1, iterations / 100));
+		BenchDecode(report, iterations);
+		BenchExpandPalette(report, iterations);
+		BenchLoad(report, iterations);
+		BenchRequest(report, iterations);
+		BenchResidency(report, iterations);
+		BenchRender(report, context, iterations);
+		BenchMap(report, dataPath, iterations);
+		BenchMapJournal(report, iterations);
+		BenchMapEdit(report, iterations);
+		BenchMapIndex(report, iterations);
+		BenchMapLayers(report, iterations);
+		BenchMapRender(report, context, iterations);
+		pipelineStats.StopTrace();
+		PipelineStats::Snapshot snapshot;
+		pipelineStats.GetSnapshot(snapshot);
+		out << "{\"stats\":";
+		PipelineStats::WriteJson(out, snapshot);
+		out << "}" << endl;
+		tileManager.Shutdown();
+		OSMesaDestroyContext(context);
+	} catch(exception &e) {
+		fprintf(stderr, "%s\n", e.what());
+		return 1;
+	}
+	return 0;
+}
@@ -2,9 +2,11 @@
 
 /* Most of these are for use in the TileLoader class, where they
  * are clearer and more concise than C++'s regular datatypes */
+typedef unsigned long long uint64;
 typedef unsigned int uint32;
 typedef unsigned short uint16;
 typedef unsigned char uint8;
+typedef signed long long int64;
 typedef signed int int32;
 typedef signed short int16;
 typedef signed char int8;
\ No newline at end of file
@@ -26,6 +26,11 @@ MainFrame::MainFrame() : wxDocMDIParentFrame(docManager, 0, -1, "MapEditor") {
 	menuFile->Append(wxID_OPEN, "&Open");
 	menuFile->Append(wxID_EXIT, "&Exit");
 	menuBar->Append(menuFile, "&File");
+	// The document manager hands these to the command processor of the active map
+	wxMenu *menuEdit = new wxMenu();
+	menuEdit->Append(wxID_UNDO, "&Undo\tCtrl+Z");
+	menuEdit->Append(wxID_REDO, "&Redo\tCtrl+Y");
+	menuBar->Append(menuEdit, "&Edit");
 	this->SetMenuBar(menuBar);
 	// TODO: Move this into the application class
 	try { tileLoader.Init(); } // TODO: Better error handling
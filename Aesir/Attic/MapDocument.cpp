@@ -1,3 +1,742 @@
 #include "stdwx.h"
 #include "MapDocument.h"
-IMPLEMENT_DYNAMIC_CLASS(MapDocument, wxDocument)
\ No newline at end of file
+#include <cstring>
+#include <exception>
+#include <algorithm>
+#include <boost/bind.hpp>
+#include <boost/atomic.hpp>
+#include <boost/thread/thread.hpp>
+using namespace std;
+IMPLEMENT_DYNAMIC_CLASS(MapDocument, wxDocument)
+
+/* A square of 2^level by 2^level chunks. Quadrants of level 0 are the leaves, and hold a chunk
+ * each; the others hold up to four children, in the order top left, top right, bottom left,
+ * bottom right. Quadrants that would be empty aren't kept at all. */
+class MapDocument::Quadrant {
+public:
+	int left, top; // In chunks
+	int level;
+	Quadrant *children[4];
+	Chunk *chunk;
+	inline Quadrant(int left_, int top_, int level_) : left(left_), top(top_), level(level_), chunk(0) {
+		children[0] = children[1] = children[2] = children[3] = 0; }
+	inline bool Contains(int chunkX, int chunkY) const {
+		return (uint32(chunkX - left) >> level) == 0 && (uint32(chunkY - top) >> level) == 0; }
+	inline bool Overlaps(int left_, int top_, int right_, int bottom_) const {
+		int size = 1 << level;
+		return left_ < left + size && right_ >= left && top_ < top + size && bottom_ >= top;
+	}
+	inline int GetChild(int chunkX, int chunkY) const {
+		int shift = level - 1;
+		return (((chunkX - left) >> shift) & 1) | ((((chunkY - top) >> shift) & 1) << 1);
+	}
+};
+
+// Hands the Edit menu's Undo and Redo to the document, in place of a list of commands
+class MapDocument::History : public wxCommandProcessor {
+public:
+	inline History(MapDocument *mapDocument_) : mapDocument(mapDocument_) { }
+	bool Undo() { return mapDocument->Undo(); }
+	bool Redo() { return mapDocument->Redo(); }
+	bool CanUndo() const { return mapDocument->CanUndo(); }
+	bool CanRedo() const { return mapDocument->CanRedo(); }
+private:
+	MapDocument *mapDocument;
+};
+
+// The part of a paint that falls in one chunk, and the edits that it made there
+struct MapDocument::ChunkPainting {
+	Chunk *chunk;
+	int left, top, right, bottom; // The cells to paint, inclusive
+	MapJournal::Batch batch;
+	bool changed;
+	std::vector<Chunk::TileCount> before; // Only kept while the usage is being counted
+};
+struct MapDocument::Painting {
+	wxRect area;
+	const uint32 *pattern;
+	int width, height;
+	bool transparent; // Whether the pattern's NO_TILE cells are skipped, rather than erased
+	std::vector<ChunkPainting> chunks;
+	boost::atomic<uint32> nextChunk;
+	inline Painting(const wxRect &area_, const uint32 *pattern_, int width_, int height_, bool transparent_) :
+		area(area_), pattern(pattern_), width(width_), height(height_), transparent(transparent_), nextChunk(0) { }
+};
+
+static inline bool TileBefore(const MapDocument::Chunk::TileCount &tileCount, uint32 tileIndex) {
+	return tileCount.tile < tileIndex; }
+
+MapDocument::Chunk::Chunk(int left_, int top_) : left(left_), top(top_), count(0), marked(0), dirty(false),
+	version(0) {
+	for(int i = 0; i < CHUNK_SIZE * CHUNK_SIZE; ++i) tiles[i] = NO_TILE;
+	memset(objects, 0, sizeof(objects));
+	memset(passability, PASSABLE, sizeof(passability));
+}
+uint32 MapDocument::Chunk::GetCell(int cell, Layer layer) const {
+	if(layer == LAYER_FLOOR) return tiles[cell];
+	return (layer == LAYER_OBJECTS)?objects[cell]:passability[cell];
+}
+void MapDocument::Chunk::SetCell(int cell, Layer layer, uint32 value) {
+	if(layer == LAYER_FLOOR) {
+		SetTile(cell, value);
+		return;
+	}
+	bool wasMarked = (objects[cell] != NO_OBJECT || passability[cell] != PASSABLE);
+	if(layer == LAYER_OBJECTS) objects[cell] = uint16(value);
+	else passability[cell] = uint8(value);
+	bool isMarked = (objects[cell] != NO_OBJECT || passability[cell] != PASSABLE);
+	if(isMarked && !wasMarked) ++marked;
+	else if(wasMarked && !isMarked) --marked;
+}
+void MapDocument::Chunk::CountCells() {
+	count = marked = 0;
+	for(int i = 0; i < CHUNK_SIZE * CHUNK_SIZE; ++i) {
+		if(tiles[i] != NO_TILE) ++count;
+		if(objects[i] != NO_OBJECT || passability[i] != PASSABLE) ++marked;
+	}
+}
+const MapDocument::Chunk::TileCount *MapDocument::Chunk::FindUsage(uint32 tileIndex) const {
+	vector<TileCount>::const_iterator tileCount = lower_bound(usage.begin(), usage.end(), tileIndex, TileBefore);
+	return (tileCount != usage.end() && tileCount->tile == tileIndex)?&*tileCount:0;
+}
+void MapDocument::Chunk::SetTile(int cell, uint32 tileIndex) {
+	uint32 &tile = tiles[cell];
+	if(tile == tileIndex) return;
+	if(tile == NO_TILE) ++count;
+	else if(tileIndex == NO_TILE) --count;
+	if(!links.empty()) {
+		if(tile != NO_TILE) Unlink(cell, tile);
+		if(tileIndex != NO_TILE) Link(cell, tileIndex);
+	}
+	tile = tileIndex;
+}
+void MapDocument::Chunk::Index() {
+	usage.clear();
+	links.resize(2 * CHUNK_SIZE * CHUNK_SIZE);
+	// Sorting the cells by tile brings each tile's cells together, in order, to be linked as a run
+	uint64 cells[CHUNK_SIZE * CHUNK_SIZE];
+	int size = 0;
+	for(int cell = 0; cell < CHUNK_SIZE * CHUNK_SIZE; ++cell)
+		if(tiles[cell] != NO_TILE) cells[size++] = (uint64(tiles[cell]) << 16) | cell;
+	sort(cells, cells + size);
+	uint16 *next = &links[0], *previous = next + CHUNK_SIZE * CHUNK_SIZE;
+	for(int i = 0; i < size; ++i) {
+		uint16 cell = uint16(cells[i]);
+		bool first = (i == 0 || (cells[i] >> 16) != (cells[i - 1] >> 16));
+		bool last = (i == size - 1 || (cells[i] >> 16) != (cells[i + 1] >> 16));
+		previous[cell] = first?NO_CELL:uint16(cells[i - 1]);
+		next[cell] = last?NO_CELL:uint16(cells[i + 1]);
+		if(first) {
+			TileCount tileCount = { uint32(cells[i] >> 16), 0, cell };
+			usage.push_back(tileCount);
+		}
+		++usage.back().count;
+	}
+}
+void MapDocument::Chunk::Link(int cell, uint32 tileIndex) {
+	vector<TileCount>::iterator tileCount = lower_bound(usage.begin(), usage.end(), tileIndex, TileBefore);
+	if(tileCount == usage.end() || tileCount->tile != tileIndex) {
+		TileCount added = { tileIndex, 0, NO_CELL };
+		tileCount = usage.insert(tileCount, added);
+	}
+	uint16 *next = &links[0], *previous = next + CHUNK_SIZE * CHUNK_SIZE;
+	next[cell] = tileCount->first;
+	previous[cell] = NO_CELL;
+	if(tileCount->first != NO_CELL) previous[tileCount->first] = uint16(cell);
+	tileCount->first = uint16(cell);
+	++tileCount->count;
+}
+void MapDocument::Chunk::Unlink(int cell, uint32 tileIndex) {
+	vector<TileCount>::iterator tileCount = lower_bound(usage.begin(), usage.end(), tileIndex, TileBefore);
+	uint16 *next = &links[0], *previous = next + CHUNK_SIZE * CHUNK_SIZE;
+	if(previous[cell] != NO_CELL) next[previous[cell]] = next[cell];
+	else tileCount->first = next[cell];
+	if(next[cell] != NO_CELL) previous[next[cell]] = previous[cell];
+	if(--tileCount->count == 0) usage.erase(tileCount);
+}
+MapDocument::ChunkIterator::ChunkIterator(const MapDocument &mapDocument, const wxRect &area) :
+	depth(0), chunk(0) {
+	if(area.GetWidth() <= 0 || area.GetHeight() <= 0) return;
+	left = area.GetLeft() >> CHUNK_SHIFT;
+	top = area.GetTop() >> CHUNK_SHIFT;
+	right = area.GetRight() >> CHUNK_SHIFT;
+	bottom = area.GetBottom() >> CHUNK_SHIFT;
+	if(mapDocument.root && mapDocument.root->Overlaps(left, top, right, bottom))
+		stack[depth++] = mapDocument.root;
+	++(*this);
+}
+MapDocument::ChunkIterator &MapDocument::ChunkIterator::operator++() {
+	chunk = 0;
+	while(depth) {
+		const Quadrant *quadrant = stack[--depth];
+		if(quadrant->level == 0) {
+			chunk = quadrant->chunk;
+			break;
+		}
+		for(int i = 3; i >= 0; --i) {
+			const Quadrant *child = quadrant->children[i];
+			if(child && child->Overlaps(left, top, right, bottom)) stack[depth++] = child;
+		}
+	}
+	return *this;
+}
+
+wxObject MapDocument::contentsReplaced;
+
+MapDocument::MapDocument() : root(0), lastChunk(0), chunkCount(0), quadrantCount(0), lastVersion(0),
+	usageCounted(false) { }
+MapDocument::~MapDocument() { Free(root); }
+bool MapDocument::OnOpenDocument(const wxString &filename) {
+	if(!OnSaveModified()) return false;
+	try { Open(string(filename.mb_str())); }
+	catch(exception &e) {
+		wxMessageBox(e.what());
+		return false;
+	}
+	SetFilename(filename, true);
+	Modify(false);
+	SetDocumentSaved(true);
+	UpdateAllViews();
+	return true;
+}
+bool MapDocument::OnSaveDocument(const wxString &filename) {
+	if(filename.IsEmpty()) return false;
+	try { Save(string(filename.mb_str())); }
+	catch(exception &e) {
+		wxMessageBox(e.what());
+		return false;
+	}
+	Modify(false);
+	SetFilename(filename);
+	SetDocumentSaved(true);
+	return true;
+}
+void MapDocument::Open(const string &path) {
+	DeleteContents();
+	file.Open(path);
+	try { file.ReadObjects(objects); }
+	catch(...) {
+		file.Close();
+		throw;
+	}
+}
+void MapDocument::Save(const string &path) {
+	vector<Chunk *> chunks;
+	GetChunks(root, chunks);
+	vector<MapFile::Change> changes;
+	for(vector<Chunk *>::iterator i = chunks.begin(); i != chunks.end(); ++i) {
+		if(!(*i)->dirty) continue;
+		MapFile::Change change = { (*i)->left >> CHUNK_SHIFT, (*i)->top >> CHUNK_SHIFT,
+			(*i)->IsEmpty()?0:(*i)->tiles, (*i)->objects, (*i)->passability };
+		changes.push_back(change);
+	}
+	file.Save(path, changes, objects);
+	for(vector<Chunk *>::iterator i = chunks.begin(); i != chunks.end(); ++i) {
+		(*i)->dirty = false;
+		// Chunks that were emptied were only kept to take them out of the file
+		if((*i)->IsEmpty()) RemoveChunk((*i)->left >> CHUNK_SHIFT, (*i)->top >> CHUNK_SHIFT);
+	}
+}
+bool MapDocument::DeleteContents() {
+	Free(root);
+	root = 0;
+	lastChunk = 0;
+	file.Close();
+	journal.Clear();
+	objects.Clear();
+	usage.clear();
+	usageCounted = false;
+	UpdateAllViews(0, &contentsReplaced);
+	return true;
+}
+wxCommandProcessor *MapDocument::OnCreateCommandProcessor() {
+	return new History(this);
+}
+void MapDocument::InsertTile(int x, int y, uint32 tileIndex) {
+	InsertCell(x, y, LAYER_FLOOR, tileIndex);
+}
+void MapDocument::InsertObject(int x, int y, uint16 object) {
+	InsertCell(x, y, LAYER_OBJECTS, object);
+}
+void MapDocument::SetPassability(int x, int y, uint8 passability) {
+	InsertCell(x, y, LAYER_PASSABILITY, passability);
+}
+void MapDocument::InsertCell(int x, int y, Layer layer, uint32 value) {
+	uint32 previous = PutCell(x, y, layer, value);
+	if(previous != value) journal.Record(x, y, previous, value, uint8(layer));
+}
+bool MapDocument::Undo() {
+	if(!journal.Undo(replay)) return false;
+	Replay(true);
+	UpdateAllViews();
+	return true;
+}
+bool MapDocument::Redo() {
+	if(!journal.Redo(replay)) return false;
+	Replay(false);
+	UpdateAllViews();
+	return true;
+}
+void MapDocument::FillRect(const wxRect &area, uint32 tileIndex) {
+	Painting painting(area, &tileIndex, 1, 1, false);
+	Paint(painting);
+}
+void MapDocument::PaintPattern(const wxRect &area, const uint32 *pattern, int width, int height) {
+	if(width <= 0 || height <= 0) return;
+	Painting painting(area, pattern, width, height, true);
+	Paint(painting);
+}
+void MapDocument::FloodFill(int x, int y, uint32 tileIndex, const wxRect &bounds) {
+	if(x < bounds.GetLeft() || x > bounds.GetRight() || y < bounds.GetTop() || y > bounds.GetBottom()) return;
+	uint32 target = GetTile(x, y);
+	if(target == tileIndex) return;
+	MapJournal::Batch batch;
+	ChangedChunks changed;
+	Chunk *chunk = 0;
+	// Fill a row at a time, and look for the runs of cells still to fill above and below it
+	vector<pair<int, int> > seeds(1, make_pair(x, y));
+	while(!seeds.empty()) {
+		int seedX = seeds.back().first, seedY = seeds.back().second;
+		seeds.pop_back();
+		if(GetTile(seedX, seedY) != target) continue; // Filled since it was seen
+		int left = seedX, right = seedX;
+		while(left > bounds.GetLeft() && GetTile(left - 1, seedY) == target) --left;
+		while(right < bounds.GetRight() && GetTile(right + 1, seedY) == target) ++right;
+		for(int i = left; i <= right; ++i) {
+			uint32 previous = WriteCell(i, seedY, LAYER_FLOOR, tileIndex, chunk, changed);
+			if(journal.IsEnabled()) batch.Record(i, seedY, previous, tileIndex);
+		}
+		for(int rowY = seedY - 1; rowY <= seedY + 1; rowY += 2) {
+			if(rowY < bounds.GetTop() || rowY > bounds.GetBottom()) continue;
+			bool run = false;
+			for(int i = left; i <= right; ++i) {
+				bool matches = (GetTile(i, rowY) == target);
+				if(matches && !run) seeds.push_back(make_pair(i, rowY));
+				run = matches;
+			}
+		}
+	}
+	Settle(changed);
+	journal.Append(batch);
+}
+void MapDocument::Paint(Painting &painting) {
+	const wxRect &area = painting.area;
+	if(area.GetWidth() <= 0 || area.GetHeight() <= 0) return;
+	// A paint with no tiles in it can only erase, and there's nothing to erase where there's no chunk
+	bool paints = false;
+	for(int i = 0; i < painting.width * painting.height; ++i)
+		if(painting.pattern[i] != NO_TILE) paints = true;
+	if(!paints && painting.transparent) return;
+	int left = area.GetLeft() >> CHUNK_SHIFT, top = area.GetTop() >> CHUNK_SHIFT,
+		right = area.GetRight() >> CHUNK_SHIFT, bottom = area.GetBottom() >> CHUNK_SHIFT;
+	for(int chunkY = top; chunkY <= bottom; ++chunkY) {
+		for(int chunkX = left; chunkX <= right; ++chunkX) {
+			Chunk *chunk = RequireChunk(chunkX, chunkY);
+			if(!chunk) {
+				if(!paints) continue;
+				chunk = CreateChunk(chunkX, chunkY);
+			}
+			ChunkPainting chunkPainting;
+			chunkPainting.chunk = chunk;
+			chunkPainting.changed = false;
+			if(usageCounted) chunkPainting.before = chunk->usage;
+			chunkPainting.left = max(area.GetLeft(), chunk->left);
+			chunkPainting.top = max(area.GetTop(), chunk->top);
+			chunkPainting.right = min(area.GetRight(), chunk->left + CHUNK_SIZE - 1);
+			chunkPainting.bottom = min(area.GetBottom(), chunk->top + CHUNK_SIZE - 1);
+			painting.chunks.push_back(chunkPainting);
+		}
+	}
+	// Every chunk is painted on its own, so they can go in any order, on any thread
+	uint32 painters = min<uint32>(boost::thread::hardware_concurrency(), painting.chunks.size() / PARALLEL_CHUNKS);
+	if(painters > 1) {
+		boost::thread_group threads;
+		for(uint32 i = 0; i < painters; ++i)
+			threads.create_thread(boost::bind(&MapDocument::PaintChunks, this, &painting));
+		threads.join_all();
+	} else PaintChunks(&painting);
+	bool changed = false;
+	journal.BeginStep();
+	for(vector<ChunkPainting>::iterator i = painting.chunks.begin(); i != painting.chunks.end(); ++i) {
+		Chunk *chunk = i->chunk;
+		if(i->changed) {
+			chunk->dirty = true;
+			chunk->version = ++lastVersion;
+			journal.Append(i->batch);
+			if(usageCounted) Recount(*chunk, i->before);
+			changed = true;
+		}
+		int chunkX = chunk->left >> CHUNK_SHIFT, chunkY = chunk->top >> CHUNK_SHIFT;
+		if(chunk->IsEmpty() && !file.Find(chunkX, chunkY)) RemoveChunk(chunkX, chunkY);
+	}
+	journal.EndStep();
+	if(changed) Modify(true);
+}
+void MapDocument::PaintChunks(Painting *painting) {
+	const wxRect &area = painting->area;
+	bool record = journal.IsEnabled();
+	for(uint32 i = painting->nextChunk++; i < painting->chunks.size(); i = painting->nextChunk++) {
+		ChunkPainting &chunkPainting = painting->chunks[i];
+		Chunk &chunk = *chunkPainting.chunk;
+		for(int y = chunkPainting.top; y <= chunkPainting.bottom; ++y) {
+			const uint32 *pattern = painting->pattern + ((y - area.GetTop()) % painting->height) * painting->width;
+			int row = (y - chunk.top) << CHUNK_SHIFT;
+			int column = (chunkPainting.left - area.GetLeft()) % painting->width;
+			for(int x = chunkPainting.left; x <= chunkPainting.right; ++x) {
+				uint32 tileIndex = pattern[column];
+				if(++column == painting->width) column = 0;
+				int cell = row | (x - chunk.left);
+				uint32 tile = chunk.tiles[cell];
+				if(tile == tileIndex || (tileIndex == NO_TILE && painting->transparent)) continue;
+				if(record) chunkPainting.batch.Record(x, y, tile, tileIndex);
+				chunk.SetTile(cell, tileIndex);
+				chunkPainting.changed = true;
+			}
+		}
+	}
+}
+uint32 MapDocument::WriteCell(int x, int y, Layer layer, uint32 value, Chunk *&chunk, ChangedChunks &changed) {
+	int chunkX = x >> CHUNK_SHIFT, chunkY = y >> CHUNK_SHIFT;
+	if(!chunk || chunk->left != chunkX * CHUNK_SIZE || chunk->top != chunkY * CHUNK_SIZE) {
+		chunk = RequireChunk(chunkX, chunkY);
+		if(!chunk) {
+			if(value == GetEmpty(layer)) return value;
+			chunk = CreateChunk(chunkX, chunkY);
+		}
+		Touch(chunk, changed);
+	}
+	int cell = ((y & (CHUNK_SIZE - 1)) << CHUNK_SHIFT) | (x & (CHUNK_SIZE - 1));
+	uint32 previous = chunk->GetCell(cell, layer);
+	chunk->SetCell(cell, layer, value);
+	return previous;
+}
+void MapDocument::Touch(Chunk *chunk, ChangedChunks &changed) {
+	if(changed.find(chunk) != changed.end()) return;
+	vector<Chunk::TileCount> &before = changed[chunk];
+	if(usageCounted) before = chunk->usage;
+}
+void MapDocument::Settle(const ChangedChunks &changed) {
+	// Emptied chunks were kept until now, since the edit held on to them
+	for(ChangedChunks::const_iterator i = changed.begin(); i != changed.end(); ++i) {
+		Chunk *chunk = i->first;
+		chunk->dirty = true;
+		chunk->version = ++lastVersion;
+		if(usageCounted) Recount(*chunk, i->second);
+		int chunkX = chunk->left >> CHUNK_SHIFT, chunkY = chunk->top >> CHUNK_SHIFT;
+		if(chunk->IsEmpty() && !file.Find(chunkX, chunkY)) RemoveChunk(chunkX, chunkY);
+	}
+	if(!changed.empty()) Modify(true);
+}
+void MapDocument::Replay(bool undo) {
+	ChangedChunks changed;
+	Chunk *chunk = 0;
+	// Undo goes backwards, in case the step changed a cell more than once
+	if(undo) {
+		for(vector<MapJournal::Edit>::reverse_iterator i = replay.rbegin(); i != replay.rend(); ++i)
+			WriteCell(i->x, i->y, Layer(i->layer), i->before, chunk, changed);
+	} else {
+		for(vector<MapJournal::Edit>::iterator i = replay.begin(); i != replay.end(); ++i)
+			WriteCell(i->x, i->y, Layer(i->layer), i->after, chunk, changed);
+	}
+	Settle(changed);
+}
+uint32 MapDocument::GetEmpty(Layer layer) {
+	if(layer == LAYER_FLOOR) return NO_TILE;
+	return (layer == LAYER_OBJECTS)?uint32(NO_OBJECT):uint32(PASSABLE);
+}
+uint32 MapDocument::PutCell(int x, int y, Layer layer, uint32 value) {
+	int chunkX = x >> CHUNK_SHIFT, chunkY = y >> CHUNK_SHIFT;
+	Chunk *chunk = RequireChunk(chunkX, chunkY);
+	if(!chunk) {
+		if(value == GetEmpty(layer)) return value; // It's empty already
+		chunk = CreateChunk(chunkX, chunkY);
+	}
+	int cell = ((y & (CHUNK_SIZE - 1)) << CHUNK_SHIFT) | (x & (CHUNK_SIZE - 1));
+	uint32 previous = chunk->GetCell(cell, layer);
+	if(previous == value) return previous;
+	chunk->SetCell(cell, layer, value);
+	if(usageCounted && layer == LAYER_FLOOR) {
+		const Chunk::TileCount *tileCount;
+		if(previous != NO_TILE) {
+			uint32 after = (tileCount = chunk->FindUsage(previous))?tileCount->count:0;
+			Recount(*chunk, previous, after + 1, after);
+		}
+		if(value != NO_TILE) {
+			uint32 after = chunk->FindUsage(value)->count;
+			Recount(*chunk, value, after - 1, after);
+		}
+	}
+	chunk->dirty = true;
+	chunk->version = ++lastVersion;
+	Modify(true);
+	// An empty chunk that is in the file has to stay until the map is saved without it
+	if(chunk->IsEmpty() && !file.Find(chunkX, chunkY)) RemoveChunk(chunkX, chunkY);
+	return previous;
+}
+uint64 MapDocument::GetTileCount(uint32 tileIndex) {
+	CountUsage();
+	UsageMap::const_iterator tileUsage = usage.find(tileIndex);
+	return (tileUsage != usage.end())?tileUsage->second.count:0;
+}
+void MapDocument::GetTileCounts(vector<pair<uint32, uint64> > &counts) {
+	CountUsage();
+	counts.clear();
+	for(UsageMap::const_iterator i = usage.begin(); i != usage.end(); ++i)
+		counts.push_back(make_pair(i->first, i->second.count));
+}
+void MapDocument::FindTile(uint32 tileIndex, vector<wxPoint> &cells) {
+	cells.clear();
+	CountUsage();
+	UsageMap::const_iterator tileUsage = usage.find(tileIndex);
+	if(tileUsage == usage.end()) return;
+	const vector<ChunkCount> &chunks = tileUsage->second.chunks;
+	for(vector<ChunkCount>::const_iterator i = chunks.begin(); i != chunks.end(); ++i) {
+		const Chunk *chunk = RequireChunk(i->x, i->y);
+		for(uint16 cell = chunk->FindUsage(tileIndex)->first; cell != Chunk::NO_CELL; cell = chunk->GetNextCell(cell))
+			cells.push_back(wxPoint(chunk->left + (cell & (CHUNK_SIZE - 1)), chunk->top + (cell >> CHUNK_SHIFT)));
+	}
+}
+uint32 MapDocument::ReplaceTile(uint32 from, uint32 to) {
+	if(from == to || from == NO_TILE) return 0; // The empty cells around the map never end
+	CountUsage();
+	UsageMap::const_iterator tileUsage = usage.find(from);
+	if(tileUsage == usage.end()) return 0;
+	vector<ChunkCount> chunks(tileUsage->second.chunks); // Settle changes the original
+	MapJournal::Batch batch;
+	ChangedChunks changed;
+	uint32 replaced = 0;
+	for(vector<ChunkCount>::iterator i = chunks.begin(); i != chunks.end(); ++i) {
+		Chunk *chunk = RequireChunk(i->x, i->y);
+		Touch(chunk, changed);
+		for(const Chunk::TileCount *tileCount; (tileCount = chunk->FindUsage(from)) != 0; ++replaced) {
+			uint16 cell = tileCount->first;
+			if(journal.IsEnabled())
+				batch.Record(chunk->left + (cell & (CHUNK_SIZE - 1)), chunk->top + (cell >> CHUNK_SHIFT), from, to);
+			chunk->SetTile(cell, to);
+		}
+	}
+	Settle(changed);
+	journal.Append(batch);
+	return replaced;
+}
+uint32 MapDocument::GetTile(int x, int y) {
+	const Chunk *chunk = RequireChunk(x >> CHUNK_SHIFT, y >> CHUNK_SHIFT);
+	if(!chunk) return NO_TILE;
+	return chunk->GetTile(x & (CHUNK_SIZE - 1), y & (CHUNK_SIZE - 1));
+}
+uint16 MapDocument::GetObject(int x, int y) {
+	return uint16(GetCell(x, y, LAYER_OBJECTS));
+}
+uint8 MapDocument::GetPassability(int x, int y) {
+	return uint8(GetCell(x, y, LAYER_PASSABILITY));
+}
+uint32 MapDocument::GetCell(int x, int y, Layer layer) {
+	const Chunk *chunk = RequireChunk(x >> CHUNK_SHIFT, y >> CHUNK_SHIFT);
+	if(!chunk) return GetEmpty(layer);
+	return chunk->GetCell(((y & (CHUNK_SIZE - 1)) << CHUNK_SHIFT) | (x & (CHUNK_SIZE - 1)), layer);
+}
+void MapDocument::LoadArea(const wxRect &area) {
+	if(!file.IsOpen() || area.GetWidth() <= 0 || area.GetHeight() <= 0) return;
+	int left = area.GetLeft() >> CHUNK_SHIFT, top = area.GetTop() >> CHUNK_SHIFT,
+		right = area.GetRight() >> CHUNK_SHIFT, bottom = area.GetBottom() >> CHUNK_SHIFT;
+	const MapFile::Directory &directory = file.GetDirectory();
+	for(int y = top; y <= bottom; ++y) {
+		for(MapFile::Directory::const_iterator record = file.Seek(left, y);
+			record != directory.end() && record->y == y && record->x <= right; ++record)
+			if(!FindChunk(record->x, y)) LoadChunk(*record);
+	}
+	if(chunkCount <= RESIDENT_CHUNK_BUDGET) return;
+	// Drop the chunks outside of the area that can be read back in from the file
+	vector<Chunk *> chunks;
+	GetChunks(root, chunks);
+	for(vector<Chunk *>::iterator i = chunks.begin(); i != chunks.end(); ++i) {
+		int x = (*i)->left >> CHUNK_SHIFT, y = (*i)->top >> CHUNK_SHIFT;
+		if(!(*i)->dirty && (x < left || x > right || y < top || y > bottom)) RemoveChunk(x, y);
+	}
+}
+uint32 MapDocument::GetMemoryBytes() const {
+	return chunkCount * sizeof(Chunk) + quadrantCount * sizeof(Quadrant) +
+		file.GetDirectory().size() * sizeof(MapFile::ChunkRecord) + GetIndexBytes();
+}
+uint32 MapDocument::GetIndexBytes() const {
+	uint32 bytes = 0;
+	vector<Chunk *> chunks;
+	GetChunks(root, chunks);
+	for(vector<Chunk *>::iterator i = chunks.begin(); i != chunks.end(); ++i) bytes += (*i)->GetIndexBytes();
+	// A tree node costs about four pointers on top of what it holds
+	for(UsageMap::const_iterator i = usage.begin(); i != usage.end(); ++i)
+		bytes += sizeof(UsageMap::value_type) + 4 * sizeof(void *) + i->second.chunks.capacity() * sizeof(ChunkCount);
+	return bytes;
+}
+MapDocument::Chunk *MapDocument::FindChunk(int chunkX, int chunkY) const {
+	if(lastChunk && lastChunk->left == chunkX * CHUNK_SIZE && lastChunk->top == chunkY * CHUNK_SIZE)
+		return lastChunk;
+	const Quadrant *quadrant = root;
+	if(!quadrant || !quadrant->Contains(chunkX, chunkY)) return 0;
+	while(quadrant->level != 0) {
+		quadrant = quadrant->children[quadrant->GetChild(chunkX, chunkY)];
+		if(!quadrant) return 0;
+	}
+	return (lastChunk = quadrant->chunk);
+}
+MapDocument::Chunk *MapDocument::RequireChunk(int chunkX, int chunkY) {
+	Chunk *chunk = FindChunk(chunkX, chunkY);
+	if(chunk || !file.IsOpen()) return chunk;
+	const MapFile::ChunkRecord *record = file.Find(chunkX, chunkY);
+	return record?LoadChunk(*record):0;
+}
+MapDocument::Chunk *MapDocument::CreateChunk(int chunkX, int chunkY) {
+	if(root) Grow(chunkX, chunkY);
+	else {
+		root = new Quadrant(chunkX, chunkY, 0);
+		++quadrantCount;
+	}
+	Quadrant *quadrant = root;
+	while(quadrant->level != 0) {
+		int child = quadrant->GetChild(chunkX, chunkY);
+		if(!quadrant->children[child]) {
+			int size = 1 << (quadrant->level - 1);
+			quadrant->children[child] = new Quadrant(quadrant->left + (child & 1) * size,
+				quadrant->top + (child >> 1) * size, quadrant->level - 1);
+			++quadrantCount;
+		}
+		quadrant = quadrant->children[child];
+	}
+	quadrant->chunk = new Chunk(chunkX * CHUNK_SIZE, chunkY * CHUNK_SIZE);
+	quadrant->chunk->version = ++lastVersion;
+	if(usageCounted) quadrant->chunk->Index();
+	++chunkCount;
+	return (lastChunk = quadrant->chunk);
+}
+MapDocument::Chunk *MapDocument::LoadChunk(const MapFile::ChunkRecord &record) {
+	Chunk *chunk = CreateChunk(record.x, record.y);
+	try { file.Read(record, chunk->tiles, chunk->objects, chunk->passability); }
+	catch(...) {
+		RemoveChunk(record.x, record.y);
+		throw;
+	}
+	chunk->CountCells();
+	if(usageCounted) chunk->Index(); // Again, now that it has tiles
+	return chunk;
+}
+void MapDocument::RemoveChunk(int chunkX, int chunkY) {
+	// Find the way down to the chunk, then free it and every quadrant that it leaves empty
+	Quadrant *path[32];
+	int depth = 0;
+	for(Quadrant *quadrant = root; ; quadrant = quadrant->children[quadrant->GetChild(chunkX, chunkY)]) {
+		path[depth++] = quadrant;
+		if(quadrant->level == 0) break;
+	}
+	if(lastChunk == path[depth - 1]->chunk) lastChunk = 0;
+	delete path[depth - 1]->chunk;
+	--chunkCount;
+	while(depth) {
+		Quadrant *quadrant = path[--depth];
+		if(quadrant->level != 0 &&
+			(quadrant->children[0] || quadrant->children[1] || quadrant->children[2] || quadrant->children[3]))
+			break;
+		delete quadrant;
+		--quadrantCount;
+		if(depth) path[depth - 1]->children[path[depth - 1]->GetChild(chunkX, chunkY)] = 0;
+		else root = 0;
+	}
+	// A root with one child is a level that every lookup walks through for nothing
+	while(root && root->level != 0) {
+		int children = 0, only = 0;
+		for(int i = 0; i < 4; ++i) if(root->children[i]) ++children, only = i;
+		if(children != 1) break;
+		Quadrant *child = root->children[only];
+		delete root;
+		--quadrantCount;
+		root = child;
+	}
+}
+void MapDocument::Grow(int chunkX, int chunkY) {
+	/* Each new root doubles the old one towards the chunk. Squares on multiples of their size
+	 * would be simpler, but then the chunks on either side of 0 would only meet at the top of a
+	 * tree as tall as an int is wide. */
+	while(!root->Contains(chunkX, chunkY)) {
+		int size = 1 << root->level;
+		Quadrant *parent = new Quadrant((chunkX < root->left)?root->left - size:root->left,
+			(chunkY < root->top)?root->top - size:root->top, root->level + 1);
+		++quadrantCount;
+		parent->children[parent->GetChild(root->left, root->top)] = root;
+		root = parent;
+	}
+}
+void MapDocument::Free(Quadrant *quadrant) {
+	if(!quadrant) return;
+	for(int i = 0; i < 4; ++i) Free(quadrant->children[i]);
+	if(quadrant->chunk) --chunkCount;
+	delete quadrant->chunk;
+	delete quadrant;
+	--quadrantCount;
+}
+void MapDocument::CountUsage() {
+	if(usageCounted) return;
+	usage.clear();
+	vector<Chunk *> chunks;
+	GetChunks(root, chunks);
+	for(vector<Chunk *>::iterator i = chunks.begin(); i != chunks.end(); ++i) {
+		(*i)->Index();
+		const vector<Chunk::TileCount> &tileCounts = (*i)->usage;
+		for(vector<Chunk::TileCount>::const_iterator j = tileCounts.begin(); j != tileCounts.end(); ++j) {
+			TileUsage &tileUsage = usage[j->tile];
+			ChunkCount chunkCount = { (*i)->left >> CHUNK_SHIFT, (*i)->top >> CHUNK_SHIFT, j->count };
+			tileUsage.count += j->count;
+			tileUsage.chunks.push_back(chunkCount);
+		}
+	}
+	// The chunks that are only in the file are counted without being kept
+	if(file.IsOpen()) {
+		vector<uint32> tiles(CHUNK_SIZE * CHUNK_SIZE);
+		const MapFile::Directory &directory = file.GetDirectory();
+		for(MapFile::Directory::const_iterator record = directory.begin(); record != directory.end(); ++record) {
+			if(FindChunk(record->x, record->y)) continue;
+			file.Read(*record, &tiles[0], 0, 0);
+			sort(tiles.begin(), tiles.end());
+			for(vector<uint32>::iterator j = tiles.begin(), k; j != tiles.end() && *j != NO_TILE; j = k) {
+				for(k = j + 1; k != tiles.end() && *k == *j; ++k);
+				TileUsage &tileUsage = usage[*j];
+				ChunkCount chunkCount = { record->x, record->y, uint32(k - j) };
+				tileUsage.count += chunkCount.count;
+				tileUsage.chunks.push_back(chunkCount);
+			}
+		}
+	}
+	for(UsageMap::iterator i = usage.begin(); i != usage.end(); ++i)
+		sort(i->second.chunks.begin(), i->second.chunks.end());
+	usageCounted = true;
+}
+void MapDocument::Recount(const Chunk &chunk, const vector<Chunk::TileCount> &before) {
+	// Both are sorted by tile, so the tiles whose counts changed fall out of a merge
+	vector<Chunk::TileCount>::const_iterator i = before.begin(), j = chunk.usage.begin();
+	while(i != before.end() || j != chunk.usage.end()) {
+		if(j == chunk.usage.end() || (i != before.end() && i->tile < j->tile)) {
+			Recount(chunk, i->tile, i->count, 0);
+			++i;
+		} else if(i == before.end() || j->tile < i->tile) {
+			Recount(chunk, j->tile, 0, j->count);
+			++j;
+		} else {
+			if(i->count != j->count) Recount(chunk, i->tile, i->count, j->count);
+			++i;
+			++j;
+		}
+	}
+}
+void MapDocument::Recount(const Chunk &chunk, uint32 tileIndex, uint32 before, uint32 after) {
+	TileUsage &tileUsage = usage[tileIndex];
+	tileUsage.count = tileUsage.count - before + after;
+	ChunkCount key = { chunk.left >> CHUNK_SHIFT, chunk.top >> CHUNK_SHIFT, after };
+	vector<ChunkCount>::iterator chunkCount = lower_bound(tileUsage.chunks.begin(), tileUsage.chunks.end(), key);
+	if(before == 0) tileUsage.chunks.insert(chunkCount, key);
+	else if(after == 0) tileUsage.chunks.erase(chunkCount);
+	else chunkCount->count = after;
+	if(tileUsage.count == 0) usage.erase(tileIndex);
+}
+void MapDocument::GetChunks(Quadrant *quadrant, vector<Chunk *> &chunks) const {
+	if(!quadrant) return;
+	if(quadrant->chunk) chunks.push_back(quadrant->chunk);
+	for(int i = 0; i < 4; ++i) GetChunks(quadrant->children[i], chunks);
+}
@@ -1,16 +1,185 @@
 #pragma once
 #include <wx/docview.h>
+#include <map>
+#include <string>
+#include <vector>
+#include <utility>
+#include "MapFile.h"
+#include "MapJournal.h"
+#include "ObjectTable.h"
 
+/* An unbounded map, kept as chunks of cells at the leaves of a sparse quadtree. Chunks are read
+ * in from the file as they're needed, and every edit goes into the journal for undo. */
 class MapDocument : public wxDocument {
 	DECLARE_DYNAMIC_CLASS(MapDocument)
 public:
-	static const int QUADRANT_SIZE = 256;
+	static const int CHUNK_SHIFT = MapFile::CHUNK_SHIFT; // Chunks are what the file is made of
+	static const int CHUNK_SIZE = 1 << CHUNK_SHIFT; // Cells on each side of a chunk
+	static const uint32 NO_TILE = 0xFFFFFFFF; // The tile of a cell that hasn't been painted
+	static const uint32 RESIDENT_CHUNK_BUDGET = 1024;
+	static const uint32 PARALLEL_CHUNKS = 64; // Bulk edits over this many chunks use every core
+	static const uint16 NO_OBJECT = ObjectTable::NO_OBJECT;
+	static const uint8 PASSABLE = 0; // Anything else blocks the cell
+	static wxObject contentsReplaced; // The hint that the views get when the whole map is thrown out
+	enum Layer {
+		LAYER_FLOOR, // The only layer that the bulk edits and the tile index deal with
+		LAYER_OBJECTS,
+		LAYER_PASSABILITY
+	};
 	class Quadrant;
-	wxOutputStream &SaveObject(wxOutputStream &stream) { return stream; }
-	wxInputStream &LoadObject(wxInputStream &stream) { return stream; }
-	void InsertTile(int x, int y, int tileIndex);
+	class Chunk {
+	public:
+		static const uint16 NO_CELL = 0xFFFF;
+		// One of the tiles in a chunk, how many cells have it and the first of those cells
+		struct TileCount {
+			uint32 tile;
+			uint16 count, first;
+		};
+		// x and y are relative to the top left corner of the chunk
+		inline uint32 GetTile(int x, int y) const { return tiles[(y << CHUNK_SHIFT) | x]; }
+		inline uint16 GetObject(int x, int y) const { return objects[(y << CHUNK_SHIFT) | x]; }
+		inline uint8 GetPassability(int x, int y) const { return passability[(y << CHUNK_SHIFT) | x]; }
+		// Each layer as one array, row by row
+		inline const uint32 *GetTiles() const { return tiles; }
+		inline const uint16 *GetObjects() const { return objects; }
+		inline const uint8 *GetPassability() const { return passability; }
+		inline int GetLeft() const { return left; } // In cells
+		inline int GetTop() const { return top; }
+		inline uint32 GetCount() const { return count; } // The number of cells with a tile
+		inline bool IsEmpty() const { return (count == 0 && marked == 0); }
+		inline uint32 GetVersion() const { return version; } // Unique to each change of any chunk
+		// The tiles in the chunk, in order; empty until the document counts its tiles
+		inline const std::vector<TileCount> &GetUsage() const { return usage; }
+		const TileCount *FindUsage(uint32 tileIndex) const; // 0 if no cell has the tile
+		// The next cell with the same tile, row by row; cells are numbered (y << CHUNK_SHIFT) | x
+		inline uint16 GetNextCell(uint16 cell) const { return links[cell]; }
+		inline uint32 GetIndexBytes() const {
+			return links.capacity() * sizeof(uint16) + usage.capacity() * sizeof(TileCount); }
+	private:
+		friend class MapDocument;
+		int left, top;
+		uint32 count;
+		uint32 marked; // The number of cells with an object or that can't be crossed freely
+		bool dirty; // Changed since the map was saved
+		uint32 version;
+		uint32 tiles[CHUNK_SIZE * CHUNK_SIZE];
+		uint16 objects[CHUNK_SIZE * CHUNK_SIZE];
+		uint8 passability[CHUNK_SIZE * CHUNK_SIZE];
+		std::vector<TileCount> usage;
+		std::vector<uint16> links; // The next cell of each cell with the same tile, then the previous
+		Chunk(int left_, int top_);
+		void SetTile(int cell, uint32 tileIndex); // This keeps the count and any index up to date
+		uint32 GetCell(int cell, Layer layer) const;
+		void SetCell(int cell, Layer layer, uint32 value);
+		void CountCells(); // Count the cells that have something, after they've been read in
+		void Index(); // Index the tiles from scratch, and go on indexing them
+		void Link(int cell, uint32 tileIndex);
+		void Unlink(int cell, uint32 tileIndex);
+	};
+	/* Visits the chunks in memory that overlap a rectangle of cells, in no particular order; LoadArea
+	 * the rectangle first. The document can't be changed while an iterator is in use. */
+	class ChunkIterator {
+	public:
+		ChunkIterator(const MapDocument &mapDocument, const wxRect &area);
+		inline bool IsDone() const { return (chunk == 0); }
+		inline const Chunk &operator*() const { return *chunk; }
+		inline const Chunk *operator->() const { return chunk; }
+		ChunkIterator &operator++();
+	private:
+		// Depth first, each quadrant pushes at most four children in place of itself
+		static const int STACK_SIZE = 3 * 32 + 1;
+		const Quadrant *stack[STACK_SIZE];
+		int depth;
+		int left, top, right, bottom; // The chunks of the area, inclusive
+		const Chunk *chunk;
+	};
+	bool OnOpenDocument(const wxString &filename);
+	bool OnSaveDocument(const wxString &filename);
+	void Open(const std::string &path); // Throws if the map can't be read
+	void Save(const std::string &path); // Only the chunks that changed are written out
+	bool DeleteContents();
+	wxCommandProcessor *OnCreateCommandProcessor();
+	// Put a tile in a cell; NO_TILE erases it, freeing the chunk once nothing is left in it
+	void InsertTile(int x, int y, uint32 tileIndex);
+	// Put an object from the object table in a cell, or take it out with NO_OBJECT
+	void InsertObject(int x, int y, uint16 object);
+	void SetPassability(int x, int y, uint8 passability);
+	// Put back the cells of the last step, or make it again; false if there's no such step
+	bool Undo();
+	bool Redo();
+	inline bool CanUndo() const { return journal.CanUndo(); }
+	inline bool CanRedo() const { return journal.CanRedo(); }
+	inline MapJournal &GetJournal() { return journal; }
+	// Each bulk edit is a single step in the journal
+	void FillRect(const wxRect &area, uint32 tileIndex); // NO_TILE erases
+	// Repeat a pattern of width by height tiles over a rectangle; NO_TILE cells are left alone
+	void PaintPattern(const wxRect &area, const uint32 *pattern, int width, int height);
+	// Fill the cells reachable from x, y that have its tile, within bounds
+	void FloodFill(int x, int y, uint32 tileIndex, const wxRect &bounds);
+	// The first query about tile usage counts the whole map; later ones are cheap
+	uint64 GetTileCount(uint32 tileIndex);
+	void GetTileCounts(std::vector<std::pair<uint32, uint64> > &counts);
+	void FindTile(uint32 tileIndex, std::vector<wxPoint> &cells); // Reads in the chunks with the tile
+	// Put to in every cell that has from, as a single step; returns the number of cells changed
+	uint32 ReplaceTile(uint32 from, uint32 to);
+	uint32 GetTile(int x, int y); // These may read a chunk in from the file
+	uint16 GetObject(int x, int y);
+	uint8 GetPassability(int x, int y);
+	inline ObjectTable &GetObjects() { return objects; }
+	// Read in every chunk of the file that overlaps a rectangle of cells
+	void LoadArea(const wxRect &area);
+	inline uint32 GetChunkCount() const { return chunkCount; } // The chunks in memory
+	uint32 GetMemoryBytes() const;
+	uint32 GetIndexBytes() const; // The part of GetMemoryBytes that counts tile usage
+	MapDocument();
+	~MapDocument();
 private:
+	class History;
+	struct Painting;
+	struct ChunkPainting;
+	struct ChunkCount {
+		int x, y; // In chunks
+		uint32 count;
+		inline bool operator<(const ChunkCount &other) const {
+			return y < other.y || (y == other.y && x < other.x); }
+	};
+	struct TileUsage {
+		uint64 count;
+		std::vector<ChunkCount> chunks; // Sorted by row, then column
+	};
+	typedef std::map<uint32, TileUsage> UsageMap;
+	// The chunks that an edit changed, and the tiles that each had before; see Settle
+	typedef std::map<Chunk *, std::vector<Chunk::TileCount> > ChangedChunks;
 	Quadrant *root;
-	wxPoint top_left;
-	wxSize size;
-};
\ No newline at end of file
+	MapFile file;
+	MapJournal journal;
+	ObjectTable objects;
+	std::vector<MapJournal::Edit> replay; // The edits of the step being undone or redone
+	mutable Chunk *lastChunk; // The chunk that was used last, since edits tend to stay close together
+	uint32 chunkCount, quadrantCount;
+	uint32 lastVersion; // The version that was given to a chunk last
+	UsageMap usage;
+	bool usageCounted; // Whether usage covers the whole map, and has to be kept up to date
+	static uint32 GetEmpty(Layer layer); // What an untouched cell of the layer holds
+	void InsertCell(int x, int y, Layer layer, uint32 value);
+	uint32 PutCell(int x, int y, Layer layer, uint32 value); // Unrecorded; returns the old value
+	uint32 GetCell(int x, int y, Layer layer);
+	// PutCell for bulk edits, which Settle the changed chunks once they're done
+	uint32 WriteCell(int x, int y, Layer layer, uint32 value, Chunk *&chunk, ChangedChunks &changed);
+	void Touch(Chunk *chunk, ChangedChunks &changed); // Add a chunk to changed, if it isn't yet
+	void Settle(const ChangedChunks &changed);
+	void CountUsage(); // Count every tile of the map, if usage doesn't already
+	void Recount(const Chunk &chunk, const std::vector<Chunk::TileCount> &before);
+	void Recount(const Chunk &chunk, uint32 tileIndex, uint32 before, uint32 after);
+	void Replay(bool undo); // Write the journal's last step back, or forward
+	void Paint(Painting &painting);
+	void PaintChunks(Painting *painting); // Paint chunks until there are none left
+	Chunk *FindChunk(int chunkX, int chunkY) const;
+	Chunk *RequireChunk(int chunkX, int chunkY); // Find a chunk, reading it from the file if need be
+	Chunk *CreateChunk(int chunkX, int chunkY);
+	Chunk *LoadChunk(const MapFile::ChunkRecord &record);
+	void RemoveChunk(int chunkX, int chunkY);
+	void Grow(int chunkX, int chunkY); // Add levels above the root until it covers a chunk
+	void Free(Quadrant *quadrant);
+	void GetChunks(Quadrant *quadrant, std::vector<Chunk *> &chunks) const;
+};
@@ -4,6 +4,12 @@
 #include <wx/docview.h>
 #include "MapDocument.h"
 #include "MapView.h"
+#include "TileLoader.h"
+#include "TileCache.h"
+#include "TileManager.h"
+#include "PipelineStats.h"
+#include <wx/cmdline.h>
+#include <exception>
 wxGLContext *mainContext = 0;
 wxMDIParentFrame *mainFrame = 0;
 wxDocManager *docManager = 0;
@@ -11,6 +17,12 @@ MapEditor *mapEditor = 0;
 
 bool MapEditor::OnInit() {
 	mapEditor = this;
+	tileCacheCommand = TILE_CACHE_NONE;
+	if(!wxApp::OnInit()) return false; // Parses the command line
+	if(tileCacheCommand != TILE_CACHE_NONE) {
+		RunTileCacheCommand();
+		return false; // Don't bring up the editor; just exit
+	}
 	docManager = new wxDocManager();
 	new wxDocTemplate(docManager, "Nexus Map", "*.nme", "", "nme",
 		"Map Document", "Map View", CLASSINFO(MapDocument), CLASSINFO(MapView));
@@ -19,8 +31,53 @@ bool MapEditor::OnInit() {
 	this->SetTopWindow(mainFrame);
 	return true;
 }
+void MapEditor::OnInitCmdLine(wxCmdLineParser &parser) {
+	wxApp::OnInitCmdLine(parser);
+	parser.AddSwitch("", "build-tile-cache", "Decode every tile into the tile cache, then exit");
+	parser.AddSwitch("", "verify-tile-cache", "Check the tile cache against the data files, then exit");
+	parser.AddSwitch("", "no-tile-cache", "Read tiles from the data files even if there is a tile cache");
+	parser.AddSwitch("", "indexed-tiles", "Keep tiles as palette indices, so that many more stay resident");
+	parser.AddOption("", "stats-file", "Write tile pipeline stats to a file every second, as JSON lines");
+	parser.AddOption("", "trace-file", "Record tile pipeline trace events, and write them out on exit");
+}
+bool MapEditor::OnCmdLineParsed(wxCmdLineParser &parser) {
+	if(!wxApp::OnCmdLineParsed(parser)) return false;
+	if(parser.Found("build-tile-cache")) tileCacheCommand = TILE_CACHE_BUILD;
+	else if(parser.Found("verify-tile-cache")) tileCacheCommand = TILE_CACHE_VERIFY;
+	if(parser.Found("no-tile-cache")) tileLoader.EnableCache(false);
+	if(parser.Found("indexed-tiles")) {
+		tileManager.SetResidency(TileManager::RESIDENCY_INDEXED);
+		tileManager.SetBudget(TileManager::DEFAULT_TEXTURE_BUDGET, TileManager::INDEXED_MEMORY_BUDGET);
+	}
+	// Start recording right away, so that TileLoader::Init shows up too
+	wxString path;
+	if(parser.Found("stats-file", &path)) pipelineStats.StartDumps(std::string(path.mb_str()));
+	if(parser.Found("trace-file", &path)) pipelineStats.StartTrace(std::string(path.mb_str()));
+	return true;
+}
+void MapEditor::RunTileCacheCommand() {
+	wxMessageOutput *output = wxMessageOutput::Get();
+	try {
+		// Both commands work from the data files themselves
+		tileLoader.EnableCache(false);
+		tileLoader.Init();
+		if(tileCacheCommand == TILE_CACHE_BUILD) {
+			TileCache::Build(tileLoader, tileLoader.GetCachePath());
+			output->Printf("Wrote %u tiles and %u objects to %s\n", tileLoader.numTiles[TypeTile],
+				tileLoader.numTiles[TypeObject], tileLoader.GetCachePath().c_str());
+			return;
+		}
+		uint32 mismatches = TileCache::Verify(tileLoader, tileLoader.GetCachePath());
+		output->Printf("%u tiles in %s differ from the data files\n",
+			mismatches, tileLoader.GetCachePath().c_str());
+	} catch(std::exception &e) { output->Printf("%s\n", e.what()); }
+}
 int MapEditor::OnExit() {
+	pipelineStats.StopDumps();
+	pipelineStats.StopTrace();
 	delete docManager;
+	// The frames, and so the GL contexts, are gone by now
+	tileManager.Shutdown();
 	return 0;
 }
 
@@ -3,15 +3,22 @@ class wxGLContext;
 typedef unsigned int GLuint;
 class wxDocManager;
 class wxMDIParentFrame;
-#include <boost/multi_array.hpp>
-typedef std::pair<uint32, int> TileIdentifier;
+class wxCmdLineParser;
+#include "TileSelection.h"
 
 class MapEditor : public wxApp {
 public:
 	virtual bool OnInit();
 	virtual int OnExit();
+	virtual void OnInitCmdLine(wxCmdLineParser &parser);
+	virtual bool OnCmdLineParsed(wxCmdLineParser &parser);
 
-	boost::multi_array<TileIdentifier, 2> selection;
+	TileSelection selection;
+private:
+	// What to do with the tile cache, as asked for on the command line
+	enum TileCacheCommand { TILE_CACHE_NONE, TILE_CACHE_BUILD, TILE_CACHE_VERIFY };
+	TileCacheCommand tileCacheCommand;
+	void RunTileCacheCommand(); // Build or verify the cache, and report how it went
 };
 
 // TODO: Move these into the application class!
@@ -0,0 +1,254 @@
+#include "stdwx.h"
+#include "MapFile.h"
+#include <cstring>
+#include <fstream>
+#include <algorithm>
+#include <exception>
+using namespace std;
+
+static const char mapMagic[8] = "AESIRMP";
+
+// Chunks are kept in order of row, and then column
+template<class A, class B> static inline bool Precedes(const A &a, const B &b) {
+	return a.y < b.y || (a.y == b.y && a.x < b.x); }
+static inline bool IsRemoved(const MapFile::ChunkRecord &record) { return record.size == 0; }
+static void PutNumber(vector<uint8> &data, uint32 number) {
+	for(; number >= 0x80; number >>= 7) data.push_back(uint8(number | 0x80));
+	data.push_back(uint8(number));
+}
+static uint32 GetNumber(const uint8 *&data, const uint8 *end) {
+	uint32 number = 0;
+	for(int shift = 0; shift < 35 && data != end; shift += 7) {
+		uint8 byte = *data++;
+		number |= uint32(byte & 0x7F) << shift;
+		if(!(byte & 0x80)) return number;
+	}
+	throw exception("A chunk of the map is damaged");
+}
+// A layer of a chunk, as runs of values plus bias; the bias wraps, which is how NO_TILE becomes 0
+template<class T> static void EncodeLayer(const T *cells, uint32 bias, vector<uint8> &data) {
+	for(int i = 0, j; i < MapFile::CHUNK_CELLS; i = j) {
+		for(j = i + 1; j < MapFile::CHUNK_CELLS && cells[j] == cells[i]; ++j);
+		PutNumber(data, j - i - 1);
+		PutNumber(data, uint32(cells[i]) + bias);
+	}
+}
+// Decode a layer into cells, or just step over it if cells is 0
+template<class T> static void DecodeLayer(const uint8 *&data, const uint8 *end, T *cells, uint32 bias) {
+	for(int i = 0; i < MapFile::CHUNK_CELLS; ) {
+		uint32 run = GetNumber(data, end) + 1, value = GetNumber(data, end) - bias;
+		if(run > uint32(MapFile::CHUNK_CELLS - i) || value != uint32(T(value)))
+			throw exception("A chunk of the map is damaged");
+		if(cells) for(uint32 j = 0; j < run; ++j) cells[i + j] = T(value);
+		i += run;
+	}
+}
+// Version 1 chunks are just the floor layer; the objects and passability come out empty
+static void DecodeFloor(const uint8 *data, uint32 size, uint32 *tiles, uint16 *objects, uint8 *passability) {
+	const uint8 *end = data + size;
+	DecodeLayer(data, end, tiles, 1);
+	if(data != end) throw exception("A chunk of the map is damaged");
+	if(objects) fill(objects, objects + MapFile::CHUNK_CELLS, uint16(ObjectTable::NO_OBJECT));
+	if(passability) fill(passability, passability + MapFile::CHUNK_CELLS, uint8(0));
+}
+// Write a chunk at the end of out, and return its record
+static MapFile::ChunkRecord WriteChunk(ostream &out, int x, int y, const uint8 *data, uint32 size) {
+	streamoff offset = out.tellp();
+	if(offset + streamoff(size) > streamoff(0xFFFFFFFF)) throw exception("The map is too large to save");
+	MapFile::ChunkRecord record = { x, y, uint32(offset), size };
+	out.write((const char *)data, size);
+	return record;
+}
+/* Write the directory and the object table at the end of out, on a four byte boundary, and then
+ * the header */
+static void WriteDirectory(ostream &out, const MapFile::Directory &directory, const ObjectTable &objects,
+	uint32 garbage) {
+	static const char padding[4] = { 0, 0, 0, 0 };
+	out.write(padding, (4 - streamoff(out.tellp()) % 4) % 4);
+	MapFile::Header header;
+	memset(&header, 0, sizeof(MapFile::Header));
+	memcpy(header.magic, mapMagic, sizeof(header.magic));
+	header.version = MapFile::VERSION;
+	header.chunkShift = MapFile::CHUNK_SHIFT;
+	header.directory.offset = uint32(out.tellp());
+	header.directory.count = directory.size();
+	header.garbage = garbage;
+	if(!directory.empty()) out.write((const char *)&directory[0], directory.size() * sizeof(MapFile::ChunkRecord));
+	vector<uint32> objectData;
+	objects.Write(objectData);
+	header.objects.offset = uint32(out.tellp());
+	header.objects.count = objectData.size();
+	if(!objectData.empty()) out.write((const char *)&objectData[0], objectData.size() * sizeof(uint32));
+	if(streamoff(out.tellp()) > streamoff(0xFFFFFFFF)) throw exception("The map is too large to save");
+	// The header goes last, so that until it's written the old directory is still the one in use
+	out.flush();
+	out.seekp(0);
+	out.write((const char *)&header, sizeof(MapFile::Header));
+}
+
+void MapFile::Open(const string &path_) {
+	if(file.IsOpen()) file.Close();
+	directory.clear();
+	try {
+		file.Open(path_);
+		// The fields up to the directory are the same in every version
+		const Version1Header *header = file.At<Version1Header>(0);
+		if(memcmp(header->magic, mapMagic, sizeof(header->magic)) ||
+			(header->version != 1 && header->version != VERSION) || header->chunkShift != CHUNK_SHIFT)
+			throw exception("The file isn't a map, or it was saved by another version of the editor");
+		const ChunkRecord *records = file.At<ChunkRecord>(header->directory.offset, header->directory.count);
+		directory.assign(records, records + header->directory.count);
+		version = header->version;
+		garbage = header->garbage;
+		if(version == VERSION) {
+			const Header *current = file.At<Header>(0);
+			file.At<uint32>(current->objects.offset, current->objects.count);
+			objects = current->objects;
+			garbage = current->garbage;
+		}
+		for(uint32 i = 0; i < directory.size(); ++i) {
+			// Make sure that every chunk lies within the file, so that later reads can't fail
+			file.At<uint8>(directory[i].offset, directory[i].size);
+			if(IsRemoved(directory[i]) || (i != 0 && !Precedes(directory[i - 1], directory[i])))
+				throw exception("The map's directory is damaged");
+		}
+		path = path_;
+	} catch(...) {
+		Close();
+		throw;
+	}
+}
+void MapFile::Close() {
+	if(file.IsOpen()) file.Close();
+	directory.clear();
+	path.clear();
+	objects.offset = objects.count = 0;
+	version = VERSION;
+	garbage = 0;
+}
+void MapFile::Save(const string &path_, const vector<Change> &changes, const ObjectTable &objects_) {
+	// Chunks from another version can't be left in among new ones, so those files are written afresh
+	if(IsOpen() && path_ == path && version == VERSION && garbage <= file.GetSize() / 2)
+		Update(changes, objects_);
+	else Write(path_, changes, objects_);
+}
+void MapFile::ReadObjects(ObjectTable &objects_) const {
+	if(!IsOpen()) objects_.Clear();
+	else objects_.Read(file.At<uint32>(objects.offset, objects.count), objects.count);
+}
+const MapFile::ChunkRecord *MapFile::Find(int x, int y) const {
+	Directory::const_iterator record = Seek(x, y);
+	return (record != directory.end() && record->x == x && record->y == y)?&*record:0;
+}
+MapFile::Directory::const_iterator MapFile::Seek(int x, int y) const {
+	ChunkRecord key = { x, y, 0, 0 };
+	return lower_bound(directory.begin(), directory.end(), key, Precedes<ChunkRecord, ChunkRecord>);
+}
+void MapFile::Read(const ChunkRecord &record, uint32 *tiles, uint16 *objects, uint8 *passability) const {
+	const uint8 *data = file.At<uint8>(record.offset, record.size);
+	if(version == VERSION) Decode(data, record.size, tiles, objects, passability);
+	else DecodeFloor(data, record.size, tiles, objects, passability);
+}
+void MapFile::Encode(const uint32 *tiles, const uint16 *objects, const uint8 *passability, vector<uint8> &data) {
+	data.clear();
+	EncodeLayer(tiles, 1, data);
+	EncodeLayer(objects, 0, data);
+	EncodeLayer(passability, 0, data);
+}
+void MapFile::Decode(const uint8 *data, uint32 size, uint32 *tiles, uint16 *objects, uint8 *passability) {
+	const uint8 *end = data + size;
+	DecodeLayer(data, end, tiles, 1);
+	DecodeLayer(data, end, objects, 0);
+	DecodeLayer(data, end, passability, 0);
+	if(data != end) throw exception("A chunk of the map is damaged");
+}
+void MapFile::Update(const vector<Change> &changes, const ObjectTable &objects_) {
+	string current(path);
+	Directory updated(directory), added;
+	// The old directory and object table are left behind too
+	uint32 newGarbage = garbage + directory.size() * sizeof(ChunkRecord) + objects.count * sizeof(uint32);
+	file.Close(); // It can't be written to while it's mapped
+	try {
+		fstream out(current.c_str(), ios::in | ios::out | ios::binary);
+		if(!out) throw exception("Couldn't write to the map file");
+		out.seekp(0, ios::end);
+		vector<uint8> data;
+		for(vector<Change>::const_iterator change = changes.begin(); change != changes.end(); ++change) {
+			ChunkRecord key = { change->x, change->y, 0, 0 };
+			Directory::iterator record = lower_bound(updated.begin(), updated.end(), key,
+				Precedes<ChunkRecord, ChunkRecord>);
+			bool found = (record != updated.end() && record->x == change->x && record->y == change->y);
+			if(found) {
+				newGarbage += record->size;
+				record->size = 0; // Taken out, unless the chunk is written again below
+			}
+			if(!change->tiles) continue;
+			Encode(change->tiles, change->objects, change->passability, data);
+			ChunkRecord written = WriteChunk(out, change->x, change->y, &data[0], data.size());
+			if(found) *record = written;
+			else added.push_back(written);
+		}
+		updated.erase(remove_if(updated.begin(), updated.end(), IsRemoved), updated.end());
+		updated.insert(updated.end(), added.begin(), added.end());
+		sort(updated.begin(), updated.end(), Precedes<ChunkRecord, ChunkRecord>);
+		WriteDirectory(out, updated, objects_, newGarbage);
+		out.close();
+		if(!out) throw exception("Couldn't write to the map file");
+	} catch(...) {
+		Open(current); // The header still points at the old directory
+		throw;
+	}
+	Open(current);
+}
+void MapFile::Write(const string &path_, const vector<Change> &changes, const ObjectTable &objects_) {
+	string target(path_), partPath = path_ + ".part";
+	vector<Change> sorted(changes);
+	sort(sorted.begin(), sorted.end(), Precedes<Change, Change>);
+	{
+		// The map is written beside the destination first, so that it's never left half written
+		ofstream out(partPath.c_str(), ios::binary | ios::trunc);
+		if(!out) throw exception("Couldn't create the map file");
+		Header header;
+		memset(&header, 0, sizeof(Header));
+		out.write((const char *)&header, sizeof(Header)); // Written again once the directory is
+		Directory written;
+		vector<uint8> data;
+		vector<uint32> oldTiles;
+		vector<uint16> oldObjects;
+		vector<uint8> oldPassability;
+		if(version != VERSION) {
+			oldTiles.resize(CHUNK_CELLS);
+			oldObjects.resize(CHUNK_CELLS);
+			oldPassability.resize(CHUNK_CELLS);
+		}
+		Directory::const_iterator record = directory.begin();
+		vector<Change>::const_iterator change = sorted.begin();
+		// Copy the chunks that haven't changed straight out of the old file, and encode the rest
+		while(record != directory.end() || change != sorted.end()) {
+			if(change == sorted.end() || (record != directory.end() && Precedes(*record, *change))) {
+				if(version == VERSION) written.push_back(WriteChunk(out, record->x, record->y,
+					file.At<uint8>(record->offset, record->size), record->size));
+				else {
+					// Chunks from an older version are encoded again, with their layers filled in
+					Read(*record, &oldTiles[0], &oldObjects[0], &oldPassability[0]);
+					Encode(&oldTiles[0], &oldObjects[0], &oldPassability[0], data);
+					written.push_back(WriteChunk(out, record->x, record->y, &data[0], data.size()));
+				}
+				++record;
+				continue;
+			}
+			if(record != directory.end() && record->x == change->x && record->y == change->y) ++record;
+			if(change->tiles) {
+				Encode(change->tiles, change->objects, change->passability, data);
+				written.push_back(WriteChunk(out, change->x, change->y, &data[0], data.size()));
+			}
+			++change;
+		}
+		WriteDirectory(out, written, objects_, 0);
+		out.close();
+		if(!out) throw exception("Couldn't write the map file");
+	}
+	Close();
+	ReplaceFileAt(target, partPath);
+	Open(target);
+}
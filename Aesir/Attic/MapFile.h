@@ -0,0 +1,76 @@
+#pragma once
+#include <string>
+#include <vector>
+#include "MappedFile.h"
+#include "ObjectTable.h"
+
+/* The file that a map is saved in. It holds the map's chunks one after another, each compressed
+ * on its own, and then a directory of where each chunk lies, sorted by row and then by column,
+ * and the map's object table. Opening a map maps the file and reads the directory, and nothing
+ * else; chunks are decoded one at a time, as they're asked for.
+ *
+ * Saving over the file that is open appends the chunks that changed and a new directory, and then
+ * points the header at it, so the file is never left without a whole directory. The chunks that
+ * were replaced stay behind as garbage until there is as much of it as there is map, and then the
+ * file is written out afresh. Maps from version 1, which had only the floor, are read with the other
+ * layers empty, and are written out afresh in this version the first time they're saved. */
+class MapFile {
+public:
+	static const uint32 VERSION = 2; // 2 added the object and passability layers
+	static const int CHUNK_SHIFT = 5;
+	static const int CHUNK_CELLS = 1 << (CHUNK_SHIFT * 2);
+	struct Section { uint32 offset, count; };
+	struct Header {
+		char magic[8]; // "AESIRMP"
+		uint32 version, chunkShift;
+		Section directory;
+		Section objects; // In uint32s, as ObjectTable::Write lays them out
+		uint32 garbage; // Bytes of old chunks that nothing points to anymore
+	};
+	struct Version1Header { // Before the objects section
+		char magic[8];
+		uint32 version, chunkShift;
+		Section directory;
+		uint32 garbage;
+	};
+	struct ChunkRecord {
+		int x, y; // In chunks
+		uint32 offset, size; // Where the encoded chunk lies in the file
+	};
+	typedef std::vector<ChunkRecord> Directory;
+	// A chunk to save, layer by layer; chunks without tiles are taken out of the file
+	struct Change {
+		int x, y;
+		const uint32 *tiles; // 0 if the chunk is empty, in which case the other layers are too
+		const uint16 *objects;
+		const uint8 *passability;
+	};
+	void Open(const std::string &path_); // Throws if the file isn't a map that can be read
+	void Close();
+	inline bool IsOpen() const { return file.IsOpen(); }
+	// Save to path_, which needn't be the file that is open, and then open it
+	void Save(const std::string &path_, const std::vector<Change> &changes, const ObjectTable &objects);
+	void ReadObjects(ObjectTable &objects) const;
+	const ChunkRecord *Find(int x, int y) const; // 0 if the file has no such chunk
+	// The first record at or after column x of row y
+	Directory::const_iterator Seek(int x, int y) const;
+	inline const Directory &GetDirectory() const { return directory; }
+	// Decode the CHUNK_CELLS cells of each layer; the layers that are 0 are skipped
+	void Read(const ChunkRecord &record, uint32 *tiles, uint16 *objects, uint8 *passability) const;
+	/* A chunk is each of its layers in turn, floor, objects and passability. A layer is a run
+	 * length and then a value for each run of cells, as varints; tiles go in plus one, so that
+	 * NO_TILE comes out as 0, like the empty cells of the other layers. */
+	static void Encode(const uint32 *tiles, const uint16 *objects, const uint8 *passability,
+		std::vector<uint8> &data);
+	static void Decode(const uint8 *data, uint32 size, uint32 *tiles, uint16 *objects, uint8 *passability);
+	inline MapFile() : version(VERSION), garbage(0) { objects.offset = objects.count = 0; }
+private:
+	MappedFile file;
+	std::string path;
+	Directory directory; // Kept apart from the mapping, which is closed while saving
+	Section objects;
+	uint32 version; // Of the file that is open
+	uint32 garbage;
+	void Update(const std::vector<Change> &changes, const ObjectTable &objects_);
+	void Write(const std::string &path_, const std::vector<Change> &changes, const ObjectTable &objects_);
+};
@@ -0,0 +1,205 @@
+#include "stdwx.h"
+#include "MapJournal.h"
+#include <cstring>
+#include <algorithm>
+using namespace std;
+
+/* Cell deltas go either way, so they're folded into small numbers before they're packed. They
+ * wrap around, so that cells at opposite ends of the map are still a delta apart. */
+static inline uint32 Fold(int first, int second) {
+	int delta = int(uint32(second) - uint32(first));
+	return (uint32(delta) << 1) ^ uint32(delta >> 31);
+}
+static inline int Unfold(int first, uint32 number) {
+	return int(uint32(first) + (uint32(number >> 1) ^ (0 - (number & 1))));
+}
+// The layer of an edit rides along with its row, which is why the numbers can be wider than 32 bits
+static inline uint64 Row(uint32 folded, uint8 layer) {
+	return (uint64(folded) << MapJournal::LAYER_BITS) | layer; }
+static inline uint8 *PutNumber(uint8 *data, uint64 number) {
+	for(; number >= 0x80; number >>= 7) *data++ = uint8(number | 0x80);
+	*data++ = uint8(number);
+	return data;
+}
+
+MapJournal::~MapJournal() {
+	for(deque<uint8 *>::iterator i = blocks.begin(); i != blocks.end(); ++i) delete[] *i;
+}
+void MapJournal::BeginStep() {
+	++depth;
+}
+void MapJournal::EndStep() {
+	if(depth == 0 || --depth != 0 || !recording) return;
+	recording = false;
+	Step &step = steps.back();
+	step.size = uint32(end - step.offset);
+	current = steps.size();
+	Trim();
+}
+void MapJournal::Record(int x, int y, uint32 before, uint32 after, uint8 layer) {
+	if(memoryCap == 0) return;
+	if(depth == 0) {
+		BeginStep();
+		Record(x, y, before, after, layer);
+		EndStep();
+		return;
+	}
+	if(!recording) Open();
+	// Pack the edit straight into the block when it's sure to fit, and through a buffer if not
+	uint8 edit[MAX_EDIT_SIZE], *start = (room >= MAX_EDIT_SIZE)?cursor:edit, *data = start;
+	data = PutNumber(data, Fold(lastX, x));
+	data = PutNumber(data, Row(Fold(lastY, y), layer));
+	data = PutNumber(data, before + 1); // So that empty cells come out as a single 0
+	data = PutNumber(data, after + 1);
+	uint32 size = uint32(data - start);
+	if(start == cursor) {
+		cursor = data;
+		room -= size;
+		end += size;
+	} else PutBytes(edit, size);
+	lastX = x;
+	lastY = y;
+	++steps.back().count;
+}
+void MapJournal::Append(const Batch &batch) {
+	if(memoryCap == 0 || batch.count == 0) return;
+	if(depth == 0) {
+		BeginStep();
+		Append(batch);
+		EndStep();
+		return;
+	}
+	if(!recording) Open();
+	// Only the first edit of the batch has to be made relative to the journal's last one
+	uint8 first[2 * 5], *data = first;
+	data = PutNumber(data, Fold(lastX, batch.firstX));
+	data = PutNumber(data, Row(Fold(lastY, batch.firstY), batch.firstLayer));
+	PutBytes(first, uint32(data - first));
+	PutBytes(&batch.data[0], batch.size);
+	lastX = batch.lastX;
+	lastY = batch.lastY;
+	steps.back().count += batch.count;
+}
+bool MapJournal::Undo(vector<Edit> &edits) {
+	if(!CanUndo()) return false;
+	Read(steps[--current], edits);
+	return true;
+}
+bool MapJournal::Redo(vector<Edit> &edits) {
+	if(!CanRedo()) return false;
+	Read(steps[current++], edits);
+	return true;
+}
+void MapJournal::SetMemoryCap(uint32 bytes) {
+	memoryCap = bytes;
+	if(memoryCap == 0) Clear();
+	else if(!recording) Trim();
+}
+void MapJournal::Clear() {
+	Discard();
+	depth = 0; // Whatever step was open goes with the rest
+}
+void MapJournal::Discard() {
+	for(deque<uint8 *>::iterator i = blocks.begin(); i != blocks.end(); ++i) delete[] *i;
+	blocks.clear();
+	steps.clear();
+	base = end = 0;
+	cursor = 0;
+	room = 0;
+	current = 0;
+	recording = false;
+}
+void MapJournal::PutBytes(const uint8 *data, uint32 size) {
+	while(size) {
+		if(room == 0) Locate();
+		uint32 part = min(size, room);
+		memcpy(cursor, data, part);
+		cursor += part;
+		room -= part;
+		end += part;
+		data += part;
+		size -= part;
+	}
+}
+void MapJournal::Open() {
+	// A new step takes the place of everything that could have been redone
+	if(current != steps.size()) steps.erase(steps.begin() + current, steps.end());
+	if(steps.empty()) Discard();
+	else end = steps.back().offset + steps.back().size;
+	room = 0; // The cursor may have been past the new end
+	Step step = { end, 0, 0 };
+	steps.push_back(step);
+	lastX = lastY = 0;
+	recording = true;
+}
+void MapJournal::Locate() {
+	uint64 position = end - base;
+	if(position == uint64(blocks.size()) * BLOCK_SIZE) blocks.push_back(new uint8[BLOCK_SIZE]);
+	cursor = blocks[uint32(position / BLOCK_SIZE)] + uint32(position % BLOCK_SIZE);
+	room = BLOCK_SIZE - uint32(position % BLOCK_SIZE);
+}
+void MapJournal::Read(const Step &step, vector<Edit> &edits) const {
+	edits.resize(step.count);
+	uint64 position = step.offset - base;
+	const uint8 *data = blocks[uint32(position / BLOCK_SIZE)] + uint32(position % BLOCK_SIZE);
+	uint32 left = BLOCK_SIZE - uint32(position % BLOCK_SIZE), block = uint32(position / BLOCK_SIZE);
+	int x = 0, y = 0;
+	for(uint32 i = 0; i < step.count; ++i) {
+		uint64 numbers[4];
+		for(int j = 0; j < 4; ++j) {
+			uint64 number = 0;
+			for(int shift = 0; ; shift += 7) {
+				if(left == 0) {
+					data = blocks[++block];
+					left = BLOCK_SIZE;
+				}
+				uint8 byte = *data++;
+				--left;
+				number |= uint64(byte & 0x7F) << shift;
+				if(!(byte & 0x80)) break;
+			}
+			numbers[j] = number;
+		}
+		x = Unfold(x, uint32(numbers[0]));
+		y = Unfold(y, uint32(numbers[1] >> LAYER_BITS));
+		Edit edit = { x, y, uint32(numbers[2]) - 1, uint32(numbers[3]) - 1,
+			uint8(numbers[1] & ((1 << LAYER_BITS) - 1)) };
+		edits[i] = edit;
+	}
+}
+void MapJournal::Batch::Record(int x, int y, uint32 before, uint32 after, uint8 layer) {
+	if(data.size() < size + MAX_EDIT_SIZE) data.resize(max<uint32>(data.size() * 2, 1024));
+	uint8 *start = &data[size], *end = start;
+	if(count == 0) {
+		firstX = x;
+		firstY = y;
+		firstLayer = layer;
+	} else {
+		end = PutNumber(end, Fold(lastX, x));
+		end = PutNumber(end, Row(Fold(lastY, y), layer));
+	}
+	end = PutNumber(end, before + 1);
+	end = PutNumber(end, after + 1);
+	size += uint32(end - start);
+	lastX = x;
+	lastY = y;
+	++count;
+}
+void MapJournal::Batch::Clear() {
+	size = 0;
+	count = 0;
+}
+void MapJournal::Trim() {
+	// Only steps that can be undone are discarded; the redo history stays whole
+	while(current != 0 && steps.size() > 1 &&
+		end - steps.front().offset + steps.size() * sizeof(Step) > memoryCap) {
+		steps.pop_front();
+		--current;
+	}
+	if(steps.empty()) return;
+	while(steps.front().offset - base >= BLOCK_SIZE) {
+		delete[] blocks.front();
+		blocks.pop_front();
+		base += BLOCK_SIZE;
+	}
+}
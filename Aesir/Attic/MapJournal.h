@@ -0,0 +1,86 @@
+#pragma once
+#include <deque>
+#include <vector>
+
+/* The edit history of a map, as a list of steps that can be undone and redone. A step is every
+ * edit made between the outermost BeginStep and EndStep, so that a whole paint drag or a fill
+ * undoes at once; an edit made outside of a step is a step of its own. Each edit is kept as the
+ * cell that changed, the layer of the cell, and its value before and after, packed as varints
+ * with the cell relative to the one before it and the layer in the low bits of the row, so a row
+ * of edits costs a few bytes apiece and history grows with the size of the edits rather than
+ * with the map.
+ *
+ * The edits go into an arena of BLOCK_SIZE blocks that is only ever appended to, apart from
+ * dropping the steps that could have been redone when a new step begins. Once the steps take
+ * up more than the memory cap, the oldest ones are discarded, block by block; the newest step
+ * is always kept, however big it is, and so are the steps that could be redone. */
+class MapJournal {
+public:
+	static const uint32 BLOCK_SIZE = 64 * 1024;
+	static const uint32 DEFAULT_MEMORY_CAP = 64 * 1024 * 1024;
+	static const uint32 MAX_EDIT_SIZE = 4 * 5; // Four varints of up to five bytes each
+	static const int LAYER_BITS = 2; // Enough for every layer of a map
+	struct Edit {
+		int x, y;
+		uint32 before, after;
+		uint8 layer; // Whatever the map numbers its layers as; 0 is the first
+	};
+	/* Edits packed apart from any journal, so that a bulk edit can pack them on many threads at
+	 * once and then Append them all; appending only has to copy the bytes. */
+	class Batch {
+	public:
+		void Record(int x, int y, uint32 before, uint32 after, uint8 layer = 0);
+		void Clear();
+		inline uint32 GetCount() const { return count; }
+		inline Batch() : size(0), count(0) { }
+	private:
+		friend class MapJournal;
+		std::vector<uint8> data; // Each edit after the first is relative to the one before it
+		uint32 size; // The bytes of data in use
+		int firstX, firstY, lastX, lastY;
+		uint8 firstLayer;
+		uint32 count;
+	};
+	void BeginStep();
+	void EndStep();
+	void Record(int x, int y, uint32 before, uint32 after, uint8 layer = 0);
+	void Append(const Batch &batch); // Record every edit of a batch, in order
+	/* Step back or forward, filling edits with the edits of the step in the order that they
+	 * were made; Undo has to apply them in reverse. Returns false if there's nothing to do. */
+	bool Undo(std::vector<Edit> &edits);
+	bool Redo(std::vector<Edit> &edits);
+	// A step that is still being recorded can't be undone
+	inline bool CanUndo() const { return (depth == 0 && current != 0); }
+	inline bool CanRedo() const { return (depth == 0 && current != steps.size()); }
+	void SetMemoryCap(uint32 bytes); // 0 keeps no history at all
+	inline bool IsEnabled() const { return (memoryCap != 0); } // Edits needn't be recorded if not
+	inline uint32 GetMemoryBytes() const { return blocks.size() * BLOCK_SIZE + steps.size() * sizeof(Step); }
+	inline uint32 GetStepCount() const { return steps.size(); }
+	void Clear();
+	inline MapJournal() : base(0), end(0), cursor(0), room(0), current(0), depth(0), recording(false),
+		memoryCap(DEFAULT_MEMORY_CAP) { }
+	~MapJournal();
+private:
+	// Offsets count every byte that has gone into the arena, including the ones since discarded
+	struct Step {
+		uint64 offset;
+		uint32 size, count; // In bytes, and in edits
+	};
+	std::deque<uint8 *> blocks;
+	uint64 base; // The offset of the first byte of the first block
+	uint64 end; // The offset that the next byte goes at
+	uint8 *cursor; // Where end lies in its block, if room isn't 0
+	uint32 room; // Bytes left in the block after the cursor
+	std::deque<Step> steps;
+	uint32 current; // The steps before this one can be undone, and the rest redone
+	uint32 depth; // How many BeginSteps are waiting for their EndSteps
+	bool recording; // Whether the last step is the one being recorded
+	int lastX, lastY; // The cell of the last edit recorded, which the next is relative to
+	uint32 memoryCap;
+	void PutBytes(const uint8 *data, uint32 size);
+	void Open(); // Start recording a step
+	void Discard(); // Free every step and block; unlike Clear, a step that is open stays open
+	void Locate(); // Point the cursor at end, adding a block if end is past the last one
+	void Read(const Step &step, std::vector<Edit> &edits) const;
+	void Trim(); // Discard the oldest undoable steps and the blocks they leave empty while over the cap
+};
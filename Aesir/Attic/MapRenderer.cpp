@@ -0,0 +1,142 @@
+#include "stdwx.h"
+#include "MapRenderer.h"
+#include "TileLoader.h"
+#include "PipelineStats.h"
+#include <cstring>
+#include <algorithm>
+#include <gl/gl.h>
+using namespace std;
+
+// Division that rounds towards negative infinity, since the map goes on past 0 in every direction
+static inline int FloorDivide(int dividend, int divisor) {
+	return (dividend >= 0)?dividend / divisor:-((divisor - 1 - dividend) / divisor); }
+static inline bool IsAbove(const MapDocument::Chunk *a, const MapDocument::Chunk *b) {
+	return a->GetTop() < b->GetTop() || (a->GetTop() == b->GetTop() && a->GetLeft() < b->GetLeft()); }
+
+MapRenderer::MapRenderer() : frame(0) {
+	memset(&stats, 0, sizeof(Stats));
+}
+void MapRenderer::Render(MapDocument &mapDocument, const wxRect &view) {
+	++frame;
+	stats.chunks = stats.listed = stats.rebuilt = 0;
+	int left = FloorDivide(view.GetLeft(), CELL_SIZE), top = FloorDivide(view.GetTop(), CELL_SIZE);
+	wxRect area(left, top, FloorDivide(view.GetRight(), CELL_SIZE) - left + 1,
+		FloorDivide(view.GetBottom(), CELL_SIZE) - top + 1 + MapDocument::CHUNK_SIZE);
+	mapDocument.LoadArea(area);
+	// The lists leave no page bound, and the atlas has to know that they do
+	textureAtlas.Unbind();
+	visible.clear();
+	for(MapDocument::ChunkIterator chunk(mapDocument, area); !chunk.IsDone(); ++chunk) visible.push_back(&*chunk);
+	sort(visible.begin(), visible.end(), IsAbove);
+	spriteBatch.Begin();
+	for(vector<const MapDocument::Chunk *>::iterator i = visible.begin(); i != visible.end(); ++i) {
+		const MapDocument::Chunk *chunk = *i;
+		CachedChunk &cachedChunk = chunks[make_pair(chunk->GetLeft(), chunk->GetTop())];
+		if(cachedChunk.version != chunk->GetVersion()) Rebuild(cachedChunk, *chunk, mapDocument.GetObjects());
+		cachedChunk.drawnFrame = frame;
+		++stats.chunks;
+		int x = chunk->GetLeft() * CELL_SIZE - view.GetLeft(), y = chunk->GetTop() * CELL_SIZE - view.GetTop();
+		if(cachedChunk.list || Compile(cachedChunk)) {
+			spriteBatch.Flush(); // The chunks before this one go first
+			glPushMatrix();
+			glTranslatef(float(x), float(y), 0);
+			glCallList(cachedChunk.list);
+			glPopMatrix();
+			++stats.listed;
+			STATS_COUNT_GL(DRAW_CALLS, 1);
+			continue;
+		}
+		Draw(spriteBatch, cachedChunk, x, y);
+	}
+	spriteBatch.End();
+	textureAtlas.Unbind();
+	Trim();
+	stats.cached = chunks.size();
+}
+wxPoint MapRenderer::GetCell(const wxPoint &pixel) {
+	return wxPoint(FloorDivide(pixel.x, CELL_SIZE), FloorDivide(pixel.y, CELL_SIZE));
+}
+void MapRenderer::Clear() {
+	for(ChunkMap::iterator i = chunks.begin(); i != chunks.end(); ++i) Delete(i->second);
+	chunks.clear();
+	stats.cached = 0;
+}
+void MapRenderer::Rebuild(CachedChunk &cachedChunk, const MapDocument::Chunk &chunk, const ObjectTable &objects) {
+	Delete(cachedChunk);
+	tileIdentifiers.clear();
+	cachedChunk.cells.clear();
+	cachedChunk.levels.clear();
+	const uint32 *tiles = chunk.GetTiles();
+	for(int cell = 0; cell < MapDocument::CHUNK_SIZE * MapDocument::CHUNK_SIZE; ++cell) {
+		if(tiles[cell] >= TileLoader::numTiles[TypeTile]) continue; // Empty, or not a tile at all
+		tileIdentifiers.push_back(TileIdentifier(tiles[cell], TypeTile));
+		cachedChunk.cells.push_back(uint16(cell));
+		cachedChunk.levels.push_back(0);
+	}
+	cachedChunk.floorCount = cachedChunk.cells.size();
+	// Rows further down come later, so their objects cover the ones behind them
+	const uint16 *cellObjects = chunk.GetObjects();
+	for(int cell = 0; cell < MapDocument::CHUNK_SIZE * MapDocument::CHUNK_SIZE; ++cell) {
+		uint16 object = cellObjects[cell];
+		if(object == MapDocument::NO_OBJECT || object >= objects.GetCount()) continue;
+		const uint32 *stack = objects.GetTiles(object);
+		for(uint32 level = 0; level < objects.GetHeight(object); ++level) {
+			if(stack[level] >= TileLoader::numTiles[TypeObject]) continue;
+			tileIdentifiers.push_back(TileIdentifier(stack[level], TypeObject));
+			cachedChunk.cells.push_back(uint16(cell));
+			cachedChunk.levels.push_back(uint16(level));
+		}
+	}
+	tileManager.RequestBatchAsync(tileIdentifiers, cachedChunk.handles);
+	cachedChunk.version = chunk.GetVersion();
+	++stats.rebuilt;
+}
+bool MapRenderer::Compile(CachedChunk &cachedChunk) {
+	for(vector<TileHandle>::iterator i = cachedChunk.handles.begin(); i != cachedChunk.handles.end(); ++i)
+		if(!i->IsLoaded() || (*i)->IsIndexed()) return false;
+	cachedChunk.list = glGenLists(1);
+	if(!cachedChunk.list) return false;
+	// Every page that the list needs has to be bound in it, so start from none
+	textureAtlas.Unbind();
+	glNewList(cachedChunk.list, GL_COMPILE);
+	listBatch.Begin();
+	Draw(listBatch, cachedChunk, 0, 0);
+	textureAtlas.Unbind();
+	glEndList();
+	return true;
+}
+void MapRenderer::Draw(SpriteBatch &batch, CachedChunk &cachedChunk, int x, int y) {
+	for(uint32 i = 0; i < cachedChunk.handles.size(); ++i) {
+		uint16 cell = cachedChunk.cells[i];
+		// Pages are drawn one after another, so flush wherever one pass has to cover the last
+		if(i >= cachedChunk.floorCount && (i == cachedChunk.floorCount ||
+			(cell >> MapDocument::CHUNK_SHIFT) != (cachedChunk.cells[i - 1] >> MapDocument::CHUNK_SHIFT))) {
+			batch.Flush();
+			if(i == cachedChunk.floorCount) {
+				// Objects have clear pixels around them, which mustn't cover what's underneath
+				glPushAttrib(GL_ENABLE_BIT | GL_COLOR_BUFFER_BIT);
+				glEnable(GL_ALPHA_TEST);
+				glAlphaFunc(GL_GREATER, 0);
+			}
+		}
+		batch.Draw(cachedChunk.handles[i], x + (cell & (MapDocument::CHUNK_SIZE - 1)) * CELL_SIZE,
+			y + ((cell >> MapDocument::CHUNK_SHIFT) - cachedChunk.levels[i]) * CELL_SIZE);
+	}
+	batch.Flush();
+	if(cachedChunk.floorCount < cachedChunk.handles.size()) glPopAttrib();
+}
+void MapRenderer::Delete(CachedChunk &cachedChunk) {
+	if(cachedChunk.list) glDeleteLists(cachedChunk.list, 1);
+	cachedChunk.list = 0;
+	cachedChunk.handles.clear();
+}
+void MapRenderer::Trim() {
+	for(ChunkMap::iterator i = chunks.begin(); i != chunks.end(); ) {
+		if(i->second.drawnFrame == frame) {
+			++i;
+			continue;
+		}
+		Delete(i->second);
+		chunks.erase(i++);
+	}
+}
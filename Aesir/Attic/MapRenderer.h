@@ -0,0 +1,70 @@
+#pragma once
+#include <map>
+#include <vector>
+#include <utility>
+#include "MapDocument.h"
+#include "TileManager.h"
+#include "SpriteBatch.h"
+typedef unsigned int GLuint;
+
+/* Draws the part of a map that is in view, a chunk at a time. Only the chunks that overlap the
+ * view are looked at, so a frame costs the same however big the map is. A chunk draws its floor
+ * and then its objects, each a stack of tiles from its cell upwards, reading each layer straight
+ * through. The chunks go from the top row down, so that an object covers what is behind it even
+ * where it stands up into the chunk above, and the view reaches a chunk further down than it
+ * shows, for the objects that stand up into it. Each chunk in view keeps handles to
+ * its tiles and, once they've all loaded, a display list that draws the whole chunk; the list is
+ * built again only when the chunk's version changes. Chunks with tiles that are still loading, or
+ * that are kept as indices and so have no fixed slot, are drawn through a SpriteBatch instead,
+ * in their place among the others.
+ * A chunk that goes out of view lets go of its tiles and its list at the end of the frame, so
+ * only the tiles in view are held and the rest fall under tileManager's budgets; a chunk that
+ * comes back finds its tiles there while they're resident, and only its list is built again.
+ * The lists are display lists because the editor uses OpenGL 1.1 as gl.h declares it, and
+ * loads no buffer object entry points.
+ *
+ * Only the GL thread may use a renderer, and tileManager.UploadCompleted has to start the frame.
+ * The lists belong to the context that was current when they were built, so make it current
+ * again before Clear. */
+class MapRenderer {
+public:
+	static const int CELL_SIZE = TextureAtlas::SLOT_SIZE; // Pixels on each side of a cell
+	struct Stats {
+		uint32 chunks; // Chunks drawn in the last frame
+		uint32 listed; // How many of them were drawn from their lists
+		uint32 rebuilt; // How many had changed, or hadn't been drawn before
+		uint32 cached; // Chunks holding tiles and lists, which are the ones in view
+	};
+	// Draw the cells that lie within view, a rectangle of the map in pixels, from 0, 0 down
+	void Render(MapDocument &mapDocument, const wxRect &view);
+	void Clear(); // Delete the lists and let go of the tiles
+	static wxPoint GetCell(const wxPoint &pixel); // The cell that a pixel of the map lies in
+	inline const Stats &GetStats() const { return stats; }
+	MapRenderer();
+private:
+	struct CachedChunk {
+		uint32 version; // The version of the chunk that the handles were requested for
+		GLuint list; // 0 until every tile has loaded
+		std::vector<TileHandle> handles;
+		std::vector<uint16> cells; // Where each handle goes in the chunk, row by row
+		std::vector<uint16> levels; // How many cells above its own each handle goes, for objects
+		uint32 floorCount; // The handles of the floor come first, then the objects row by row
+		uint32 drawnFrame;
+		inline CachedChunk() : version(0), list(0), floorCount(0), drawnFrame(0) { }
+	};
+	typedef std::map<std::pair<int, int>, CachedChunk> ChunkMap; // By the chunk's corner, in cells
+	ChunkMap chunks;
+	SpriteBatch spriteBatch;
+	SpriteBatch listBatch; // For building lists, without flushing what the frame has queued
+	std::vector<TileIdentifier> tileIdentifiers; // Where Rebuild gathers the tiles of a chunk
+	std::vector<const MapDocument::Chunk *> visible; // The chunks of a frame, in the order they're drawn
+	uint32 frame;
+	Stats stats;
+	void Rebuild(CachedChunk &cachedChunk, const MapDocument::Chunk &chunk, const ObjectTable &objects);
+	bool Compile(CachedChunk &cachedChunk); // Returns false if the chunk can't be listed yet
+	/* Draw a chunk through a batch with its corner at x, y: the floor, and then the objects a row
+	 * at a time, since they stand over the rows above. The batch is flushed after each. */
+	void Draw(SpriteBatch &batch, CachedChunk &cachedChunk, int x, int y);
+	void Delete(CachedChunk &cachedChunk);
+	void Trim(); // Drop the chunks that weren't drawn in this frame, and their tiles
+};
@@ -1,15 +1,38 @@
 #include "stdwx.h"
 #include "MapView.h"
 #include "MapEditor.h"
+#include "MapDocument.h"
+#include "MapRenderer.h"
 #include "BasicCanvas.h"
 #include "TileManager.h"
+#include "PipelineStats.h"
 #include <wx/docmdi.h>
 IMPLEMENT_DYNAMIC_CLASS(MapView, wxView)
 
 class MapView::GraphicsCanvas : public BasicCanvas {
 public:
-	inline GraphicsCanvas(wxWindow *parent) : BasicCanvas(parent) { }
+	GraphicsCanvas(wxWindow *parent, MapView *mapView_);
+	~GraphicsCanvas();
 	void Render();
+	void EndPaint();
+private:
+	MapView *mapView;
+	MapRenderer mapRenderer;
+	wxPoint origin; // The pixel of the map that is drawn at the top left corner of the canvas
+	wxPoint dragPosition; // Where the mouse was the last time that the map was dragged
+	bool painting; // Whether a paint drag has a step open in the document's journal
+	std::vector<uint32> pattern; // The stamp being painted, as map tiles
+	wxSize stampSize;
+	/* The objects of the stamp, one for each column that has object tiles, as the cell that the
+	 * stack stands on, relative to the stamp, and its id in the document's object table */
+	std::vector<std::pair<wxPoint, uint16> > stampObjects;
+	wxPoint paintedCell; // Where the stamp was painted last in this drag
+	void HandleMiddleDrag(wxMouseEvent &event); // Dragging with the middle button pans the map
+	/* Dragging with the left button paints the stamp, and undoes as one step; clicking with
+	 * control held flood fills with the stamp's top left tile */
+	void HandlePaintDrag(wxMouseEvent &event);
+	void OnCaptureLost(wxMouseCaptureLostEvent &event);
+	DECLARE_EVENT_TABLE()
 };
 class MapView::ChildFrame : public wxDocMDIChildFrame {
 public:
@@ -22,28 +45,145 @@ private:
 	DECLARE_EVENT_TABLE()
 };
 
+BEGIN_EVENT_TABLE(MapView::GraphicsCanvas, BasicCanvas)
+	EVT_MIDDLE_DOWN(MapView::GraphicsCanvas::HandleMiddleDrag)
+	EVT_MIDDLE_UP(MapView::GraphicsCanvas::HandleMiddleDrag)
+	EVT_MOTION(MapView::GraphicsCanvas::HandleMiddleDrag)
+	EVT_LEFT_DOWN(MapView::GraphicsCanvas::HandlePaintDrag)
+	EVT_LEFT_UP(MapView::GraphicsCanvas::HandlePaintDrag)
+	EVT_MOTION(MapView::GraphicsCanvas::HandlePaintDrag)
+	EVT_MOUSE_CAPTURE_LOST(MapView::GraphicsCanvas::OnCaptureLost)
+END_EVENT_TABLE()
 BEGIN_EVENT_TABLE(MapView::ChildFrame, wxDocMDIChildFrame)
 	EVT_SIZE(MapView::ChildFrame::OnSize)
 END_EVENT_TABLE()
 
 MapView::ChildFrame::ChildFrame(wxDocument *doc, MapView *mapView_, wxMDIParentFrame *parent) :
-	wxDocMDIChildFrame(doc, mapView_, parent, -1, ""), mapView(mapView_) {
+	wxDocMDIChildFrame(doc, mapView_, parent, -1, ""), graphicsCanvas(0), mapView(mapView_) {
 	this->Show();
-	graphicsCanvas = new GraphicsCanvas(this);
+	graphicsCanvas = new GraphicsCanvas(this, mapView);
+	graphicsCanvas->SetSize(GetClientSize());
+	mapView->graphicsCanvas = graphicsCanvas;
+}
+void MapView::ChildFrame::OnSize(wxSizeEvent &event) {
+	if(graphicsCanvas) graphicsCanvas->SetSize(GetClientSize());
+}
+MapView::GraphicsCanvas::GraphicsCanvas(wxWindow *parent, MapView *mapView_) :
+	BasicCanvas(parent), mapView(mapView_), origin(0, 0), painting(false) {
+	tileManager.AddListener(this);
+}
+MapView::GraphicsCanvas::~GraphicsCanvas() {
+	tileManager.RemoveListener(this);
+	EndPaint();
+	this->SetCurrent(); // The lists were built in this context
+	mapRenderer.Clear();
 }
-void MapView::ChildFrame::OnSize(wxSizeEvent &event) { }
 void MapView::GraphicsCanvas::Render() {
+	STATS_TIME(FRAME_RENDER);
+	tileManager.UploadCompleted(); // This makes the main context current, so do it first
 	this->SetCurrent();
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+	mapRenderer.Render(*(MapDocument *)mapView->GetDocument(), wxRect(origin, GetClientSize()));
 	this->SwapBuffers();
 }
+void MapView::GraphicsCanvas::HandleMiddleDrag(wxMouseEvent &event) {
+	if(event.MiddleDown()) {
+		dragPosition = event.GetPosition();
+		this->SetCursor(wxCURSOR_SIZING);
+		this->CaptureMouse();
+	} else if(event.MiddleUp()) {
+		this->SetCursor(wxNullCursor);
+		if(this->HasCapture()) this->ReleaseMouse();
+	} else if(event.MiddleIsDown()) {
+		origin -= event.GetPosition() - dragPosition;
+		dragPosition = event.GetPosition();
+		Render();
+	}
+	event.Skip(); // Motion is for painting too
+}
+void MapView::GraphicsCanvas::HandlePaintDrag(wxMouseEvent &event) {
+	MapDocument *mapDocument = (MapDocument *)mapView->GetDocument();
+	if(event.LeftDown()) {
+		const TileSelection::Stamp &stamp = mapEditor->selection.GetStamp();
+		stampSize = wxSize(stamp.shape()[1], stamp.shape()[0]);
+		pattern.assign(stamp.num_elements(), MapDocument::NO_TILE);
+		for(uint32 i = 0; i < pattern.size(); ++i) {
+			TileIdentifier tileIdentifier = stamp.data()[i];
+			if(tileIdentifier.second == TypeTile) pattern[i] = tileIdentifier.first;
+		}
+		if(pattern.empty()) return;
+		wxPoint cell = MapRenderer::GetCell(origin + event.GetPosition());
+		if(event.ControlDown()) {
+			if(pattern[0] == MapDocument::NO_TILE) return;
+			// Flood as far as the edges of the view, since the map has none
+			wxPoint first = MapRenderer::GetCell(origin),
+				last = MapRenderer::GetCell(origin + GetClientSize() - wxSize(1, 1));
+			mapDocument->FloodFill(cell.x, cell.y, pattern[0], wxRect(first, last));
+			Render();
+			return;
+		}
+		// The object tiles of each column stack up from the lowest of them
+		stampObjects.clear();
+		try {
+			for(int x = 0; x < stampSize.GetWidth(); ++x) {
+				std::vector<uint32> tiles;
+				int bottom = -1;
+				for(int y = stampSize.GetHeight() - 1; y >= 0; --y) {
+					TileIdentifier tileIdentifier = stamp[y][x];
+					if(tileIdentifier.second != TypeObject || tileIdentifier.first == MapDocument::NO_TILE) continue;
+					if(bottom == -1) bottom = y;
+					tiles.push_back(tileIdentifier.first);
+				}
+				if(tiles.empty()) continue;
+				uint16 object = mapDocument->GetObjects().Add(&tiles[0], tiles.size());
+				stampObjects.push_back(std::make_pair(wxPoint(x, bottom), object));
+			}
+		}
+		catch(std::exception &e) {
+			wxMessageBox(e.what());
+			return;
+		}
+		mapDocument->GetJournal().BeginStep();
+		painting = true;
+		paintedCell = wxPoint(cell.x - 1, cell.y); // Anywhere but the cell under the mouse
+		this->CaptureMouse();
+	} else if(event.LeftUp()) {
+		if(this->HasCapture()) this->ReleaseMouse();
+		EndPaint();
+		return;
+	} else if(!painting || !event.LeftIsDown()) return;
+	wxPoint cell = MapRenderer::GetCell(origin + event.GetPosition());
+	if(cell == paintedCell) return;
+	paintedCell = cell;
+	mapDocument->PaintPattern(wxRect(cell, stampSize), &pattern[0], stampSize.GetWidth(), stampSize.GetHeight());
+	for(uint32 i = 0; i < stampObjects.size(); ++i)
+		mapDocument->InsertObject(cell.x + stampObjects[i].first.x, cell.y + stampObjects[i].first.y,
+			stampObjects[i].second);
+	Render();
+}
+void MapView::GraphicsCanvas::OnCaptureLost(wxMouseCaptureLostEvent &event) {
+	EndPaint();
+	this->SetCursor(wxNullCursor);
+}
+void MapView::GraphicsCanvas::EndPaint() {
+	if(!painting) return;
+	painting = false;
+	((MapDocument *)mapView->GetDocument())->GetJournal().EndStep();
+}
 bool MapView::OnCreate(wxDocument *doc, long flags) {
 	this->SetFrame(new ChildFrame(doc, this, mainFrame));
 	return true;
 }
+void MapView::OnUpdate(wxView *sender, wxObject *hint) {
+	if(!graphicsCanvas) return;
+	// A drag can't go on into another map; its stamp's objects were in the old one's table
+	if(hint == &MapDocument::contentsReplaced) graphicsCanvas->EndPaint();
+	graphicsCanvas->Refresh(false);
+}
 bool MapView::OnClose(bool deleteWindow) {
 	if(!GetDocument()->Close()) return false;
 	this->Activate(false);
+	graphicsCanvas = 0;
 	if(deleteWindow) delete GetFrame();
 	return true;
-}
\ No newline at end of file
+}
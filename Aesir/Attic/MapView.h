@@ -5,12 +5,14 @@ class MapView : public wxView {
 	DECLARE_DYNAMIC_CLASS(MapView)
 public:
 	bool OnCreate(wxDocument *doc, long flags);
-	void OnUpdate(wxView *sender, wxObject *hint) { } // TODO
-	void OnDraw(wxDC *dc) { } // TODO
+	void OnUpdate(wxView *sender, wxObject *hint);
+	void OnDraw(wxDC *dc) { } // The canvas draws the map itself, with OpenGL
 	bool OnClose(bool deleteWindow);
+	inline MapView() : graphicsCanvas(0) { }
 private:
 	friend class GraphicsCanvas;
 	friend class ChildFrame;
 	class GraphicsCanvas;
 	class ChildFrame;
+	GraphicsCanvas *graphicsCanvas; // 0 until the frame has been made
 };
\ No newline at end of file
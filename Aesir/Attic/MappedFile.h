@@ -0,0 +1,56 @@
+#pragma once
+#include <string>
+#include <exception>
+#include <boost/iostreams/device/mapped_file.hpp>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <boost/filesystem/operations.hpp>
+#endif
+
+/* A read-only memory mapped file. Data is handed out as pointers straight into the mapping,
+ * so nothing is copied; At() makes sure that the requested range lies within the file. */
+class MappedFile {
+public:
+	inline void Open(const std::string &path) { file.open(path); }
+	inline void Close() { file.close(); }
+	inline bool IsOpen() const { return file.is_open(); }
+	inline uint32 GetSize() const { return uint32(file.size()); }
+	// Get a pointer to count objects of type T at the specified offset
+	template<class T> inline const T *At(uint32 offset, uint32 count = 1) const {
+		if(offset > GetSize() || count > (GetSize() - offset) / sizeof(T))
+			/* TODO: Better error handling */ throw std::exception("Read past the end of a file");
+		return (const T *)(file.data() + offset);
+	}
+private:
+	boost::iostreams::mapped_file_source file;
+};
+// Reads through a MappedFile sequentially, in the same manner as an istream
+class MappedReader {
+public:
+	inline MappedReader(const MappedFile &file_, uint32 offset_ = 0) :
+		file(file_), offset(offset_) { }
+	template<class T> inline const T *Read(uint32 count = 1) {
+		const T *data = file.At<T>(offset, count);
+		offset += count * sizeof(T);
+		return data;
+	}
+	template<class T> inline T Get() { return *Read<T>(); }
+	inline void Skip(uint32 amount) { offset += amount; }
+	inline void Seek(uint32 offset_) { offset = offset_; }
+	inline uint32 Tell() const { return offset; }
+	inline const MappedFile &GetFile() const { return file; }
+private:
+	const MappedFile &file;
+	uint32 offset;
+};
+/* Move the file at from to path, replacing whatever is there in one step, so that path is
+ * never left without a whole file */
+inline void ReplaceFileAt(const std::string &path, const std::string &from) {
+#ifdef _WIN32
+	if(!MoveFileExA(from.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH))
+		throw std::exception("Couldn't replace a file");
+#else
+	boost::filesystem::rename(from, path); // rename() replaces the target atomically
+#endif
+}
@@ -0,0 +1,48 @@
+#include "stdwx.h"
+#include "ObjectTable.h"
+#include <exception>
+using namespace std;
+
+ObjectTable::ObjectTable() {
+	Clear();
+}
+uint16 ObjectTable::Add(const uint32 *tiles_, uint32 height) {
+	if(height == 0) return NO_OBJECT;
+	vector<uint32> stack(tiles_, tiles_ + height);
+	map<vector<uint32>, uint16>::iterator id = ids.find(stack);
+	if(id != ids.end()) return id->second;
+	if(offsets.size() - 1 == MAX_OBJECTS) throw exception("The map has too many different objects");
+	uint16 object = uint16(offsets.size() - 1);
+	tiles.insert(tiles.end(), stack.begin(), stack.end());
+	offsets.push_back(tiles.size());
+	ids.insert(make_pair(stack, object));
+	return object;
+}
+void ObjectTable::Clear() {
+	tiles.clear();
+	offsets.assign(2, 0); // NO_OBJECT starts and ends at 0
+	ids.clear();
+}
+void ObjectTable::Write(vector<uint32> &data) const {
+	data.clear();
+	for(uint32 object = 1; object < offsets.size() - 1; ++object) {
+		data.push_back(GetHeight(uint16(object)));
+		data.insert(data.end(), tiles.begin() + offsets[object], tiles.begin() + offsets[object + 1]);
+	}
+}
+void ObjectTable::Read(const uint32 *data, uint32 size) {
+	Clear();
+	for(const uint32 *end = data + size; data != end; ) {
+		uint32 height = *data++;
+		if(height == 0 || height > uint32(end - data) || offsets.size() - 1 == MAX_OBJECTS) {
+			Clear();
+			throw exception("The map's objects are damaged");
+		}
+		// Ids are places in the table, so even a stack that is already in it takes one
+		uint16 object = uint16(offsets.size() - 1);
+		tiles.insert(tiles.end(), data, data + height);
+		offsets.push_back(tiles.size());
+		ids.insert(make_pair(vector<uint32>(data, data + height), object));
+		data += height;
+	}
+}
@@ -0,0 +1,28 @@
+#pragma once
+#include <map>
+#include <vector>
+
+/* The objects that the cells of a map can hold. An object is a stack of object tiles, from the
+ * one on its cell upwards, the way the game's object info lays them out; a cell only holds the
+ * object's id, its place in the table, so the object layer of a chunk is an array of small
+ * integers however tall its objects are. The same stack is kept once, and ids are never given
+ * back, since the journal and the map's file may still refer to them. */
+class ObjectTable {
+public:
+	static const uint16 NO_OBJECT = 0; // The object of a cell that has none; it has no tiles
+	static const uint32 MAX_OBJECTS = 0x10000; // Counting NO_OBJECT
+	// The id of a stack, which is added if it's new; throws if the table is full
+	uint16 Add(const uint32 *tiles, uint32 height);
+	inline uint32 GetCount() const { return offsets.size() - 1; } // Counting NO_OBJECT
+	inline uint32 GetHeight(uint16 object) const { return offsets[object + 1] - offsets[object]; }
+	inline const uint32 *GetTiles(uint16 object) const { return tiles.empty()?0:&tiles[offsets[object]]; }
+	void Clear();
+	// Each object after NO_OBJECT, as its height and then its tiles
+	void Write(std::vector<uint32> &data) const;
+	void Read(const uint32 *data, uint32 size); // Throws if the data is damaged
+	ObjectTable();
+private:
+	std::vector<uint32> tiles; // Every stack, one after the other
+	std::vector<uint32> offsets; // Where each object's stack starts in tiles, and where the last ends
+	std::map<std::vector<uint32>, uint16> ids;
+};
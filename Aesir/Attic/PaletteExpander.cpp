@@ -0,0 +1,151 @@
+#include "stdwx.h"
+#include "PaletteExpander.h"
+#include <vector>
+#include <algorithm>
+#include <boost/thread/once.hpp>
+#include <emmintrin.h>
+#include <smmintrin.h>
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define KERNEL_TARGET(name)
+#else
+#include <cpuid.h>
+#define KERNEL_TARGET(name) __attribute__((target(name)))
+#endif
+using namespace std;
+
+typedef void (*PaletteKernel)(const uint8 *, uint32 *, uint32, const uint32 *);
+
+void ExpandPaletteScalar(const uint8 *indices, uint32 *pixels, uint32 count, const uint32 *lut) {
+	for(uint32 i = 0; i < count; ++i)
+		pixels[i] = lut[indices[i]];
+}
+// Four lookups are assembled in a register and written out with one store
+KERNEL_TARGET("sse4.1") static void ExpandPaletteSSE4(
+	const uint8 *indices, uint32 *pixels, uint32 count, const uint32 *lut) {
+	uint32 i = 0;
+	for(; i + 8 <= count; i += 8) {
+		__m128i low = _mm_cvtsi32_si128(lut[indices[i + 0]]);
+		low = _mm_insert_epi32(low, lut[indices[i + 1]], 1);
+		low = _mm_insert_epi32(low, lut[indices[i + 2]], 2);
+		low = _mm_insert_epi32(low, lut[indices[i + 3]], 3);
+		__m128i high = _mm_cvtsi32_si128(lut[indices[i + 4]]);
+		high = _mm_insert_epi32(high, lut[indices[i + 5]], 1);
+		high = _mm_insert_epi32(high, lut[indices[i + 6]], 2);
+		high = _mm_insert_epi32(high, lut[indices[i + 7]], 3);
+		_mm_storeu_si128((__m128i *)(pixels + i), low);
+		_mm_storeu_si128((__m128i *)(pixels + i + 4), high);
+	}
+	ExpandPaletteScalar(indices + i, pixels + i, count - i, lut);
+}
+// Eight indices are widened to dwords and looked up with a single gather
+KERNEL_TARGET("avx2") static void ExpandPaletteAVX2(
+	const uint8 *indices, uint32 *pixels, uint32 count, const uint32 *lut) {
+	uint32 i = 0;
+	for(; i + 16 <= count; i += 16) {
+		__m128i packed = _mm_loadu_si128((const __m128i *)(indices + i));
+		__m256i low = _mm256_cvtepu8_epi32(packed);
+		__m256i high = _mm256_cvtepu8_epi32(_mm_srli_si128(packed, 8));
+		_mm256_storeu_si256((__m256i *)(pixels + i),
+			_mm256_i32gather_epi32((const int *)lut, low, 4));
+		_mm256_storeu_si256((__m256i *)(pixels + i + 8),
+			_mm256_i32gather_epi32((const int *)lut, high, 4));
+	}
+	ExpandPaletteScalar(indices + i, pixels + i, count - i, lut);
+}
+
+static void CpuId(int leaf, int registers[4]) {
+#ifdef _MSC_VER
+	__cpuidex(registers, leaf, 0);
+#else
+	__cpuid_count(leaf, 0, registers[0], registers[1], registers[2], registers[3]);
+#endif
+}
+static bool SupportsAVX2() {
+	int registers[4];
+	CpuId(0, registers);
+	if(registers[0] < 7) return false;
+	CpuId(1, registers);
+	// The processor has to support AVX, and the OS has to save the YMM registers for us
+	if(!(registers[2] & (1 << 27)) || !(registers[2] & (1 << 28))) return false;
+#ifdef _MSC_VER
+	if((_xgetbv(0) & 6) != 6) return false;
+#else
+	unsigned int xcr0Low, xcr0High;
+	__asm__("xgetbv" : "=a"(xcr0Low), "=d"(xcr0High) : "c"(0));
+	if((xcr0Low & 6) != 6) return false;
+#endif
+	CpuId(7, registers);
+	return (registers[1] & (1 << 5)) != 0;
+}
+static bool SupportsSSE4() {
+	int registers[4];
+	CpuId(1, registers);
+	return (registers[2] & (1 << 19)) != 0;
+}
+
+struct KernelChoice {
+	const char *name;
+	PaletteKernel kernel;
+	bool (*supported)();
+};
+static bool Always() { return true; }
+// Fastest first; the scalar kernel is always there to fall back on
+static const KernelChoice kernelChoices[] = {
+	{ "avx2", ExpandPaletteAVX2, SupportsAVX2 },
+	{ "sse4", ExpandPaletteSSE4, SupportsSSE4 },
+	{ "scalar", ExpandPaletteScalar, Always }
+};
+static const uint32 KERNEL_CHOICES = sizeof(kernelChoices) / sizeof(KernelChoice);
+static const uint32 WIDEST_STEP = 16; // The most pixels that any kernel does at once
+
+// Set once, by SelectKernel through kernelSelected, before any thread expands a palette
+static PaletteKernel paletteKernel = 0;
+static const char *paletteKernelName = "none";
+static boost::once_flag kernelSelected = BOOST_ONCE_INIT;
+/* Make sure that a kernel produces exactly what the scalar kernel does, with every number of
+ * pixels left over after its last full step. The data comes from a generator of its own, so the
+ * program's rand is left alone. */
+static bool VerifyKernel(PaletteKernel kernel) {
+	const uint32 count = 48 * 48 + WIDEST_STEP;
+	vector<uint8> indices(count);
+	vector<uint32> lut(256), expected(count), actual(count);
+	uint32 seed = 1;
+	for(uint32 i = 0; i < 256; ++i) lut[i] = seed = seed * 1664525 + 1013904223;
+	for(uint32 i = 0; i < count; ++i) {
+		seed = seed * 1664525 + 1013904223;
+		indices[i] = uint8(seed >> 24);
+	}
+	for(uint32 tail = 0; tail < WIDEST_STEP; ++tail) {
+		uint32 size = 48 * 48 + tail;
+		ExpandPaletteScalar(&indices[0], &expected[0], size, &lut[0]);
+		kernel(&indices[0], &actual[0], size, &lut[0]);
+		if(!equal(expected.begin(), expected.begin() + size, actual.begin())) return false;
+	}
+	return true;
+}
+static void SelectKernel() {
+	for(uint32 i = 0; i < KERNEL_CHOICES; ++i) {
+		const KernelChoice &choice = kernelChoices[i];
+		if(!choice.supported() || !VerifyKernel(choice.kernel)) continue;
+		paletteKernel = choice.kernel;
+		paletteKernelName = choice.name;
+		return;
+	}
+}
+void ExpandPalette(const uint8 *indices, uint32 *pixels, uint32 count, const uint32 *lut) {
+	boost::call_once(SelectKernel, kernelSelected);
+	paletteKernel(indices, pixels, count, lut);
+}
+const char *GetPaletteKernelName() {
+	boost::call_once(SelectKernel, kernelSelected);
+	return paletteKernelName;
+}
+const char *VerifyPaletteKernels() {
+	for(uint32 i = 0; i < KERNEL_CHOICES; ++i) {
+		const KernelChoice &choice = kernelChoices[i];
+		if(choice.supported() && !VerifyKernel(choice.kernel)) return choice.name;
+	}
+	return 0;
+}
@@ -0,0 +1,11 @@
+#pragma once
+
+/* Palette expansion turns 8-bit palette indices into packed RGBA32 pixels using a 256 entry
+ * lookup table. ExpandPalette picks the fastest kernel that the processor supports and that
+ * agrees exactly with ExpandPaletteScalar, the plain C++ version, once for the whole program;
+ * any thread may call it. */
+void ExpandPalette(const uint8 *indices, uint32 *pixels, uint32 count, const uint32 *lut);
+void ExpandPaletteScalar(const uint8 *indices, uint32 *pixels, uint32 count, const uint32 *lut);
+const char *GetPaletteKernelName(); // The name of the kernel in use, for diagnostics
+// The name of the first supported kernel that disagrees with the scalar kernel, or 0 if none does
+const char *VerifyPaletteKernels();
@@ -0,0 +1,163 @@
+#include "stdwx.h"
+#include "PipelineStats.h"
+#include <fstream>
+#include <algorithm>
+#include <boost/bind.hpp>
+#include <boost/thread/tss.hpp>
+using namespace boost;
+using namespace std;
+PipelineStats pipelineStats;
+
+static const char *counterNames[PipelineStats::COUNTER_COUNT] = {
+	"cache_hits", "cache_misses", "cache_evictions", "bytes_read", "bytes_decoded",
+	"tiles_uploaded", "textures_created", "sprites_drawn", "draw_calls" };
+static const char *histogramNames[PipelineStats::HISTOGRAM_COUNT] = {
+	"archive_read", "palette_expansion", "texture_upload", "frame_render" };
+static const char *gaugeNames[PipelineStats::GAUGE_COUNT] = {
+	"resident_tiles", "idle_tiles", "pending_decodes", "texture_bytes", "memory_bytes",
+	"working_set_bytes", "atlas_pages" };
+
+// Trace viewers want small thread ids, so number the threads in the order that they show up
+static boost::thread_specific_ptr<uint32> traceThreadIds;
+static boost::atomic<uint32> nextTraceThreadId(1);
+static uint32 GetTraceThreadId() {
+	if(!traceThreadIds.get()) traceThreadIds.reset(new uint32(nextTraceThreadId++));
+	return *traceThreadIds;
+}
+
+uint32 PipelineStats::HistogramSnapshot::GetPercentile(double fraction) const {
+	uint32 target = uint32(fraction * count + 0.5), seen = 0;
+	for(int i = 0; i < BUCKET_COUNT; ++i) {
+		seen += buckets[i];
+		if(seen >= target && seen != 0) return min(uint32(1) << i, maxMicroseconds);
+	}
+	return maxMicroseconds;
+}
+PipelineStats::PipelineStats() : epoch(Clock::now()), dumpThread(0), tracing(false),
+	droppedTraceEvents(0) {
+	for(int i = 0; i < COUNTER_COUNT; ++i) counters[i] = 0;
+	for(int i = 0; i < GAUGE_COUNT; ++i) gauges[i] = 0;
+	for(int i = 0; i < HISTOGRAM_COUNT; ++i) {
+		AtomicHistogram &histogram = histograms[i];
+		histogram.count = histogram.maxMicroseconds = 0;
+		histogram.totalNanoseconds = 0;
+		for(int j = 0; j < BUCKET_COUNT; ++j) histogram.buckets[j] = 0;
+	}
+}
+PipelineStats::~PipelineStats() {
+	StopDumps();
+	StopTrace();
+}
+void PipelineStats::Record(Histogram histogram, Clock::time_point start, Clock::time_point end) {
+	uint64 nanoseconds = boost::chrono::duration_cast<boost::chrono::nanoseconds>(end - start).count();
+	uint32 microseconds = uint32(min<uint64>(nanoseconds / 1000, 0xFFFFFFFF));
+	AtomicHistogram &target = histograms[histogram];
+	target.count.fetch_add(1, boost::memory_order_relaxed);
+	target.totalNanoseconds.fetch_add(nanoseconds, boost::memory_order_relaxed);
+	uint32 previous = target.maxMicroseconds.load(boost::memory_order_relaxed);
+	while(microseconds > previous && !target.maxMicroseconds.compare_exchange_weak(previous,
+		microseconds, boost::memory_order_relaxed, boost::memory_order_relaxed));
+	int bucket = 0;
+	while(bucket < BUCKET_COUNT - 1 && (microseconds >> bucket) != 0) ++bucket;
+	target.buckets[bucket].fetch_add(1, boost::memory_order_relaxed);
+	if(!tracing.load(boost::memory_order_relaxed)) return;
+	TraceEvent event = { histogram, GetTraceThreadId(),
+		MicrosecondsSinceEpoch(start), nanoseconds / 1000.0 };
+	boost::mutex::scoped_lock lock(traceMutex);
+	if(traceEvents.size() < MAX_TRACE_EVENTS) traceEvents.push_back(event);
+	else ++droppedTraceEvents;
+}
+void PipelineStats::GetSnapshot(Snapshot &snapshot) const {
+	snapshot.time = MicrosecondsSinceEpoch(Clock::now()) / 1000;
+	for(int i = 0; i < COUNTER_COUNT; ++i)
+		snapshot.counters[i] = counters[i].load(boost::memory_order_relaxed);
+	for(int i = 0; i < GAUGE_COUNT; ++i)
+		snapshot.gauges[i] = gauges[i].load(boost::memory_order_relaxed);
+	for(int i = 0; i < HISTOGRAM_COUNT; ++i) {
+		const AtomicHistogram &source = histograms[i];
+		HistogramSnapshot &histogram = snapshot.histograms[i];
+		histogram.count = source.count.load(boost::memory_order_relaxed);
+		histogram.totalMicroseconds = source.totalNanoseconds.load(boost::memory_order_relaxed) / 1000.0;
+		histogram.maxMicroseconds = source.maxMicroseconds.load(boost::memory_order_relaxed);
+		for(int j = 0; j < BUCKET_COUNT; ++j)
+			histogram.buckets[j] = source.buckets[j].load(boost::memory_order_relaxed);
+	}
+}
+void PipelineStats::WriteJson(ostream &out, const Snapshot &snapshot) {
+	// Write times with three decimals, and never in scientific notation
+	ios::fmtflags flags = out.flags(ios::fixed);
+	streamsize precision = out.precision(3);
+	out << "{\"time_ms\":" << snapshot.time << ",\"counters\":{";
+	for(int i = 0; i < COUNTER_COUNT; ++i)
+		out << (i?",":"") << '"' << counterNames[i] << "\":" << snapshot.counters[i];
+	out << "},\"gauges\":{";
+	for(int i = 0; i < GAUGE_COUNT; ++i)
+		out << (i?",":"") << '"' << gaugeNames[i] << "\":" << snapshot.gauges[i];
+	out << "},\"histograms\":{";
+	for(int i = 0; i < HISTOGRAM_COUNT; ++i) {
+		const HistogramSnapshot &histogram = snapshot.histograms[i];
+		out << (i?",":"") << '"' << histogramNames[i] << "\":{\"count\":" << histogram.count <<
+			",\"mean_us\":" << (histogram.count?histogram.totalMicroseconds / histogram.count:0) <<
+			",\"p50_us\":" << histogram.GetPercentile(0.5) <<
+			",\"p90_us\":" << histogram.GetPercentile(0.9) <<
+			",\"p99_us\":" << histogram.GetPercentile(0.99) <<
+			",\"max_us\":" << histogram.maxMicroseconds << "}";
+	}
+	out << "}}";
+	out.flags(flags);
+	out.precision(precision);
+}
+void PipelineStats::StartDumps(const string &path, int interval) {
+	StopDumps();
+	dumpThread = new boost::thread(boost::bind(&PipelineStats::DumpThread, this, path, interval));
+}
+void PipelineStats::StopDumps() {
+	if(!dumpThread) return;
+	dumpThread->interrupt();
+	dumpThread->join();
+	delete dumpThread;
+	dumpThread = 0;
+}
+void PipelineStats::DumpThread(string path, int interval) {
+	ofstream out(path.c_str(), ios::trunc);
+	Snapshot snapshot;
+	try {
+		for(;;) {
+			boost::this_thread::sleep(boost::posix_time::milliseconds(interval));
+			GetSnapshot(snapshot);
+			WriteJson(out, snapshot);
+			out << endl;
+		}
+	} catch(boost::thread_interrupted &) { }
+	// One last dump, so that the file always ends with the final numbers
+	GetSnapshot(snapshot);
+	WriteJson(out, snapshot);
+	out << endl;
+}
+void PipelineStats::StartTrace(const string &path) {
+	boost::mutex::scoped_lock lock(traceMutex);
+	tracePath = path;
+	traceEvents.clear();
+	droppedTraceEvents = 0;
+	tracing = true;
+}
+void PipelineStats::StopTrace() {
+	if(!tracing.exchange(false)) return; // There's no trace to write
+	boost::mutex::scoped_lock lock(traceMutex);
+	ofstream out(tracePath.c_str(), ios::trunc);
+	out.setf(ios::fixed);
+	out.precision(3);
+	out << "{\"traceEvents\":[";
+	for(uint32 i = 0; i < traceEvents.size(); ++i) {
+		const TraceEvent &event = traceEvents[i];
+		out << (i?",\n":"\n") << "{\"name\":\"" << histogramNames[event.histogram] <<
+			"\",\"cat\":\"tiles\",\"ph\":\"X\",\"pid\":1,\"tid\":" << event.thread <<
+			",\"ts\":" << event.start << ",\"dur\":" << event.duration << "}";
+	}
+	out << "\n],\"displayTimeUnit\":\"ms\",\"otherData\":{\"dropped_events\":" <<
+		droppedTraceEvents << "}}" << endl;
+	vector<TraceEvent>().swap(traceEvents);
+}
+const char *PipelineStats::GetName(Counter counter) { return counterNames[counter]; }
+const char *PipelineStats::GetName(Histogram histogram) { return histogramNames[histogram]; }
+const char *PipelineStats::GetName(Gauge gauge) { return gaugeNames[gauge]; }
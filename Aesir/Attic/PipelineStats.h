@@ -0,0 +1,138 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <ostream>
+#include <boost/atomic.hpp>
+#include <boost/chrono.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+
+/* Counters, latency histograms and gauges for the tile pipeline, from the archives through to
+ * the frames that draw the tiles. Everything is updated with relaxed atomics, so any thread can
+ * record into it, and a snapshot can be taken at any time. Snapshots can be dumped to a file
+ * every DUMP_INTERVAL milliseconds as one JSON object per line, and timed sections can be
+ * recorded as trace events in the JSON format that chrome://tracing and Perfetto read.
+ *
+ * Record through the STATS_ macros at the bottom; defining AESIR_NO_STATS compiles them out,
+ * and the snapshots are then all zeros. */
+class PipelineStats {
+public:
+	enum Counter {
+		CACHE_HITS, CACHE_MISSES, CACHE_EVICTIONS, // Tile requests, as TileManager sees them
+		BYTES_READ, // Source bytes read out of the archives or the tile cache
+		BYTES_DECODED, // RGBA bytes produced by palette expansion
+		TILES_UPLOADED, TEXTURES_CREATED, // Tiles copied into the atlas, and atlas pages made
+		SPRITES_DRAWN, DRAW_CALLS, // Tiles drawn through a SpriteBatch, and the calls that took
+		COUNTER_COUNT
+	};
+	enum Histogram {
+		ARCHIVE_READ, // Finding a batch of tiles in the archives, or copying them out of the cache
+		PALETTE_EXPANSION, // Expanding one tile; this is where the archive pages get faulted in
+		TEXTURE_UPLOAD, // Copying one tile into an atlas page
+		FRAME_RENDER, // Drawing one frame of a canvas
+		HISTOGRAM_COUNT
+	};
+	enum Gauge {
+		RESIDENT_TILES, IDLE_TILES, // Registered tiles, and how many of them nothing refers to
+		PENDING_DECODES, // Tiles queued for the async loader
+		TEXTURE_BYTES, MEMORY_BYTES, // As TileManager accounts for them against its budgets
+		WORKING_SET_BYTES, // The atlas slots that indexed tiles are drawn from
+		ATLAS_PAGES,
+		GAUGE_COUNT
+	};
+	// Bucket 0 holds durations under a microsecond, and bucket i those under 2^i microseconds
+	static const int BUCKET_COUNT = 24;
+	static const int DUMP_INTERVAL = 1000;
+	// Stop buffering trace events past this many, so that a forgotten trace can't eat memory
+	static const uint32 MAX_TRACE_EVENTS = 1 << 20;
+	struct HistogramSnapshot {
+		uint32 count;
+		double totalMicroseconds;
+		uint32 maxMicroseconds;
+		uint32 buckets[BUCKET_COUNT];
+		// The upper bound of the bucket that holds the given fraction of the samples
+		uint32 GetPercentile(double fraction) const;
+	};
+	struct Snapshot {
+		double time; // Milliseconds since the stats were created
+		uint64 counters[COUNTER_COUNT];
+		HistogramSnapshot histograms[HISTOGRAM_COUNT];
+		uint32 gauges[GAUGE_COUNT];
+	};
+	typedef boost::chrono::steady_clock Clock;
+	// Times a section of code into a histogram, and into the trace if one is being recorded
+	class ScopedTimer {
+	public:
+		inline ScopedTimer(PipelineStats &stats_, Histogram histogram_) :
+			stats(stats_), histogram(histogram_), start(Clock::now()) { }
+		inline ~ScopedTimer() { stats.Record(histogram, start, Clock::now()); }
+	private:
+		PipelineStats &stats;
+		Histogram histogram;
+		Clock::time_point start;
+	};
+	inline void Add(Counter counter, uint32 amount = 1) {
+		counters[counter].fetch_add(amount, boost::memory_order_relaxed); }
+	/* For counters that only the GL thread adds to; this skips the locked add, which costs as
+	 * much as a cache hit itself */
+	inline void AddFromGLThread(Counter counter, uint32 amount = 1) {
+		counters[counter].store(counters[counter].load(boost::memory_order_relaxed) + amount,
+			boost::memory_order_relaxed);
+	}
+	inline void Set(Gauge gauge, uint32 value) {
+		gauges[gauge].store(value, boost::memory_order_relaxed); }
+	void Record(Histogram histogram, Clock::time_point start, Clock::time_point end);
+	void GetSnapshot(Snapshot &snapshot) const;
+	static void WriteJson(std::ostream &out, const Snapshot &snapshot);
+	// Append a snapshot to path every interval milliseconds, from a thread of its own
+	void StartDumps(const std::string &path, int interval = DUMP_INTERVAL);
+	void StopDumps();
+	// Record timed sections until StopTrace, which writes them out to path if there's a trace
+	void StartTrace(const std::string &path);
+	void StopTrace();
+	static const char *GetName(Counter counter);
+	static const char *GetName(Histogram histogram);
+	static const char *GetName(Gauge gauge);
+	PipelineStats();
+	~PipelineStats();
+private:
+	struct TraceEvent {
+		Histogram histogram;
+		uint32 thread;
+		double start, duration; // In microseconds since the stats were created
+	};
+	void DumpThread(std::string path, int interval);
+	inline double MicrosecondsSinceEpoch(Clock::time_point time) const {
+		return boost::chrono::duration<double, boost::micro>(time - epoch).count(); }
+	Clock::time_point epoch;
+	boost::atomic<uint64> counters[COUNTER_COUNT];
+	boost::atomic<uint32> gauges[GAUGE_COUNT];
+	struct AtomicHistogram {
+		boost::atomic<uint32> count, maxMicroseconds;
+		boost::atomic<uint64> totalNanoseconds;
+		boost::atomic<uint32> buckets[BUCKET_COUNT];
+	} histograms[HISTOGRAM_COUNT];
+	boost::thread *dumpThread;
+	boost::atomic<bool> tracing;
+	boost::mutex traceMutex; // Guards the members below
+	std::string tracePath;
+	std::vector<TraceEvent> traceEvents;
+	uint32 droppedTraceEvents;
+};
+extern PipelineStats pipelineStats;
+
+#define STATS_CONCAT_(a, b) a##b
+#define STATS_CONCAT(a, b) STATS_CONCAT_(a, b)
+#ifndef AESIR_NO_STATS
+#define STATS_COUNT(counter, amount) pipelineStats.Add(PipelineStats::counter, (amount))
+#define STATS_COUNT_GL(counter, amount) pipelineStats.AddFromGLThread(PipelineStats::counter, (amount))
+#define STATS_GAUGE(gauge, value) pipelineStats.Set(PipelineStats::gauge, (value))
+// Time the rest of the enclosing scope
+#define STATS_TIME(histogram) PipelineStats::ScopedTimer \
+	STATS_CONCAT(statsTimer, __LINE__)(pipelineStats, PipelineStats::histogram)
+#else
+#define STATS_COUNT(counter, amount) ((void)0)
+#define STATS_COUNT_GL(counter, amount) ((void)0)
+#define STATS_GAUGE(gauge, value) ((void)0)
+#define STATS_TIME(histogram) ((void)0)
+#endif
@@ -0,0 +1,66 @@
+#include "stdwx.h"
+#include "SpriteBatch.h"
+#include "TileManager.h"
+#include "PipelineStats.h"
+#include <algorithm>
+#include <gl/gl.h>
+using namespace std;
+
+SpriteBatch::SpriteBatch() : queued(0) {
+	stats.sprites = stats.drawCalls = 0;
+}
+void SpriteBatch::Begin() {
+	stats.sprites = stats.drawCalls = 0;
+}
+void SpriteBatch::Draw(TileGraphic *tileGraphic, int x, int y, uint32 tint) {
+	float left = float(x), top = float(y);
+	if(!tileGraphic->IsLoaded()) {
+		if(pages.empty()) pages.resize(1);
+		AddQuad(pages[0], left, top, left + TextureAtlas::SLOT_SIZE, top + TextureAtlas::SLOT_SIZE,
+			TextureAtlas::Slot(), PLACEHOLDER);
+		return;
+	}
+	const TextureAtlas::Slot &slot = tileGraphic->GetSlot();
+	if(slot.page == TextureAtlas::NO_PAGE) return; // There are no pixels to draw
+	if(slot.page + 1U >= pages.size()) pages.resize(slot.page + 2);
+	uint32 width = min<uint32>(tileGraphic->width, TextureAtlas::SLOT_SIZE),
+		height = min<uint32>(tileGraphic->height, TextureAtlas::SLOT_SIZE);
+	AddQuad(pages[slot.page + 1], left, top, left + width, top + height, slot, tint);
+}
+void SpriteBatch::AddQuad(vector<Vertex> &vertices, float left, float top, float right, float bottom,
+	const TextureAtlas::Slot &slot, uint32 color) {
+	Vertex quad[4] = {
+		{ left, top, slot.left, slot.top, color },
+		{ right, top, slot.right, slot.top, color },
+		{ right, bottom, slot.right, slot.bottom, color },
+		{ left, bottom, slot.left, slot.bottom, color } };
+	vertices.insert(vertices.end(), quad, quad + 4);
+	++queued;
+	++stats.sprites;
+}
+void SpriteBatch::Flush() {
+	if(queued == 0) return;
+	glPushClientAttrib(GL_CLIENT_VERTEX_ARRAY_BIT);
+	glEnableClientState(GL_VERTEX_ARRAY);
+	glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+	glEnableClientState(GL_COLOR_ARRAY);
+	for(uint32 i = 0; i < pages.size(); ++i) {
+		vector<Vertex> &vertices = pages[i];
+		if(vertices.empty()) continue;
+		if(i == 0) {
+			glPushAttrib(GL_ENABLE_BIT);
+			glDisable(GL_TEXTURE_2D); // The placeholders are flat
+		} else textureAtlas.Bind(uint16(i - 1));
+		glVertexPointer(2, GL_FLOAT, sizeof(Vertex), &vertices[0].x);
+		glTexCoordPointer(2, GL_FLOAT, sizeof(Vertex), &vertices[0].u);
+		glColorPointer(4, GL_UNSIGNED_BYTE, sizeof(Vertex), &vertices[0].color);
+		glDrawArrays(GL_QUADS, 0, vertices.size());
+		if(i == 0) glPopAttrib(); // Whatever the caller had enabled
+		++stats.drawCalls;
+		STATS_COUNT_GL(DRAW_CALLS, 1);
+		vertices.clear(); // This keeps the memory for the next frame
+	}
+	glPopClientAttrib();
+	STATS_COUNT_GL(SPRITES_DRAWN, queued);
+	queued = 0;
+}
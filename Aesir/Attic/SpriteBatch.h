@@ -0,0 +1,46 @@
+#pragma once
+#include <vector>
+#include "TextureAtlas.h"
+class TileGraphic;
+
+/* Collects the tiles of a frame as quads in vertex arrays, one per atlas page, and draws each
+ * page with a single glDrawArrays. The arrays keep their memory from frame to frame, so a steady
+ * frame allocates nothing. Tiles that are still being decoded are drawn as flat placeholders,
+ * all in one more call. The tint of a sprite goes in with its vertices, so tinting a tile
+ * doesn't break up the batch.
+ *
+ * Within a page the sprites are drawn in the order that they were queued, but the pages are
+ * drawn one after another; Flush between layers that overlap. Only the GL thread may use a
+ * batch, and as with TileGraphic::Render, tileManager.UploadCompleted has to start the frame. */
+class SpriteBatch {
+public:
+	// Tints are packed RGBA, as they lie in memory, like the palettes
+	static const uint32 WHITE = 0xFFFFFFFF;
+	static const uint32 PLACEHOLDER = 0xFF262626; // The colour of a tile that isn't loaded yet
+	inline static uint32 MakeTint(uint8 red, uint8 green, uint8 blue, uint8 alpha = 0xFF) {
+		return red | (green << 8) | (blue << 16) | (uint32(alpha) << 24); }
+	struct Stats {
+		uint32 sprites; // Sprites queued since Begin
+		uint32 drawCalls; // The draw calls that they took
+	};
+	void Begin(); // Start a frame, clearing the stats
+	/* Queue a tile with its top left corner at x, y. The tile is drawn at its own size, clipped to
+	 * a slot; tiles that don't exist aren't drawn at all. */
+	void Draw(TileGraphic *tileGraphic, int x, int y, uint32 tint = WHITE);
+	void Flush(); // Draw everything that is queued
+	inline void End() { Flush(); }
+	inline const Stats &GetStats() const { return stats; }
+	SpriteBatch();
+private:
+	struct Vertex {
+		float x, y;
+		float u, v;
+		uint32 color;
+	};
+	// The quads of each page, with the placeholders in front: pages[page + 1]
+	std::vector<std::vector<Vertex> > pages;
+	uint32 queued; // The number of sprites waiting for Flush
+	Stats stats;
+	void AddQuad(std::vector<Vertex> &vertices, float left, float top, float right, float bottom,
+		const TextureAtlas::Slot &slot, uint32 color);
+};
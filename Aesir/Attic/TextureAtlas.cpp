@@ -0,0 +1,77 @@
+#include "stdwx.h"
+#include "TextureAtlas.h"
+#include "PipelineStats.h"
+#include <algorithm>
+#include <gl/gl.h>
+using namespace std;
+TextureAtlas textureAtlas;
+
+TextureAtlas::Slot TextureAtlas::Insert(const uint32 *pixels, uint32 width, uint32 height) {
+	// Find a page with a free slot, or make a new page if they're all full
+	uint16 page = 0;
+	while(page < pages.size() && pages[page].freeSlots.empty()) ++page;
+	if(page == pages.size()) page = AddPage();
+	Slot slot;
+	slot.page = page;
+	slot.index = pages[page].freeSlots.back();
+	pages[page].freeSlots.pop_back();
+	uint32 x = (slot.index % SLOTS_PER_ROW) * SLOT_SIZE, y = (slot.index / SLOTS_PER_ROW) * SLOT_SIZE;
+	uint32 clippedWidth = min<uint32>(width, SLOT_SIZE), clippedHeight = min<uint32>(height, SLOT_SIZE);
+	slot.left = float(x) / PAGE_SIZE;
+	slot.top = float(y) / PAGE_SIZE;
+	slot.right = float(x + clippedWidth) / PAGE_SIZE;
+	slot.bottom = float(y + clippedHeight) / PAGE_SIZE;
+	if(clippedWidth * clippedHeight == 0) return slot;
+	STATS_TIME(TEXTURE_UPLOAD);
+	STATS_COUNT_GL(TILES_UPLOADED, 1);
+	glBindTexture(GL_TEXTURE_2D, pages[page].texture);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, width);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, clippedWidth, clippedHeight,
+		GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+	// Restore whatever binding the drawing code expects
+	glBindTexture(GL_TEXTURE_2D, (boundPage == NO_PAGE)?0:pages[boundPage].texture);
+	return slot;
+}
+void TextureAtlas::Remove(const Slot &slot) {
+	if(slot.page < pages.size()) pages[slot.page].freeSlots.push_back(slot.index);
+}
+void TextureAtlas::Bind(uint16 page) {
+	if(page == boundPage) return;
+	glBindTexture(GL_TEXTURE_2D, (page == NO_PAGE)?0:pages[page].texture);
+	boundPage = page;
+	++bindCount;
+}
+void TextureAtlas::Unbind() {
+	glBindTexture(GL_TEXTURE_2D, 0);
+	boundPage = NO_PAGE;
+}
+uint16 TextureAtlas::AddPage() {
+	Page page;
+	glGenTextures(1, &page.texture);
+	glBindTexture(GL_TEXTURE_2D, page.texture);
+	// Tiles are drawn pixel for pixel, and there are no mipmaps to bleed between slots
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, PAGE_SIZE, PAGE_SIZE, 0,
+		GL_RGBA, GL_UNSIGNED_BYTE, 0);
+	// Hand out the slots in order, starting from the top left
+	page.freeSlots.reserve(SLOTS_PER_PAGE);
+	for(int i = SLOTS_PER_PAGE - 1; i >= 0; --i) page.freeSlots.push_back(i);
+	pages.push_back(page);
+	STATS_COUNT_GL(TEXTURES_CREATED, 1);
+	STATS_GAUGE(ATLAS_PAGES, pages.size());
+	return uint16(pages.size() - 1);
+}
+void TextureAtlas::Abandon() {
+	pages.clear();
+	boundPage = NO_PAGE;
+	STATS_GAUGE(ATLAS_PAGES, 0);
+}
+TextureAtlas::~TextureAtlas() {
+	for(vector<Page>::iterator i = pages.begin(); i != pages.end(); ++i)
+		glDeleteTextures(1, &i->texture);
+}
@@ -0,0 +1,49 @@
+#pragma once
+#include <vector>
+typedef unsigned int GLuint;
+
+/* Packs tiles into a handful of large textures, called pages, so that drawing a screen full
+ * of tiles doesn't have to bind a texture for every single one of them. Each page is divided
+ * into a grid of fixed size slots; when a tile is removed its slot goes back to the page's
+ * free list, to be handed out to the next tile that is inserted. The atlas only talks to GL,
+ * so it works under any context, including a software rasteriser. */
+class TextureAtlas {
+public:
+	static const int PAGE_SIZE = 1024; // The dimensions of a page, in pixels
+	static const int SLOT_SIZE = 48; // The dimensions of a slot, in pixels
+	static const int SLOTS_PER_ROW = PAGE_SIZE / SLOT_SIZE;
+	static const int SLOTS_PER_PAGE = SLOTS_PER_ROW * SLOTS_PER_ROW;
+	static const uint16 NO_PAGE = 0xFFFF;
+	// The part of a page that holds a tile
+	struct Slot {
+		uint16 page, index; // The page, and the index of the slot within the page
+		float left, top, right, bottom; // The texture coordinates of the tile
+		inline Slot() : page(NO_PAGE), index(0), left(0), top(0), right(0), bottom(0) { }
+	};
+	/* Put a tile into the atlas. The pixels are RGBA; anything that doesn't fit in a slot is
+	 * clipped away. */
+	Slot Insert(const uint32 *pixels, uint32 width, uint32 height);
+	void Remove(const Slot &slot); // Give the slot of a tile back to its page
+	// Bind a page for drawing; binding the page that is already bound does nothing
+	void Bind(uint16 page);
+	// Unbind the current page. Call this when you're done drawing, since bindings aren't
+	// shared between contexts.
+	void Unbind();
+	/* Forget every page without deleting its texture, once the context that held them is gone;
+	 * the textures went with it. Slots from before are ignored when they're removed. */
+	void Abandon();
+	inline uint32 GetPageCount() { return pages.size(); }
+	inline uint32 GetBindCount() { return bindCount; } // The number of binds that were issued
+	inline TextureAtlas() : boundPage(NO_PAGE), bindCount(0) { }
+	~TextureAtlas();
+private:
+	struct Page {
+		GLuint texture;
+		std::vector<uint16> freeSlots;
+	};
+	std::vector<Page> pages;
+	uint16 boundPage;
+	uint32 bindCount;
+	uint16 AddPage();
+};
+extern TextureAtlas textureAtlas;
@@ -0,0 +1,197 @@
+#include "stdwx.h"
+#include "TileCache.h"
+#include "TileLoader.h"
+#include <cstring>
+#include <algorithm>
+#include <fstream>
+#include <exception>
+#include <boost/format.hpp>
+#include <boost/filesystem/operations.hpp>
+using namespace boost;
+using namespace std;
+
+static const char cacheMagic[8] = "AESIRTC";
+// The number of tiles decoded at once while building or verifying the cache
+static const uint32 CHUNK_SIZE = 1024;
+
+// Write count records at the current position, padded out to four bytes
+template<class T> static TileCache::Section WriteSection(ofstream &out, const T *data, uint32 count) {
+	TileCache::Section section = { uint32(out.tellp()), count };
+	if(count != 0) out.write((const char *)data, count * sizeof(T));
+	static const char padding[4] = { 0, 0, 0, 0 };
+	out.write(padding, (4 - (count * sizeof(T)) % 4) % 4);
+	return section;
+}
+void TileCache::Stamp(const TileLoader &loader, vector<SourceStamp> &stamps) {
+	vector<string> names(1, "tile.dat");
+	for(int i = 0; i < 2; ++i) {
+		for(uint32 j = 0; j < loader.numArchives[i]; ++j)
+			names.push_back((format("%1%%2%.dat") % loader.typeNames[i] % j).str());
+	}
+	stamps.resize(names.size());
+	for(uint32 i = 0; i < names.size(); ++i) {
+		SourceStamp &stamp = stamps[i];
+		memset(&stamp, 0, sizeof(SourceStamp)); // The stamps are compared byte for byte
+		strncpy(stamp.name, names[i].c_str(), sizeof(stamp.name) - 1);
+		filesystem::path source(loader.dataPath + names[i]);
+		stamp.size = uint32(filesystem::file_size(source));
+		stamp.modified = uint32(filesystem::last_write_time(source));
+	}
+}
+void TileCache::Build(TileLoader &loader, const string &path) {
+	if(loader.IsCached()) throw exception("The tile cache can only be built from the data files");
+	vector<SourceStamp> stamps;
+	Stamp(loader, stamps);
+	Header header;
+	memset(&header, 0, sizeof(Header));
+	memcpy(header.magic, cacheMagic, sizeof(header.magic));
+	header.version = VERSION;
+	header.sourceCount = stamps.size();
+	string partPath = path + ".part";
+	ofstream out(partPath.c_str(), ios::binary | ios::trunc);
+	if(!out) throw exception("Couldn't create the tile cache");
+	out.write((const char *)&header, sizeof(Header)); // Written again once the sections are known
+	WriteSection(out, &stamps[0], stamps.size());
+	vector<CachedTile> cachedTiles[2];
+	for(int i = 0; i < 2; ++i) {
+		loader.RequirePalettes(i);
+		Header::TypeSections &sections = header.types[i];
+		vector<ArchiveRecord> archives;
+		for(vector<TileLoader::GraphicsFile>::iterator j = loader.graphicsFiles[i].begin();
+			j != loader.graphicsFiles[i].end(); ++j) {
+			ArchiveRecord record = { j->tileCount, j->infoOffset };
+			archives.push_back(record);
+		}
+		sections.archives = WriteSection(out, archives.empty()?0:&archives[0], archives.size());
+		TileLoader::PaletteTable &table = loader.paletteTables[i];
+		sections.table = WriteSection(out, table.empty()?0:&table[0], table.size());
+		TileLoader::PaletteSet &set = loader.paletteSets[i];
+		sections.palettes = WriteSection(out, set.empty()?0:&set[0], set.size());
+		// The tile records are filled in after the pixels have been written
+		cachedTiles[i].resize(loader.numTiles[i]);
+		sections.tiles = WriteSection(out,
+			cachedTiles[i].empty()?0:&cachedTiles[i][0], cachedTiles[i].size());
+	}
+	vector<TileIdentifier> tileIdentifiers;
+	vector<TileLoader::DecodedTile> decoded, indexed;
+	vector<uint32> staging;
+	vector<uint8> indexStaging;
+	for(int i = 0; i < 2; ++i) {
+		for(uint32 first = 0; first < loader.numTiles[i]; first += CHUNK_SIZE) {
+			tileIdentifiers.clear();
+			for(uint32 j = first; j < min(first + CHUNK_SIZE, loader.numTiles[i]); ++j)
+				tileIdentifiers.push_back(TileIdentifier(j, i));
+			loader.DecodeBatch(tileIdentifiers, decoded, staging);
+			loader.DecodeIndexedBatch(tileIdentifiers, indexed, indexStaging);
+			for(uint32 j = 0; j < decoded.size(); ++j) {
+				CachedTile &cachedTile = cachedTiles[i][decoded[j].tileIdentifier.first];
+				cachedTile.width = decoded[j].width;
+				cachedTile.height = decoded[j].height;
+				uint32 pixelCount = decoded[j].width * decoded[j].height;
+				cachedTile.offset = uint32(WriteSection(out,
+					pixelCount?&staging[decoded[j].offset]:0, pixelCount).offset);
+				cachedTile.indexOffset = uint32(WriteSection(out,
+					pixelCount?&indexStaging[indexed[j].offset]:0, pixelCount).offset);
+				if(streamoff(out.tellp()) > streamoff(0xFFFFFFFF))
+					throw exception("The tile cache is too large");
+			}
+		}
+	}
+	for(int i = 0; i < 2; ++i) {
+		if(cachedTiles[i].empty()) continue;
+		out.seekp(header.types[i].tiles.offset);
+		out.write((const char *)&cachedTiles[i][0], cachedTiles[i].size() * sizeof(CachedTile));
+	}
+	out.seekp(0);
+	out.write((const char *)&header, sizeof(Header));
+	out.close();
+	if(!out) throw exception("Couldn't write the tile cache");
+	ReplaceFileAt(path, partPath);
+}
+uint32 TileCache::Verify(TileLoader &loader, const string &path) {
+	if(loader.IsCached()) throw exception("The tile cache can only be verified against the data files");
+	vector<SourceStamp> stamps;
+	Stamp(loader, stamps);
+	TileCache cache;
+	if(!cache.Open(path, stamps)) throw exception("The tile cache is missing or out of date");
+	uint32 mismatches = 0;
+	vector<TileIdentifier> tileIdentifiers;
+	vector<TileLoader::DecodedTile> decoded, indexed;
+	vector<uint32> staging;
+	vector<uint8> indexStaging;
+	for(int i = 0; i < 2; ++i) {
+		uint32 cachedCount = cache.header->types[i].tiles.count;
+		if(cachedCount != loader.numTiles[i])
+			mismatches += max(cachedCount, loader.numTiles[i]) - min(cachedCount, loader.numTiles[i]);
+		for(uint32 first = 0; first < loader.numTiles[i]; first += CHUNK_SIZE) {
+			tileIdentifiers.clear();
+			for(uint32 j = first; j < min(first + CHUNK_SIZE, loader.numTiles[i]); ++j)
+				tileIdentifiers.push_back(TileIdentifier(j, i));
+			loader.DecodeBatch(tileIdentifiers, decoded, staging);
+			loader.DecodeIndexedBatch(tileIdentifiers, indexed, indexStaging);
+			for(uint32 j = 0; j < decoded.size(); ++j) {
+				const CachedTile *cachedTile = cache.GetTile(decoded[j].tileIdentifier.first, i);
+				uint32 pixelCount = decoded[j].width * decoded[j].height;
+				if(!cachedTile) continue; // Already counted above
+				if(cachedTile->width != decoded[j].width || cachedTile->height != decoded[j].height ||
+					(pixelCount != 0 && (memcmp(cache.GetPixels(*cachedTile),
+					&staging[decoded[j].offset], pixelCount * 4) || memcmp(cache.GetIndices(*cachedTile),
+					&indexStaging[indexed[j].offset], pixelCount)))) ++mismatches;
+			}
+		}
+	}
+	return mismatches;
+}
+bool TileCache::Open(const string &path, const vector<SourceStamp> &stamps) {
+	try {
+		file.Open(path);
+		const Header *header_ = file.At<Header>(0);
+		if(memcmp(header_->magic, cacheMagic, sizeof(header_->magic)) ||
+			header_->version != VERSION || header_->sourceCount != stamps.size()) return false;
+		const SourceStamp *sourceStamps = file.At<SourceStamp>(sizeof(Header), header_->sourceCount);
+		if(memcmp(sourceStamps, &stamps[0], stamps.size() * sizeof(SourceStamp))) return false;
+		for(int i = 0; i < 2; ++i) {
+			// Make sure that every section lies within the file, so that later reads can't fail
+			const Header::TypeSections &sections = header_->types[i];
+			file.At<ArchiveRecord>(sections.archives.offset, sections.archives.count);
+			const uint8 *table = file.At<uint8>(sections.table.offset, sections.table.count);
+			file.At<TileLoader::Palette>(sections.palettes.offset, sections.palettes.count);
+			tiles[i] = file.At<CachedTile>(sections.tiles.offset, sections.tiles.count);
+			// And every tile and palette that they refer to, since decoding doesn't check them
+			if(sections.tiles.count > sections.table.count) return false;
+			for(uint32 j = 0; j < sections.table.count; ++j)
+				if(table[j] >= sections.palettes.count) return false;
+			for(uint32 j = 0; j < sections.tiles.count; ++j) {
+				uint32 pixelCount = tiles[i][j].width * tiles[i][j].height;
+				if(pixelCount == 0) continue;
+				file.At<uint32>(tiles[i][j].offset, pixelCount);
+				file.At<uint8>(tiles[i][j].indexOffset, pixelCount);
+			}
+		}
+		header = header_;
+		return true;
+	} catch(std::exception &) { return false; } // There's no cache, or it can't be read
+}
+void TileCache::Restore(TileLoader &loader) const {
+	for(int i = 0; i < 2; ++i) {
+		const Header::TypeSections &sections = header->types[i];
+		const ArchiveRecord *archives =
+			file.At<ArchiveRecord>(sections.archives.offset, sections.archives.count);
+		loader.graphicsFiles[i].clear();
+		loader.archiveBases[i].assign(1, 0);
+		for(uint32 j = 0; j < sections.archives.count; ++j) {
+			TileLoader::GraphicsHeader graphicsHeader;
+			graphicsHeader.tileCount = archives[j].tileCount;
+			graphicsHeader.infoOffset = archives[j].infoOffset;
+			loader.graphicsFiles[i].push_back(graphicsHeader);
+			loader.archiveBases[i].push_back(loader.archiveBases[i].back() + archives[j].tileCount);
+		}
+		loader.numTiles[i] = sections.tiles.count;
+		const uint8 *table = file.At<uint8>(sections.table.offset, sections.table.count);
+		loader.paletteTables[i].assign(table, table + sections.table.count);
+		const TileLoader::Palette *palettes =
+			file.At<TileLoader::Palette>(sections.palettes.offset, sections.palettes.count);
+		loader.paletteSets[i].assign(palettes, palettes + sections.palettes.count);
+		loader.palettesLoaded[i] = true;
+	}
+}
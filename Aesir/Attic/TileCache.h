@@ -0,0 +1,57 @@
+#pragma once
+#include <string>
+#include <vector>
+#include "MappedFile.h"
+class TileLoader;
+
+/* A file that holds everything TileLoader::Init works out from the data files, along with every
+ * tile both decoded into RGBA and as its palette indices, laid out so that it can be used straight
+ * out of a mapping. The cache is stamped with the size and modification time of each data file it
+ * was built from, and it's ignored as soon as any of them change. With a current cache, Init
+ * doesn't have to open a single archive. */
+class TileCache {
+public:
+	static const uint32 VERSION = 2;
+	// The data file that a cache was built from, as it was at the time
+	struct SourceStamp {
+		char name[16];
+		uint32 size, modified;
+	};
+	struct Section { uint32 offset, count; }; // A run of records somewhere in the file
+	struct Header {
+		char magic[8]; // "AESIRTC"
+		uint32 version, sourceCount; // The source stamps come right after the header
+		// Per tile type: GraphicsFile records, the palette table, the palettes and the tiles
+		struct TypeSections { Section archives, table, palettes, tiles; } types[2];
+	};
+	struct ArchiveRecord { uint32 tileCount, infoOffset; };
+	// A decoded tile, and where its RGBA pixels and its palette indices start in the file
+	struct CachedTile {
+		uint32 offset, indexOffset;
+		uint16 width, height;
+	};
+	// Stamp every data file that the loader reads from
+	static void Stamp(const TileLoader &loader, std::vector<SourceStamp> &stamps);
+	/* Decode every tile of an uncached loader and write the cache to path. The cache is
+	 * written beside the destination first, so a reader never sees half a cache. */
+	static void Build(TileLoader &loader, const std::string &path);
+	/* Compare the cache at path against the data files, tile by tile. Returns the number of
+	 * tiles that differ, and throws if the cache is missing or out of date. */
+	static uint32 Verify(TileLoader &loader, const std::string &path);
+	// Map a cache; returns false if it doesn't exist, is damaged or doesn't match the stamps
+	bool Open(const std::string &path, const std::vector<SourceStamp> &stamps);
+	// Fill in the loader's tile counts, archive information and palettes from the cache
+	void Restore(TileLoader &loader) const;
+	// Get a cached tile, or 0 if there is no such tile
+	inline const CachedTile *GetTile(uint32 index, int tileType) const {
+		return (index < header->types[tileType].tiles.count)?&tiles[tileType][index]:0; }
+	inline const uint32 *GetPixels(const CachedTile &tile) const {
+		return file.At<uint32>(tile.offset, tile.width * tile.height); }
+	inline const uint8 *GetIndices(const CachedTile &tile) const {
+		return file.At<uint8>(tile.indexOffset, tile.width * tile.height); }
+	inline TileCache() : header(0) { tiles[0] = tiles[1] = 0; }
+private:
+	MappedFile file;
+	const Header *header;
+	const CachedTile *tiles[2];
+};
@@ -2,16 +2,19 @@
 #include "TileChooser.h"
 #include "TileLoader.h"
 #include "MapEditor.h"
+#include "PipelineStats.h"
 #include <cmath>
-#include <boost/array.hpp>
+#include <cstring>
 #include <algorithm>
 using namespace std;
 
 class TileChooser::GraphicsCanvas : public BasicCanvas {
 public:
 	GraphicsCanvas(TileChooser *tileChooser_);
+	inline ~GraphicsCanvas() { tileManager.RemoveListener(this); }
 	void Render();
 private:
+	static const uint32 SELECTED_TINT = 0xFF808080; // Selected tiles are drawn at half brightness
 	inline void HandleMiddleDrag(wxMouseEvent &event) {
 		tileChooser->HandleMiddleDrag(event); }
 	inline void OnMotion(wxMouseEvent &event) {
@@ -38,26 +41,23 @@ BEGIN_EVENT_TABLE(TileChooser, wxPanel)
 END_EVENT_TABLE()
 
 void TileChooser::HandleSelectionDrag(wxMouseEvent &event) {
-	wxPoint mousePos = event.GetPosition();
-	this->ScreenToClient(&mousePos.x, &mousePos.y);
+	// The events come from the canvas, so the position is already relative to the tiles
+	uint32 cell = HitTest(event.GetPosition());
 	if(event.LeftDown()) {
-		// The user has begin dragging a selection box
-		selectOrigin = mousePos;
-		boost::array<int, 3> extents = { 0, 0 };
-		mapEditor->selection.reshape(extents);
+		// The user has begun dragging a selection box; until it moves, it's the one tile
+		selectOrigin = cell;
+		graphicsCanvas->CaptureMouse(); // Keep the box going when the mouse leaves the canvas
 	} else if(event.LeftUp()) {
-		// The user has stopped dragging a selection box
-	} else if(event.LeftIsDown()) {
-		// The user is currently dragging a selection box
-		wxPoint delta = (mousePos - selectOrigin);
-		wxSize selectSize(
-			float(selectOrigin.x), 0
-		);
-		/*return GetTileOffset() + (point.x / tileSize) +
-		(int(point.y + scrollInterp * tileSize) / tileSize) * ringBuffer.GetWidth();*/
-	}
+		if(graphicsCanvas->HasCapture()) graphicsCanvas->ReleaseMouse();
+		return;
+	} else if(!event.LeftIsDown()) return;
+	mapEditor->selection.SelectRect(selectOrigin, cell, ringBuffer.GetWidth(), TypeTile);
+	graphicsCanvas->Render();
 }
-TileChooser::TileChooser(wxWindow *parent) : wxPanel(parent), scrollDisplacement(0), scrollInterp(0) {
+TileChooser::TileChooser(wxWindow *parent) : wxPanel(parent), scrollDisplacement(0), scrollInterp(0),
+	lastScrollTime(0), lastThumbPosition(0), scrollVelocity(0), scrollDirection(1),
+	prefetchFirst(0), prefetchRows(0) {
+	memset(&prefetchStats, 0, sizeof(PrefetchStats));
 	graphicsCanvas = new GraphicsCanvas(this);
 	scrollVert = new wxScrollBar(this, -1, wxDefaultPosition, wxDefaultSize, wxVERTICAL);
 	toolBar = new wxToolBar(this, -1, wxDefaultPosition, wxDefaultSize,
@@ -72,14 +72,98 @@ void TileChooser::OnMouseWheel(wxMouseEvent &event) {
 	UpdateScroll();
 }
 void TileChooser::Rebuild() {
+	vector<TileIdentifier> tileIdentifiers;
+	tileIdentifiers.reserve(ringBuffer.GetWidth() * ringBuffer.GetHeight());
 	for(int y = 0; y < ringBuffer.GetHeight(); ++y) {
 		for(int x = 0; x < ringBuffer.GetWidth(); ++x) {
 			int index = GetTileOffset() + x + y * ringBuffer.GetWidth();
-			ringBuffer[y][x] = tileManager.Request(index, TypeTile);
+			tileIdentifiers.push_back(TileIdentifier(index, TypeTile));
+		}
+	}
+	vector<TileHandle> handles;
+	tileManager.RequestBatchAsync(tileIdentifiers, handles);
+	for(int y = 0; y < ringBuffer.GetHeight(); ++y) {
+		for(int x = 0; x < ringBuffer.GetWidth(); ++x)
+			ringBuffer[y][x].swap(handles[x + y * ringBuffer.GetWidth()]);
+	}
+}
+void TileChooser::OnScroll(wxScrollEvent &event) {
+	UpdateScroll();
+	if(event.GetEventType() == wxEVT_SCROLL_THUMBRELEASE) LogPrefetchStats();
+}
+void TileChooser::UpdateVelocity() {
+	long now = scrollClock.Time();
+	int thumbPosition = scrollVert->GetThumbPosition();
+	float rows = float(thumbPosition - lastThumbPosition) / float(tileSize);
+	long elapsed = max(now - lastScrollTime, 1L);
+	if(elapsed > VELOCITY_TIMEOUT) scrollVelocity = rows * 1000 / VELOCITY_TIMEOUT;
+	else scrollVelocity = (scrollVelocity + rows * 1000 / elapsed) / 2;
+	if(rows != 0) scrollDirection = (rows > 0)?1:-1;
+	lastScrollTime = now;
+	lastThumbPosition = thumbPosition;
+}
+void TileChooser::UpdatePrefetch() {
+	int width = ringBuffer.GetWidth(), height = ringBuffer.GetHeight();
+	if(width == 0) return;
+	int rowCount = (tileLoader.numTiles[TypeTile] + width - 1) / width;
+	int rows = int(ceil(fabs(scrollVelocity) * PREFETCH_LOOKAHEAD / 1000));
+	rows = min(max(rows, int(PREFETCH_MIN_ROWS)), int(PREFETCH_MAX_ROWS));
+	int first = (scrollDirection > 0)?scrollDisplacement + height:scrollDisplacement - rows;
+	int last = min(first + rows, rowCount);
+	first = max(first, 0);
+	rows = max(last - first, 0);
+	vector<TileHandle> handles(rows * width);
+	vector<TileHandle *> cells;
+	vector<TileIdentifier> tileIdentifiers;
+	for(int row = first; row < first + rows; ++row) {
+		for(int x = 0; x < width; ++x) {
+			TileHandle &cell = handles[(row - first) * width + x];
+			if(row >= prefetchFirst && row < prefetchFirst + prefetchRows) {
+				// Still in the window, so keep the request that's already out
+				cell.swap(prefetchHandles[(row - prefetchFirst) * width + x]);
+			} else if(uint32(row * width + x) < tileLoader.numTiles[TypeTile]) {
+				cells.push_back(&cell);
+				tileIdentifiers.push_back(TileIdentifier(row * width + x, TypeTile));
+			}
 		}
 	}
+	// Whatever is left of the old window is dropped, unless it has scrolled into view
+	for(int row = prefetchFirst; row < prefetchFirst + prefetchRows; ++row) {
+		if(row >= scrollDisplacement && row < scrollDisplacement + height) continue;
+		for(int x = 0; x < width; ++x)
+			if(prefetchHandles[(row - prefetchFirst) * width + x]) ++prefetchStats.dropped;
+	}
+	vector<TileHandle> requested;
+	tileManager.RequestBatchAsync(tileIdentifiers, requested, TileManager::PRIORITY_PREFETCH);
+	for(uint32 i = 0; i < cells.size(); ++i) cells[i]->swap(requested[i]);
+	prefetchStats.issued += tileIdentifiers.size();
+	prefetchHandles.swap(handles);
+	prefetchFirst = first;
+	prefetchRows = rows;
+}
+void TileChooser::ClearPrefetch() {
+	prefetchHandles.clear();
+	prefetchRows = 0;
+}
+void TileChooser::CountRevealed(int firstRow, int rowCount) {
+	int width = ringBuffer.GetWidth();
+	for(int row = firstRow; row < firstRow + rowCount; ++row) {
+		bool prefetched = (row >= prefetchFirst && row < prefetchFirst + prefetchRows);
+		for(int x = 0; x < width; ++x) {
+			if(uint32(row * width + x) >= tileLoader.numTiles[TypeTile]) break;
+			if(!prefetched) ++prefetchStats.misses;
+			else if(prefetchHandles[(row - prefetchFirst) * width + x].IsLoaded()) ++prefetchStats.hits;
+			else ++prefetchStats.late;
+		}
+	}
+}
+void TileChooser::LogPrefetchStats() {
+	wxLogVerbose("Prefetch hit rate %.0f%% (%u hits, %u late, %u misses; %u issued, %u dropped)",
+		prefetchStats.GetHitRate() * 100, prefetchStats.hits, prefetchStats.late,
+		prefetchStats.misses, prefetchStats.issued, prefetchStats.dropped);
 }
 void TileChooser::UpdateScroll() {
+	UpdateVelocity();
 	int deltaPos = (scrollVert->GetThumbPosition() - (scrollDisplacement * tileSize)), advance = 0;
 	scrollInterp = float(deltaPos) / float(tileSize);
 	if(scrollInterp > 1) advance = 1;
@@ -87,23 +171,37 @@ void TileChooser::UpdateScroll() {
 	if(abs(scrollInterp) > ringBuffer.GetHeight()) {
 		scrollDisplacement += advance * floor(scrollInterp);
 		scrollInterp -= floor(scrollInterp);
+		CountRevealed(scrollDisplacement, ringBuffer.GetHeight());
 		Rebuild();
 	} else {
+		// Collect the cells of every row that scrolls into view, and request them all at once
+		vector<TileHandle *> cells;
+		vector<TileIdentifier> tileIdentifiers;
 		while(scrollInterp > 1 || scrollInterp < 0) {
 			scrollInterp += -advance;
 			scrollDisplacement += advance;
 			ringBuffer.Advance(advance);
+			CountRevealed((advance > 0)?scrollDisplacement + ringBuffer.GetHeight() - 1:scrollDisplacement, 1);
 			TileHandle *row = (advance > 0)?ringBuffer.GetBack():ringBuffer.GetFront();
 			for(int x = 0; x < ringBuffer.GetWidth(); ++x) {
 				int index = GetTileOffset() + x;
 				if(advance > 0) index += ringBuffer.GetWidth() * (ringBuffer.GetHeight() - 1);
-				row[x] = tileManager.Request(index, TypeTile);
+				cells.push_back(&row[x]);
+				tileIdentifiers.push_back(TileIdentifier(index, TypeTile));
 			}
 		}
+		vector<TileHandle> handles;
+		tileManager.RequestBatchAsync(tileIdentifiers, handles);
+		for(uint32 i = 0; i < cells.size(); ++i) cells[i]->swap(handles[i]);
 	}
+	UpdatePrefetch();
 	graphicsCanvas->Render();
 }
 uint32 TileChooser::HitTest(wxPoint point) {
+	// Points outside of the canvas hit the nearest tile inside of it
+	wxSize size = graphicsCanvas->GetClientSize();
+	point.x = min(max(point.x, 0), min(size.GetWidth(), ringBuffer.GetWidth() * tileSize) - 1);
+	point.y = min(max(point.y, 0), size.GetHeight() - 1);
 	return GetTileOffset() + (point.x / tileSize) +
 		(int(point.y + scrollInterp * tileSize) / tileSize) * ringBuffer.GetWidth();
 }
@@ -123,7 +221,9 @@ void TileChooser::OnSize(wxSizeEvent &event) {
 		float(ringBuffer.GetHeight() * ringBuffer.GetWidth()) / (float)tileLoader.numTiles[TypeTile],
 		(tileLoader.numTiles[TypeTile] / ringBuffer.GetWidth()) * tileSize,
 		tileSize);
+	ClearPrefetch(); // The rows are a different width now
 	Rebuild();
+	UpdatePrefetch();
 	graphicsCanvas->Render();
 }
 void TileChooser::HandleMiddleDrag(wxMouseEvent &event) {
@@ -135,6 +235,7 @@ void TileChooser::HandleMiddleDrag(wxMouseEvent &event) {
 	} else if(event.MiddleUp()) {
 		// We've stopped dragging, reset the cursor!
 		this->SetCursor(wxNullCursor);
+		LogPrefetchStats();
 	} else if(event.MiddleIsDown()) {
 		if(!draggingIgnoreEvent) {
 			scrollVert->SetThumbPosition(scrollVert->GetThumbPosition() -
@@ -146,21 +247,24 @@ void TileChooser::HandleMiddleDrag(wxMouseEvent &event) {
 	}
 }
 void TileChooser::GraphicsCanvas::Render() {
+	STATS_TIME(FRAME_RENDER);
+	tileManager.UploadCompleted(); // This makes the main context current, so do it first
 	this->SetCurrent();
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 	glPushMatrix();
 	glTranslatef(0, -tileChooser->scrollInterp * tileSize, 0);
+	spriteBatch.Begin();
 	TileGraphic *tileGraphic = 0;
 	for(int y = 0; y < tileChooser->ringBuffer.GetHeight(); ++y) {
 		for(int x = 0; x < tileChooser->ringBuffer.GetWidth(); ++x) {
 			tileGraphic = tileChooser->ringBuffer[y][x];
-			if(find(mapEditor->selection.begin(), mapEditor->selection.end(),
-				make_pair<uint32, int>(tileGraphic->index, TypeTile)) != mapEditor->selection.end())
-				glColor3f(0.5, 0.5, 0.5);
-			else glColor3f(1, 1, 1);
-			tileGraphic->Render(x * tileSize, y * tileSize);
+			bool selected = mapEditor->selection.IsSelected(TileIdentifier(tileGraphic->index, TypeTile));
+			spriteBatch.Draw(tileGraphic, x * tileSize, y * tileSize,
+				selected?uint32(SELECTED_TINT):uint32(SpriteBatch::WHITE));
 		}
 	}
+	spriteBatch.End();
+	textureAtlas.Unbind();
 	glPopMatrix();
 	this->SwapBuffers();
 }
@@ -178,4 +282,5 @@ void TileChooser::GraphicsCanvas::OnMotion(wxMouseEvent &event) {
 }
 #endif
 TileChooser::GraphicsCanvas::GraphicsCanvas(TileChooser *tileChooser_) :
-	BasicCanvas(tileChooser_, true), tileChooser(tileChooser_) { }
\ No newline at end of file
+	BasicCanvas(tileChooser_, true), tileChooser(tileChooser_) {
+	tileManager.AddListener(this); }
\ No newline at end of file
@@ -12,9 +12,27 @@
 class TileChooser : public wxPanel {
 public:
 	TileChooser(wxWindow *parent);
+	// How well prefetching kept up with the scrolling, in tiles
+	struct PrefetchStats {
+		uint32 issued; // Tiles requested ahead of the scroll
+		uint32 hits; // Prefetched tiles that were already decoded when they scrolled into view
+		uint32 late; // Prefetched tiles that were still pending when they scrolled into view
+		uint32 misses; // Tiles that scrolled into view without having been prefetched
+		uint32 dropped; // Prefetched tiles that the scroll fell behind or turned away from
+		inline float GetHitRate() const {
+			uint32 revealed = hits + late + misses;
+			return revealed?float(hits) / float(revealed):0;
+		}
+	};
+	inline const PrefetchStats &GetPrefetchStats() const { return prefetchStats; }
 private:
 	static const int tilePadding = 2; // Padding between displayed tiles
 	static const int tileSize = 48 + tilePadding; // Total tile size
+	// Prefetch far enough ahead to cover this many milliseconds of scrolling at the current speed
+	static const int PREFETCH_LOOKAHEAD = 300;
+	static const int PREFETCH_MIN_ROWS = 1, PREFETCH_MAX_ROWS = 64;
+	// Scroll events further apart than this many milliseconds start a new gesture
+	static const int VELOCITY_TIMEOUT = 200;
 	friend class GraphicsCanvas;
 	class GraphicsCanvas;
 	/* A buffer which stores rows of tile handles that allows you to move the "head" of the
@@ -72,12 +90,31 @@ private:
 	wxToolBar *toolBar; // TODO: Something better than a tool bar for this?
 	// TODO: Implement the zoom feature
 	/* int zoomLevel; */
-	wxPoint selectOrigin; // The point where the user first started dragging a selection box
+	uint32 selectOrigin; // The tile where the user first started dragging a selection box
 	void UpdateScroll(); // Update the data from the position of the scroll bar
+	/* Scrolling is tracked in rows per second, smoothed over the events of a gesture; it
+	 * decides how far ahead of the visible rows UpdatePrefetch requests tiles */
+	void UpdateVelocity();
+	wxStopWatch scrollClock;
+	long lastScrollTime;
+	int lastThumbPosition;
+	float scrollVelocity;
+	int scrollDirection; // The direction of the last movement; 1 is down, -1 is up
+	/* Hold low priority requests for the rows just past the visible ones, in the direction of
+	 * the scroll. Rows that fall out of the window are dropped, which cancels whatever in them
+	 * hasn't been decoded yet. */
+	void UpdatePrefetch();
+	void ClearPrefetch();
+	// Count the rows that have just scrolled into view against the prefetch window
+	void CountRevealed(int firstRow, int rowCount);
+	void LogPrefetchStats();
+	std::vector<TileHandle> prefetchHandles; // Row by row, starting at prefetchFirst
+	int prefetchFirst, prefetchRows;
+	PrefetchStats prefetchStats;
 	void HandleMiddleDrag(wxMouseEvent &event); // For dragging using the middle mouse button
 	void HandleSelectionDrag(wxMouseEvent &event); // For selecting things by dragging the mouse
 	void OnMouseWheel(wxMouseEvent &event); // For scrolling using the mouse wheel
-	inline void OnScroll(wxScrollEvent &event) { UpdateScroll(); }
+	void OnScroll(wxScrollEvent &event);
 	void OnSize(wxSizeEvent &event); // Resize the control manually!
 	// Get the index of the first tile displayed within the tile chooser, based on the scroll displacement
 	inline int GetTileOffset() { return scrollDisplacement * ringBuffer.GetWidth(); }
@@ -2,12 +2,13 @@
 #include <wx/glcanvas.h>
 #include "TileLoader.h"
 #include "MapEditor.h"
-#include <sstream>
-#include <fstream>
+#include "PaletteExpander.h"
+#include "TileCache.h"
+#include "PipelineStats.h"
 #include <algorithm>
-#include <gl/gl.h>
-#include <gl/glu.h>
+#include <boost/bind.hpp>
 #include <boost/format.hpp>
+#include <boost/thread/thread.hpp>
 #include <boost/lexical_cast.hpp>
 using namespace boost;
 using namespace std;
@@ -16,161 +17,390 @@ uint32 TileLoader::numArchives[2] = { 16, 18 };
 const char *TileLoader::typeNames[2] = { "tile", "tilec" };
 uint32 TileLoader::numTiles[2] = { 0, 0 };
 
-GLuint TileLoader::Load(pair<uint32, int> tileIdentifier, uint32 &width, uint32 &height) {
-	uint32 index = tileIdentifier.first;
-	int tileType = tileIdentifier.second;
+TextureAtlas::Slot TileLoader::Load(TileIdentifier tileIdentifier, uint32 &width, uint32 &height) {
+	vector<TileIdentifier> tileIdentifiers(1, tileIdentifier);
+	vector<TextureAtlas::Slot> slots;
+	vector<TileMetrics> metrics;
+	LoadBatch(tileIdentifiers, slots, metrics);
+	width = metrics[0].width;
+	height = metrics[0].height;
+	return slots[0];
+}
+void TileLoader::LoadBatch(const vector<TileIdentifier> &tileIdentifiers,
+	vector<TextureAtlas::Slot> &slots, vector<TileMetrics> &metrics) {
+	vector<DecodedTile> tiles;
+	vector<uint32> staging;
+	DecodeBatch(tileIdentifiers, tiles, staging);
+	slots.assign(tiles.size(), TextureAtlas::Slot());
+	metrics.resize(tiles.size());
+	// NOTE: This assumes that wxGLContext::SetCurrent is a threadsafe operation...?
+	if(mainContext) mainContext->SetCurrent(); // Without one, use whatever context is current
+	for(uint32 i = 0; i < tiles.size(); ++i) {
+		metrics[i].width = tiles[i].width;
+		metrics[i].height = tiles[i].height;
+		if(tiles[i].width * tiles[i].height == 0) continue; // The tile doesn't exist
+		slots[i] = textureAtlas.Insert(&staging[tiles[i].offset], tiles[i].width, tiles[i].height);
+	}
+}
+struct TileLoader::BatchRead {
+	uint32 request; // The index of the tile in the batch
+	uint32 archiveIndex;
+	const GraphicsTileInfo *tileInfo;
+	inline bool operator <(const BatchRead &compare) const {
+		if(archiveIndex != compare.archiveIndex) return archiveIndex < compare.archiveIndex;
+		return tileInfo->startOffset < compare.tileInfo->startOffset;
+	}
+};
+uint32 TileLoader::PlanBatch(const vector<TileIdentifier> &tileIdentifiers,
+	vector<DecodedTile> &tiles, vector<BatchRead> &reads) {
+	// Look up every tile, and then sort the reads so that each archive is read front to back
+	reads.clear();
+	reads.reserve(tileIdentifiers.size());
+	tiles.resize(tileIdentifiers.size());
+	{
+		STATS_TIME(ARCHIVE_READ);
+		for(uint32 i = 0; i < tileIdentifiers.size(); ++i) {
+			DecodedTile &tile = tiles[i];
+			tile.tileIdentifier = tileIdentifiers[i];
+			tile.width = tile.height = tile.offset = 0;
+			tile.palette = 0;
+			BatchRead read;
+			read.request = i;
+			read.tileInfo = FindTileInfo(tileIdentifiers[i].first,
+				tileIdentifiers[i].second, read.archiveIndex);
+			if(read.tileInfo) reads.push_back(read);
+		}
+		sort(reads.begin(), reads.end());
+	}
+	// Lay the tiles out in the staging buffer in the order that they will be read
+	uint32 stagingSize = 0;
+	for(vector<BatchRead>::iterator i = reads.begin(); i != reads.end(); ++i) {
+		DecodedTile &tile = tiles[i->request];
+		tile.width = i->tileInfo->GetWidth();
+		tile.height = i->tileInfo->GetHeight();
+		tile.offset = stagingSize;
+		stagingSize += tile.width * tile.height;
+	}
+	return stagingSize;
+}
+const uint8 *TileLoader::GetPixels(const DecodedTile &tile, const BatchRead &read) {
+	GraphicsArchive &archive = *graphicsArchives[tile.tileIdentifier.second][read.archiveIndex];
+	// The tile data is located relative to the end of the EPF header
+	return archive.file.At<uint8>(archive.epfOffset + 12 + read.tileInfo->startOffset,
+		tile.width * tile.height);
+}
+void TileLoader::DecodeBatch(const vector<TileIdentifier> &tileIdentifiers,
+	vector<DecodedTile> &tiles, vector<uint32> &staging) {
+	if(cache) { DecodeCached(tileIdentifiers, tiles, staging); return; }
+	vector<BatchRead> reads;
+	staging.resize(PlanBatch(tileIdentifiers, tiles, reads));
+	for(vector<BatchRead>::iterator i = reads.begin(); i != reads.end(); ++i) {
+		DecodedTile &tile = tiles[i->request];
+		uint32 pixelCount = tile.width * tile.height;
+		if(pixelCount == 0) continue;
+		RequirePalettes(tile.tileIdentifier.second);
+		const uint8 *pixels = GetPixels(tile, *i);
+		tile.palette = GetPalette(tile.tileIdentifier);
+		{
+			STATS_TIME(PALETTE_EXPANSION);
+			ExpandPalette(pixels, &staging[tile.offset], pixelCount, tile.palette);
+		}
+		STATS_COUNT(BYTES_READ, pixelCount);
+		STATS_COUNT(BYTES_DECODED, pixelCount * 4);
+		++counters.loads;
+	}
+}
+void TileLoader::DecodeIndexedBatch(const vector<TileIdentifier> &tileIdentifiers,
+	vector<DecodedTile> &tiles, vector<uint8> &staging) {
+	if(cache) { DecodeCachedIndexed(tileIdentifiers, tiles, staging); return; }
+	vector<BatchRead> reads;
+	staging.resize(PlanBatch(tileIdentifiers, tiles, reads));
+	for(vector<BatchRead>::iterator i = reads.begin(); i != reads.end(); ++i) {
+		DecodedTile &tile = tiles[i->request];
+		uint32 pixelCount = tile.width * tile.height;
+		if(pixelCount == 0) continue;
+		RequirePalettes(tile.tileIdentifier.second);
+		memcpy(&staging[tile.offset], GetPixels(tile, *i), pixelCount);
+		tile.palette = GetPalette(tile.tileIdentifier);
+		STATS_COUNT(BYTES_READ, pixelCount);
+		++counters.loads;
+	}
+}
+uint32 TileLoader::PlanCached(const vector<TileIdentifier> &tileIdentifiers,
+	vector<DecodedTile> &tiles, vector<const TileCache::CachedTile *> &cachedTiles) {
+	cachedTiles.resize(tileIdentifiers.size());
+	tiles.resize(tileIdentifiers.size());
+	uint32 stagingSize = 0;
+	for(uint32 i = 0; i < tileIdentifiers.size(); ++i) {
+		DecodedTile &tile = tiles[i];
+		tile.tileIdentifier = tileIdentifiers[i];
+		cachedTiles[i] = cache->GetTile(tileIdentifiers[i].first, tileIdentifiers[i].second);
+		tile.width = cachedTiles[i]?cachedTiles[i]->width:0;
+		tile.height = cachedTiles[i]?cachedTiles[i]->height:0;
+		tile.offset = stagingSize;
+		tile.palette = cachedTiles[i]?GetPalette(tileIdentifiers[i]):0;
+		stagingSize += tile.width * tile.height;
+	}
+	return stagingSize;
+}
+void TileLoader::DecodeCached(const vector<TileIdentifier> &tileIdentifiers,
+	vector<DecodedTile> &tiles, vector<uint32> &staging) {
+	// The tiles are already decoded, so this is just a copy out of the mapping
+	STATS_TIME(ARCHIVE_READ);
+	vector<const TileCache::CachedTile *> cachedTiles;
+	staging.resize(PlanCached(tileIdentifiers, tiles, cachedTiles));
+	for(uint32 i = 0; i < tiles.size(); ++i) {
+		uint32 pixelCount = tiles[i].width * tiles[i].height;
+		if(pixelCount == 0) continue;
+		memcpy(&staging[tiles[i].offset], cache->GetPixels(*cachedTiles[i]), pixelCount * 4);
+		STATS_COUNT(BYTES_READ, pixelCount * 4);
+		++counters.loads;
+	}
+}
+void TileLoader::DecodeCachedIndexed(const vector<TileIdentifier> &tileIdentifiers,
+	vector<DecodedTile> &tiles, vector<uint8> &staging) {
+	STATS_TIME(ARCHIVE_READ);
+	vector<const TileCache::CachedTile *> cachedTiles;
+	staging.resize(PlanCached(tileIdentifiers, tiles, cachedTiles));
+	for(uint32 i = 0; i < tiles.size(); ++i) {
+		uint32 pixelCount = tiles[i].width * tiles[i].height;
+		if(pixelCount == 0) continue;
+		memcpy(&staging[tiles[i].offset], cache->GetIndices(*cachedTiles[i]), pixelCount);
+		STATS_COUNT(BYTES_READ, pixelCount);
+		++counters.loads;
+	}
+}
+const TileLoader::GraphicsTileInfo *TileLoader::FindTileInfo(
+	uint32 index, int tileType, uint32 &archiveIndex) {
 	if(index >= numTiles[tileType]) return 0;
 	// Determine in which archive the tile with the specified index resides
-	int archiveIndex = 0, // The index of the archive
-		baseIndex = 0; // The absolute index of the first tile in our archive
-	for(; archiveIndex < numArchives[tileType] && (baseIndex +
-		graphicsFiles[tileType][archiveIndex].tileCount) <= index; ++archiveIndex)
-		baseIndex += graphicsFiles[tileType][archiveIndex].tileCount;
-	if(archiveIndex == numArchives[tileType]) return 0; // TODO: Better errors
-	int localIndex = (index - baseIndex); // Determine the relative index of the tile
-	// Open up the archive and read the header
-	string fileName = (typeNames[tileType] + lexical_cast<string>(archiveIndex));
-	ifstream in((dataPath + fileName + ".dat").c_str(), ios::binary);
-	ArchiveHeader header;
-	in >> header;
-	ArchiveSeek(in, header, (fileName + ".epf").c_str());
+	vector<uint32> &bases = archiveBases[tileType];
+	archiveIndex = (upper_bound(bases.begin(), bases.end(), index) - bases.begin()) - 1;
+	uint32 localIndex = (index - bases[archiveIndex]); // The relative index of the tile
+	// The archive was mapped and its header parsed back in Init
+	GraphicsArchive &archive = *graphicsArchives[tileType][archiveIndex];
 	// Get the offset to the GraphicsTileInfo for our tile using the base info offset
 	uint32 infoOffset = graphicsFiles[tileType][archiveIndex].infoOffset +
 		12 /* Account for the header in our calculations */ + sizeof(GraphicsTileInfo) * localIndex;
-	in.seekg(infoOffset, ios::cur); // Seek to the GraphicsTileInfo and read it in
-	GraphicsTileInfo tileInfo;
-	in.read((char *)&tileInfo, sizeof(GraphicsTileInfo));
-	in.seekg(tileInfo.startOffset + 12 - infoOffset - sizeof(GraphicsTileInfo), ios::cur);
-	uint8 *tileData = new uint8[tileInfo.GetWidth() * tileInfo.GetHeight() * 3];
-	Palette &palette = paletteSets[tileType][paletteTables[tileType][index]];
-	for(int y = 0; y < tileInfo.GetHeight(); ++y) {
-		for(int x = 0; x < tileInfo.GetWidth(); ++x) {
-			uint8 buffer;
-			in.read((char *)&buffer, 1);
-			uint32 dataOffset = (x + y * tileInfo.GetWidth()) * 3;
-			wxColor &color = palette.data[buffer];
-			tileData[dataOffset + 0] = color.Red();
-			tileData[dataOffset + 1] = color.Green();
-			tileData[dataOffset + 2] = color.Blue();
+	return archive.file.At<GraphicsTileInfo>(archive.epfOffset + infoOffset);
+}
+void TileLoader::GetMetrics(const vector<TileIdentifier> &tileIdentifiers,
+	vector<TileMetrics> &metrics) {
+	metrics.resize(tileIdentifiers.size());
+	for(uint32 i = 0; i < tileIdentifiers.size(); ++i) {
+		if(cache) {
+			const TileCache::CachedTile *cachedTile =
+				cache->GetTile(tileIdentifiers[i].first, tileIdentifiers[i].second);
+			metrics[i].width = cachedTile?cachedTile->width:0;
+			metrics[i].height = cachedTile?cachedTile->height:0;
+			continue;
 		}
+		uint32 archiveIndex;
+		const GraphicsTileInfo *tileInfo =
+			FindTileInfo(tileIdentifiers[i].first, tileIdentifiers[i].second, archiveIndex);
+		metrics[i].width = tileInfo?tileInfo->GetWidth():0;
+		metrics[i].height = tileInfo?tileInfo->GetHeight():0;
 	}
-	// NOTE: This assumes that wxGLContext::SetCurrent is a threadsafe operation...?
-	mainContext->SetCurrent();
-	glEnable(GL_TEXTURE_2D);
-	GLuint texture = 0;
-	glGenTextures(1,  &texture);
-	glBindTexture(GL_TEXTURE_2D, texture);
-	gluBuild2DMipmaps(GL_TEXTURE_2D, 3, tileInfo.GetWidth(), tileInfo.GetHeight(),
-		GL_RGB, GL_UNSIGNED_BYTE, tileData);
-	glBindTexture(GL_TEXTURE_2D, 0);
-	delete[] tileData;
-	width = tileInfo.GetWidth();
-	height = tileInfo.GetHeight();
-	return texture;
 }
 void TileLoader::Init() {
-	dataPath = "C:/program files/nexustk/data/"; // TEMP
-	// TODO: Make sure that every archive has the necessary files
-	ArchiveHeader header;
-	{
-		// Open up the main archive, tile.dat
-		ifstream in((format("%1%tile.dat") % dataPath).str().c_str(), ios::binary);
-		in >> header;
-		for(int i = 0; i < 2; ++i) {
-			string fileName(typeNames[i]);
-			ArchiveSeek(in, header, (fileName + ".pal").c_str());
-			in >> paletteSets[i]; // Read in palette information
-			ArchiveSeek(in, header, (fileName + ".tbl").c_str());
-			in >> paletteTables[i]; // Read in table information
+	wxStopWatch totalWatch, phaseWatch;
+	// Init runs again whenever the data path or the cache setting changes
+	Reset();
+	numTiles[0] = numTiles[1] = 0;
+	bool cached = useCache && OpenCache();
+	timings.cache = phaseWatch.Time();
+	if(!cached) {
+		// TODO: Make sure that every archive has the necessary files
+		try {
+			phaseWatch.Start();
+			// Map the main archive, tile.dat. It stays mapped so that the palettes of a tile type
+			// can be read when that type is first decoded.
+			mainFile.Open((format("%1%tile.dat") % dataPath).str());
+			++counters.archiveOpens;
+			MappedReader in(mainFile);
+			in >> mainHeader;
+			++counters.headerParses;
+			timings.mainArchive = phaseWatch.Time();
+			phaseWatch.Start();
+			ReadGraphicsHeaders();
+			timings.graphicsHeaders = phaseWatch.Time();
+		}
+		catch(...) {
+			// Rather than leave half of the archives mapped
+			Reset();
+			numTiles[0] = numTiles[1] = 0;
+			throw;
 		}
 	}
-	// Open up all of the graphics archives and determine how many tiles they contain
+	timings.total = totalWatch.Time();
+	wxLogVerbose("TileLoader::Init took %ldms (cache %ldms, tile.dat %ldms, graphics headers %ldms)",
+		timings.total, timings.cache, timings.mainArchive, timings.graphicsHeaders);
+}
+void TileLoader::ReadGraphicsHeaders() {
+	// Map all of the graphics archives and determine how many tiles they contain. The
+	// archives stay mapped so that Load doesn't have to open them and parse them again.
+	vector<GraphicsHeaderRead> headerReads;
 	for(int i = 0; i < 2; ++i) {
-		for(int j = 0; j < numArchives[i]; ++j) {
-			string fileName = (format("%1%%2%") % typeNames[i] % j).str();
-			ifstream in((dataPath + fileName + ".dat").c_str(), ios::binary);
-			in >> header;
-			ArchiveSeek(in, header, (fileName + ".epf").c_str());
-			GraphicsHeader graphicsHeader;
-			in.read((char *)&graphicsHeader, sizeof(GraphicsHeader));
-			graphicsFiles[i].push_back(graphicsHeader);
-			numTiles[i] += graphicsHeader.tileCount;
+		for(uint32 j = 0; j < numArchives[i]; ++j) {
+			GraphicsHeaderRead headerRead = { i, j };
+			headerReads.push_back(headerRead);
+			graphicsArchives[i].push_back(new GraphicsArchive);
+		}
+	}
+	/* The reads are spread over a few threads, since each one mostly waits on the disk (or on
+	 * the network, if the data directory is mounted from somewhere else). */
+	boost::atomic<uint32> nextRead(0);
+	vector<string> errors(headerReads.size());
+	boost::thread_group readers;
+	uint32 readerCount = MAX_HEADER_READERS;
+	if(headerReads.size() < readerCount) readerCount = headerReads.size();
+	for(uint32 i = 0; i < readerCount; ++i)
+		readers.create_thread(boost::bind(&TileLoader::HeaderReader, this, &headerReads, &nextRead, &errors));
+	readers.join_all();
+	for(vector<string>::iterator i = errors.begin(); i != errors.end(); ++i)
+		if(!i->empty()) throw exception(i->c_str());
+	counters.archiveOpens += headerReads.size();
+	counters.headerParses += headerReads.size();
+	// Now that every header is in, lay out the tile indices in archive order
+	for(int i = 0; i < 2; ++i) {
+		numTiles[i] = 0;
+		archiveBases[i].push_back(0);
+		for(uint32 j = 0; j < numArchives[i]; ++j) {
+			graphicsFiles[i].push_back(graphicsArchives[i][j]->graphicsHeader);
+			numTiles[i] += graphicsArchives[i][j]->graphicsHeader.tileCount;
+			archiveBases[i].push_back(numTiles[i]);
 		}
 	}
 }
-istream &operator >>(istream &in, TileLoader::PaletteTable &table) {
-	uint16 count;
-	in.read((char *)&count, 2);
-	in.seekg(2, ios::cur);
-	table.reserve(count);
-	uint8 buffer;
-	for(int i = 0; i < count; ++i) {
-		in.read((char *)&buffer, 1);
-		in.seekg(1, ios::cur);
-		table.push_back(buffer);
+void TileLoader::HeaderReader(const vector<GraphicsHeaderRead> *headerReads,
+	boost::atomic<uint32> *nextRead, vector<string> *errors) {
+	for(uint32 i = (*nextRead)++; i < headerReads->size(); i = (*nextRead)++) {
+		int tileType = (*headerReads)[i].tileType;
+		uint32 index = (*headerReads)[i].index;
+		try {
+			string fileName = (format("%1%%2%") % typeNames[tileType] % index).str();
+			GraphicsArchive *archive = graphicsArchives[tileType][index];
+			archive->file.Open(dataPath + fileName + ".dat");
+			MappedReader in(archive->file);
+			in >> archive->header;
+			ArchiveSeek(in, archive->header, (fileName + ".epf").c_str());
+			archive->epfOffset = in.Tell();
+			archive->graphicsHeader = in.Get<GraphicsHeader>();
+		} catch(std::exception &e) { (*errors)[i] = e.what(); } // Rethrown by ReadGraphicsHeaders
 	}
+}
+void TileLoader::RequirePalettes(int tileType) {
+	if(palettesLoaded[tileType].load(boost::memory_order_acquire)) return;
+	boost::mutex::scoped_lock lock(paletteMutex);
+	if(palettesLoaded[tileType].load(boost::memory_order_relaxed)) return;
+	wxStopWatch stopWatch;
+	MappedReader in(mainFile);
+	string fileName(typeNames[tileType]);
+	ArchiveSeek(in, mainHeader, (fileName + ".pal").c_str());
+	in >> paletteSets[tileType]; // Read in palette information
+	if(tileType == TypeObject) { // Index 0 is transparent in object tiles
+		for(PaletteSet::iterator i = paletteSets[tileType].begin(); i != paletteSets[tileType].end(); ++i)
+			i->data[0] = 0;
+	}
+	ArchiveSeek(in, mainHeader, (fileName + ".tbl").c_str());
+	in >> paletteTables[tileType]; // Read in table information
+	timings.palettes[tileType] = stopWatch.Time(); // Not logged, since this may be a worker
+	palettesLoaded[tileType].store(true, boost::memory_order_release);
+}
+bool TileLoader::OpenCache() {
+	vector<TileCache::SourceStamp> stamps;
+	try { TileCache::Stamp(*this, stamps); }
+	catch(std::exception &) { return false; } // Let the regular path report missing files
+	cache = new TileCache;
+	if(!cache->Open(GetCachePath(), stamps)) {
+		delete cache;
+		cache = 0;
+		return false;
+	}
+	cache->Restore(*this);
+	return true;
+}
+string TileLoader::GetCachePath() const { return dataPath + "aesir-tiles.cache"; }
+void TileLoader::Reset() {
+	delete cache;
+	cache = 0;
+	for(int i = 0; i < 2; ++i) {
+		for(vector<GraphicsArchive *>::iterator j = graphicsArchives[i].begin();
+			j != graphicsArchives[i].end(); ++j) delete *j;
+		graphicsArchives[i].clear();
+		graphicsFiles[i].clear();
+		archiveBases[i].clear();
+		paletteTables[i].clear();
+		paletteSets[i].clear();
+		palettesLoaded[i] = false;
+	}
+	mainFile.Close();
+	mainHeader.files.clear();
+}
+TileLoader::~TileLoader() {
+	Reset();
+}
+MappedReader &operator >>(MappedReader &in, TileLoader::PaletteTable &table) {
+	uint16 count = in.Get<uint16>();
+	in.Skip(2);
+	// Each entry is two bytes, of which only the first one is used
+	const uint8 *entries = in.Read<uint8>(count * 2);
+	table.reserve(count);
+	for(int i = 0; i < count; ++i)
+		table.push_back(entries[i * 2]);
 	return in;
 }
-istream &operator >>(istream &in, TileLoader::PaletteSet &set) {
-	uint8 count, type;
-	in.read((char *)&count, 1);
+MappedReader &operator >>(MappedReader &in, TileLoader::PaletteSet &set) {
+	uint8 count = in.Get<uint8>(), type;
 	set.reserve(count);
-	in.seekg(3, ios::cur);
-	char header[10] = { 0 };
+	in.Skip(3);
 	int index = 0;
 	while(index < count) {
-		in.read((char *)&header, 9);
-		if(strcmp(header, "DLPalette")) { /* TODO: Better errors */
+		if(strncmp(in.Read<char>(9), "DLPalette", 9)) { /* TODO: Better errors */
 			string error = (format("Bad header in palette %1%") % index).str();
-			int32 tell = in.tellg(); // TEMP: What is this?
 			throw exception(error.c_str());
 		}
-		in.seekg(15, ios::cur);
-		in.read((char *)&type, 1);
+		in.Skip(15);
+		type = in.Get<uint8>();
 		switch(type) {
-			case 3: in.seekg(13, ios::cur); break;
-			case 1: in.seekg(9, ios::cur); break;
-			case 2: in.seekg(11, ios::cur); break;
-			case 4: in.seekg(15, ios::cur); break;
-			default: in.seekg(7, ios::cur); break;
+			case 3: in.Skip(13); break;
+			case 1: in.Skip(9); break;
+			case 2: in.Skip(11); break;
+			case 4: in.Skip(15); break;
+			default: in.Skip(7); break;
 		}
-		uint32 buffer;
+		const uint32 *entries = in.Read<uint32>(256);
 		set.push_back(TileLoader::Palette());
-		for(int i = 0; i < 256; ++i) {
-			in.read((char *)&buffer, 4);
-			set[index].data[i] = wxColor(
-				(buffer & 0x000000FF),
-				(buffer & 0x0000FF00) >> 8,
-				(buffer & 0x00FF0000) >> 16
-			);
-		}
+		// The entries are stored as RGBX; bake them into opaque RGBA
+		for(int i = 0; i < 256; ++i)
+			set[index].data[i] = (entries[i] & 0x00FFFFFF) | 0xFF000000;
 		++index;
 	}
 	return in;
 }
-istream &operator >>(istream &in, TileLoader::ArchiveHeader &header) {
+MappedReader &operator >>(MappedReader &in, TileLoader::ArchiveHeader &header) {
 	header.files.clear();
-	uint32 count;
-	in.read((char *)&count, 4);
+	uint32 count = in.Get<uint32>();
 	for(int i = 0; i < (count - 1); ++i) {
 		TileLoader::ArchiveFile file;
-		in.read((char *)&file.offset, 4);
-		in.read((char *)file.name, 13);
-		transform(file.name, file.name + strlen(file.name), file.name, tolower);
+		file.offset = in.Get<uint32>();
+		memcpy(file.name, in.Read<char>(13), 13);
+		file.name[12] = 0;
+		transform(file.name, file.name + strlen(file.name), file.name, ::tolower);
 		header.files.push_back(file);
 	}
 	return in;
 }
 uint32 TileLoader::ArchiveFileSize(
-	istream &in, TileLoader::ArchiveHeader &header, const char *fileName) { return -1; }
+	MappedReader &in, TileLoader::ArchiveHeader &header, const char *fileName) { return -1; }
 void TileLoader::ArchiveSeek(
-	istream &in, TileLoader::ArchiveHeader &header, const char *fileName) {
+	MappedReader &in, TileLoader::ArchiveHeader &header, const char *fileName) {
 	vector<ArchiveFile>::iterator i = find(header.files.begin(), header.files.end(), fileName);
-	if(i != header.files.end()) in.seekg(i->offset, ios::beg); else
+	if(i != header.files.end()) in.Seek(i->offset); else
 		/* TODO: Better error handling */ throw exception("Invalid file requested");
 }
 bool TileLoader::ArchiveFile::operator ==(const char *compare) {
 	string compareLower(compare);
-	transform(compareLower.begin(), compareLower.end(), compareLower.begin(), tolower);
+	transform(compareLower.begin(), compareLower.end(), compareLower.begin(), ::tolower);
 	return (compareLower == name);
 }
\ No newline at end of file
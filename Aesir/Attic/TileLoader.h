@@ -1,23 +1,100 @@
 #pragma once
 #include <vector>
 #include <string>
-#include <iobinaryReader>
 #include <utility>
-#include <wx/colour.h>
+#include <boost/atomic.hpp>
+#include <boost/thread/mutex.hpp>
+#include "MappedFile.h"
+#include "TextureAtlas.h"
+#include "TileCache.h"
 class TileGraphic;
-typedef unsigned int GLuint;
 #define TypeTile 0
 #define TypeObject 1
+typedef std::pair<uint32, int> TileIdentifier;
 
 class TileLoader {
 public:
 	static uint32 numTiles[2];
+	/* Work out how many tiles there are and read the palettes. If the tile cache is enabled
+	 * and current, everything comes out of the cache, and no archive is opened at all. */
 	void Init();
-	GLuint Load(std::pair<uint32, int> tileIdentifier, uint32 &width, uint32 &height);
+	// Whether Init may use the tile cache; turn this off before Init to go to the data files
+	inline void EnableCache(bool enable) { useCache = enable; }
+	inline bool IsCached() const { return (cache != 0); } // Whether tiles come from the cache
+	std::string GetCachePath() const; // Where the tile cache lives, next to the data files
+	// The directory that holds the data files, ending with a slash; set this before Init
+	inline void SetDataPath(const std::string &dataPath_) { dataPath = dataPath_; }
+	inline static uint32 GetArchiveCount(int tileType) { return numArchives[tileType]; }
+	inline static const char *GetTypeName(int tileType) { return typeNames[tileType]; }
+	// Load a tile into the texture atlas
+	TextureAtlas::Slot Load(TileIdentifier tileIdentifier, uint32 &width, uint32 &height);
+	// The dimensions of a tile, which can be obtained without decoding the tile
+	struct TileMetrics { uint32 width, height; };
+	// Get the metrics for many tiles at once; tiles that don't exist get zero dimensions
+	void GetMetrics(const std::vector<TileIdentifier> &tileIdentifiers,
+		std::vector<TileMetrics> &metrics);
+	/* Load many tiles at once; slots[i] and metrics[i] belong to tileIdentifiers[i]. The
+	 * tiles are read grouped by archive and in file order, no matter what order they were
+	 * requested in. */
+	void LoadBatch(const std::vector<TileIdentifier> &tileIdentifiers,
+		std::vector<TextureAtlas::Slot> &slots, std::vector<TileMetrics> &metrics);
+	// A tile that has been decoded, but not uploaded
+	struct DecodedTile {
+		TileIdentifier tileIdentifier;
+		uint32 width, height;
+		uint32 offset; // The offset of the pixels in the staging buffer
+		const uint32 *palette; // The RGBA lookup table of the tile, or 0 if the tile doesn't exist
+	};
+	/* Decode many tiles into one contiguous staging buffer. The tiles are laid out in the
+	 * buffer in the order in which they were read. Decoding doesn't touch GL, so once Init is
+	 * done this can be called from any thread. */
+	void DecodeBatch(const std::vector<TileIdentifier> &tileIdentifiers,
+		std::vector<DecodedTile> &tiles, std::vector<uint32> &staging);
+	/* Like DecodeBatch, but leave the tiles as 8-bit palette indices, a quarter of the size.
+	 * ExpandPalette with each tile's palette gives exactly what DecodeBatch would have. The
+	 * palettes stay put for as long as the loader is around. */
+	void DecodeIndexedBatch(const std::vector<TileIdentifier> &tileIdentifiers,
+		std::vector<DecodedTile> &tiles, std::vector<uint8> &staging);
+	/* Counters for the archive work done by the loader. After Init, archiveOpens and
+	 * headerParses should stay put no matter how many tiles are loaded. */
+	struct Counters {
+		boost::atomic<uint32> loads; // The decode workers count their loads here too
+		uint32 archiveOpens, headerParses;
+		inline Counters() : loads(0), archiveOpens(0), headerParses(0) { }
+	};
+	inline const Counters &GetCounters() { return counters; }
+	/* How long each phase of Init took, in milliseconds. The palettes of a tile type are read
+	 * when that type is first decoded, so their times are only filled in then. */
+	struct Timings {
+		long cache, mainArchive, graphicsHeaders, total;
+		long palettes[2];
+		inline Timings() : cache(0), mainArchive(0), graphicsHeaders(0), total(0) {
+			palettes[0] = palettes[1] = 0; }
+	};
+	inline const Timings &GetTimings() { return timings; }
+	inline TileLoader() : useCache(true), cache(0),
+		dataPath("C:/program files/nexustk/data/") /* TEMP */ {
+		palettesLoaded[0] = palettesLoaded[1] = false; }
+	~TileLoader();
 private:
+	friend class TileCache; // For access to the metadata that goes into the cache
+	Counters counters;
+	Timings timings;
+	bool useCache;
+	TileCache *cache; // The mapped tile cache, if Init found a current one
+	bool OpenCache(); // Try to initialise from the tile cache
+	// Unmap and forget everything that Init found, apart from numTiles, which every loader shares
+	void Reset();
+	// Look up a batch in the cache; returns the number of pixels that the staging buffer needs
+	uint32 PlanCached(const std::vector<TileIdentifier> &tileIdentifiers, std::vector<DecodedTile> &tiles,
+		std::vector<const TileCache::CachedTile *> &cachedTiles);
+	void DecodeCached(const std::vector<TileIdentifier> &tileIdentifiers,
+		std::vector<DecodedTile> &tiles, std::vector<uint32> &staging);
+	void DecodeCachedIndexed(const std::vector<TileIdentifier> &tileIdentifiers,
+		std::vector<DecodedTile> &tiles, std::vector<uint8> &staging);
 	static uint32 numArchives[2];
 	static const char *typeNames[2];
-	char *dataPath;
+	std::string dataPath;
 	struct ArchiveFile {
 		uint32 offset;
 		char name[13];
@@ -28,8 +105,8 @@ private:
 	};
 	struct ArchiveHeader {
 		std::vector<ArchiveFile> files; };
-	uint32 ArchiveFileSize(std::ibinaryReader &in, ArchiveHeader &header, const char *fileName);
-	void ArchiveSeek(std::ibinaryReader &in, ArchiveHeader &header, const char *fileName);
+	uint32 ArchiveFileSize(MappedReader &in, ArchiveHeader &header, const char *fileName);
+	void ArchiveSeek(MappedReader &in, ArchiveHeader &header, const char *fileName);
 	struct GraphicsHeader { // The header for an EPF file
 		uint16 tileCount, // The number of tiles contained in this file
 			frameHeight, frameWidth, unknown; // Ignored values
@@ -44,24 +121,64 @@ private:
 	};
 	struct GraphicsTileInfo { // Information about a tile in an EPF file
 		uint16 left, top, right, bottom; // The dimensions of the tile
-		uint32 GetWidth() { return right - left; }
-		uint32 GetHeight() { return bottom - top; }
+		uint32 GetWidth() const { return right - left; }
+		uint32 GetHeight() const { return bottom - top; }
 		// Between these offsets lies the actual tile data!
 		uint32 startOffset, endOffset;
 	};
 	std::vector<GraphicsFile> graphicsFiles[2];
+	/* A prefix sum of the tile counts of the graphics archives: archiveBases[type][i] is the
+	 * index of the first tile in archive i, and the last element is numTiles[type]. Finding
+	 * the archive that holds a tile is a binary search over this table. */
+	std::vector<uint32> archiveBases[2];
+	// Find the GraphicsTileInfo for a tile, or return 0 if the tile doesn't exist
+	const GraphicsTileInfo *FindTileInfo(uint32 index, int tileType, uint32 &archiveIndex);
+	struct BatchRead; // A pending read in DecodeBatch, ordered by archive and offset
+	/* Look up a batch and sort its reads into file order, laying the tiles out in a staging
+	 * buffer as they'll be read. Returns the number of pixels that the staging buffer needs. */
+	uint32 PlanBatch(const std::vector<TileIdentifier> &tileIdentifiers,
+		std::vector<DecodedTile> &tiles, std::vector<BatchRead> &reads);
+	// Find the pixels of a planned read in its archive
+	const uint8 *GetPixels(const DecodedTile &tile, const BatchRead &read);
+	/* An archive that is mapped once in Init and kept mapped, along with its parsed header and
+	 * the absolute offset of the EPF file inside of it. Tile information and pixel data are
+	 * read straight out of the mapping. */
+	struct GraphicsArchive {
+		MappedFile file;
+		ArchiveHeader header;
+		uint32 epfOffset;
+		GraphicsHeader graphicsHeader;
+	};
+	std::vector<GraphicsArchive *> graphicsArchives[2];
+	// The number of threads that map graphics archives and read their headers in Init
+	static const uint32 MAX_HEADER_READERS = 8;
+	struct GraphicsHeaderRead { int tileType; uint32 index; }; // An archive for Init to read
+	void ReadGraphicsHeaders(); // Map every graphics archive and read its header, in parallel
+	void HeaderReader(const std::vector<GraphicsHeaderRead> *headerReads,
+		boost::atomic<uint32> *nextRead, std::vector<std::string> *errors);
+	MappedFile mainFile; // tile.dat, which holds the palettes
+	ArchiveHeader mainHeader;
 	typedef std::vector<uint8> PaletteTable;
-	struct Palette { wxColor data[256]; };
+	// Palettes are stored as packed RGBA32 lookup tables, ready to be fed to ExpandPalette
+	struct Palette { uint32 data[256]; };
 	typedef std::vector<Palette> PaletteSet;
 	PaletteTable paletteTables[2];
 	PaletteSet paletteSets[2];
+	/* The palettes and palette table of a tile type are read from tile.dat the first time that
+	 * the type is decoded. Decoding can happen on any thread, hence the lock. */
+	void RequirePalettes(int tileType);
+	// The lookup table of a tile's palette; the palettes of its type have to be loaded
+	inline const uint32 *GetPalette(TileIdentifier tileIdentifier) {
+		return paletteSets[tileIdentifier.second][paletteTables[tileIdentifier.second][tileIdentifier.first]].data; }
+	boost::atomic<bool> palettesLoaded[2];
+	boost::mutex paletteMutex;
 
-	friend std::ibinaryReader &operator >>(std::ibinaryReader &, ArchiveHeader &);
-	friend std::ibinaryReader &operator >>(std::ibinaryReader &, PaletteSet &);
-	friend std::ibinaryReader &operator >>(std::ibinaryReader &, PaletteTable &);
+	friend MappedReader &operator >>(MappedReader &, ArchiveHeader &);
+	friend MappedReader &operator >>(MappedReader &, PaletteSet &);
+	friend MappedReader &operator >>(MappedReader &, PaletteTable &);
 };
-std::ibinaryReader &operator >>(std::ibinaryReader &in, TileLoader::ArchiveHeader &header);
-std::ibinaryReader &operator >>(std::ibinaryReader &in, TileLoader::PaletteSet &set);
-std::ibinaryReader &operator >>(std::ibinaryReader &in, TileLoader::PaletteTable &table);
+MappedReader &operator >>(MappedReader &in, TileLoader::ArchiveHeader &header);
+MappedReader &operator >>(MappedReader &in, TileLoader::PaletteSet &set);
+MappedReader &operator >>(MappedReader &in, TileLoader::PaletteTable &table);
 
 extern TileLoader tileLoader;
\ No newline at end of file
@@ -1,124 +1,410 @@
 #include "stdwx.h"
+#include <wx/glcanvas.h>
 #include "TileManager.h"
 #include "TileLoader.h"
+#include "MapEditor.h"
+#include "PipelineStats.h"
+#include "PaletteExpander.h"
 #include <gl/gl.h>
+#include <cstring>
 #include <utility>
 #include <algorithm>
 #include <boost/bind.hpp>
-#if 0
-#include <boost/thread/thread.hpp>
-#include <boost/thread/condition.hpp>
-#include <boost/thread/mutex.hpp>
-#endif
 using namespace boost;
 using namespace std;
 TileManager tileManager;
 
 BEGIN_EVENT_TABLE(TileManager, wxEvtHandler)
-	EVT_TIMER(0, OnFlushNotify)
+	EVT_TIMER(1, OnUploadNotify)
 END_EVENT_TABLE()
 
+// What a graphic costs; the LRU list is threaded through the graphics, so it costs nothing more
+static const uint32 GRAPHIC_BYTES = sizeof(TileGraphic);
+
+void *TilePool::Allocate() {
+	if(freeList) {
+		FreeRecord *record = freeList;
+		freeList = record->next;
+		return record;
+	}
+	if(slabUsed == SLAB_SIZE) {
+		slabs.push_back(new char[SLAB_SIZE * recordSize]);
+		slabUsed = 0;
+	}
+	return slabs.back() + recordSize * slabUsed++;
+}
+void TilePool::Free(void *record) {
+	FreeRecord *freeRecord = (FreeRecord *)record;
+	freeRecord->next = freeList;
+	freeList = freeRecord;
+}
+void TilePool::DestroyAll() {
+	vector<char *> freed;
+	for(FreeRecord *record = freeList; record; record = record->next) freed.push_back((char *)record);
+	sort(freed.begin(), freed.end());
+	for(uint32 i = 0; i < slabs.size(); ++i) {
+		uint32 used = (i + 1 == slabs.size())?slabUsed:SLAB_SIZE;
+		for(uint32 j = 0; j < used; ++j) {
+			char *record = slabs[i] + recordSize * j;
+			if(binary_search(freed.begin(), freed.end(), record)) continue;
+			((TileGraphic *)record)->~TileGraphic();
+			Free(record);
+		}
+	}
+}
+TilePool::~TilePool() {
+	DestroyAll(); // Indexed graphics have pixels of their own to give back
+	for(vector<char *>::iterator i = slabs.begin(); i != slabs.end(); ++i) delete[] *i;
+}
+
+void *TileGraphic::operator new(size_t) { return tileManager.pool.Allocate(); }
+void TileGraphic::operator delete(void *record) { tileManager.pool.Free(record); }
 TileGraphic::~TileGraphic() {
-	if(texture)
-		glDeleteTextures(1, &texture);
-	tileManager.tiles[tileType].erase(internalHandle);
+	if(task) tileManager.asyncLoader.Cancel(task);
+	if(indices) {
+		if(slot.page != TextureAtlas::NO_PAGE) {
+			tileManager.UnlinkWorking(this);
+			tileManager.workingSetBytes -= GetTextureBytes();
+		}
+		tileManager.memoryBytes -= width * height;
+		delete[] indices;
+	} else tileManager.textureBytes -= GetTextureBytes();
+	tileManager.memoryBytes -= GRAPHIC_BYTES;
+	textureAtlas.Remove(slot);
+	tileManager.tiles[tileType][index] = 0;
+	--tileManager.resident;
 }
+// NOTE: The caller should unbind the atlas with TextureAtlas::Unbind when it's done drawing
 void TileGraphic::Render(int x, int y) {
-	glBindTexture(GL_TEXTURE_2D, texture);
+	if(!IsLoaded()) {
+		// Draw a flat placeholder while the tile is still being decoded
+		glPushAttrib(GL_CURRENT_BIT | GL_ENABLE_BIT);
+		glDisable(GL_TEXTURE_2D);
+		glColor3f(0.15f, 0.15f, 0.15f);
+		glBegin(GL_QUADS);
+			glVertex2i(0 + x, 0 + y); glVertex2i(48 + x, 0 + y);
+			glVertex2i(48 + x, 48 + y); glVertex2i(0 + x, 48 + y);
+		glEnd();
+		glPopAttrib();
+		return;
+	}
+	textureAtlas.Bind(GetSlot().page);
 	glBegin(GL_QUADS);
-		glTexCoord2f(0, 0); glVertex2i(0 + x, 0 + y);
-		glTexCoord2f(1, 0); glVertex2i(48 + x, 0 + y);
-		glTexCoord2f(1, 1); glVertex2i(48 + x, 48 + y);
-		glTexCoord2f(0, 1); glVertex2i(0 + x, 48 + y);
+		glTexCoord2f(slot.left, slot.top); glVertex2i(0 + x, 0 + y);
+		glTexCoord2f(slot.right, slot.top); glVertex2i(48 + x, 0 + y);
+		glTexCoord2f(slot.right, slot.bottom); glVertex2i(48 + x, 48 + y);
+		glTexCoord2f(slot.left, slot.bottom); glVertex2i(0 + x, 48 + y);
 	glEnd();
-	glBindTexture(GL_TEXTURE_2D, 0);
+}
+void TileManager::PushReleased(TileGraphic *tileGraphic) {
+	TileGraphic *head = released.load(boost::memory_order_relaxed);
+	do tileGraphic->releasedNext = head;
+	while(!released.compare_exchange_weak(head, tileGraphic,
+		boost::memory_order_release, boost::memory_order_relaxed));
+}
+void TileManager::CollectReleasedSlow() {
+	TileGraphic *list = released.exchange(0, boost::memory_order_acquire);
+	while(list) {
+		TileGraphic *tileGraphic = list;
+		list = list->releasedNext; // Once the mark is off, another release may push it again
+		uint32 refcount = tileGraphic->refcount.load(boost::memory_order_relaxed);
+		while(!tileGraphic->refcount.compare_exchange_weak(refcount, refcount & ~TileGraphic::RELEASED,
+			boost::memory_order_acq_rel, boost::memory_order_relaxed));
+		// If the graphic was requested again in the meantime, its new handles will release it
+		if(refcount == TileGraphic::RELEASED) Release(tileGraphic);
+	}
+	Trim();
+}
+void TileManager::Shutdown() {
+	uploadTimer.Stop();
+	asyncLoader.Stop();
+	pool.DestroyAll();
+	released = 0;
+	lruHead = lruTail = 0;
+	lruCount = 0;
+	textureAtlas.Abandon();
+	UpdateGauges();
+}
+void TileManager::Release(TileGraphic *tileGraphic) {
+	if(!tileGraphic->IsLoaded()) {
+		// Nobody is waiting on the decode anymore; cancel it rather than keep it around
+		delete tileGraphic;
+		return;
+	}
+	LinkIdle(tileGraphic);
+}
+void TileManager::LinkIdle(TileGraphic *tileGraphic) {
+	tileGraphic->lruPrevious = 0;
+	tileGraphic->lruNext = lruHead;
+	if(lruHead) lruHead->lruPrevious = tileGraphic;
+	else lruTail = tileGraphic;
+	lruHead = tileGraphic;
+	tileGraphic->idle = true;
+	++lruCount;
+}
+void TileManager::UnlinkIdle(TileGraphic *tileGraphic) {
+	if(tileGraphic->lruPrevious) tileGraphic->lruPrevious->lruNext = tileGraphic->lruNext;
+	else lruHead = tileGraphic->lruNext;
+	if(tileGraphic->lruNext) tileGraphic->lruNext->lruPrevious = tileGraphic->lruPrevious;
+	else lruTail = tileGraphic->lruPrevious;
+	tileGraphic->lruPrevious = tileGraphic->lruNext = 0;
+	tileGraphic->idle = false;
+	--lruCount;
+}
+void TileManager::Evict(TileGraphic *tileGraphic) {
+	UnlinkIdle(tileGraphic);
+	delete tileGraphic;
+}
+void TileManager::Trim() {
+	while(lruTail && (textureBytes > textureBudget || memoryBytes > memoryBudget)) {
+		Evict(lruTail);
+		++evictions;
+		STATS_COUNT_GL(CACHE_EVICTIONS, 1);
+	}
+	UpdateGauges();
+}
+void TileManager::UpdateGauges() {
+	STATS_GAUGE(RESIDENT_TILES, resident);
+	STATS_GAUGE(IDLE_TILES, lruCount);
+	STATS_GAUGE(TEXTURE_BYTES, textureBytes);
+	STATS_GAUGE(MEMORY_BYTES, memoryBytes);
+	STATS_GAUGE(WORKING_SET_BYTES, workingSetBytes);
+}
+void TileManager::LoadIndexed(const vector<TileIdentifier> &tileIdentifiers,
+	const vector<TileGraphic *> &tileGraphics) {
+	vector<TileLoader::DecodedTile> decoded;
+	tileLoader.DecodeIndexedBatch(tileIdentifiers, decoded, indexedStaging);
+	for(uint32 i = 0; i < decoded.size(); ++i) {
+		const TileLoader::DecodedTile &tile = decoded[i];
+		StoreIndexed(tileGraphics[i], tile.width, tile.height,
+			(tile.width * tile.height)?&indexedStaging[tile.offset]:0, tile.palette);
+	}
+}
+void TileManager::StoreIndexed(TileGraphic *tileGraphic, uint32 width, uint32 height,
+	const uint8 *indices, const uint32 *palette) {
+	tileGraphic->width = width;
+	tileGraphic->height = height;
+	if(!indices) return; // There's nothing to draw, so the tile is drawn like an empty RGBA one
+	tileGraphic->indices = new uint8[width * height];
+	memcpy(tileGraphic->indices, indices, width * height);
+	tileGraphic->palette = palette;
+	memoryBytes += width * height;
+}
+void TileManager::RequireSlot(TileGraphic *tileGraphic) {
+	tileGraphic->drawnFrame = frame;
+	if(tileGraphic->slot.page != TextureAtlas::NO_PAGE) {
+		// Keep the working set in the order that the tiles were drawn
+		if(tileGraphic != workingHead) {
+			UnlinkWorking(tileGraphic);
+			LinkWorking(tileGraphic);
+		}
+		return;
+	}
+	uint32 pixelCount = tileGraphic->width * tileGraphic->height;
+	expansion.resize(pixelCount);
+	{
+		STATS_TIME(PALETTE_EXPANSION);
+		ExpandPalette(tileGraphic->indices, &expansion[0], pixelCount, tileGraphic->palette);
+	}
+	STATS_COUNT(BYTES_DECODED, pixelCount * 4);
+	tileGraphic->slot = textureAtlas.Insert(&expansion[0], tileGraphic->width, tileGraphic->height);
+	workingSetBytes += tileGraphic->GetTextureBytes();
+	LinkWorking(tileGraphic);
+	TrimWorkingSet();
+}
+void TileManager::TrimWorkingSet() {
+	while(workingTail && workingSetBytes > workingSetBudget && workingTail->drawnFrame != frame) {
+		TileGraphic *tileGraphic = workingTail;
+		UnlinkWorking(tileGraphic);
+		workingSetBytes -= tileGraphic->GetTextureBytes();
+		textureAtlas.Remove(tileGraphic->slot);
+		tileGraphic->slot = TextureAtlas::Slot();
+	}
+	STATS_GAUGE(WORKING_SET_BYTES, workingSetBytes);
+}
+void TileManager::LinkWorking(TileGraphic *tileGraphic) {
+	tileGraphic->workingPrevious = 0;
+	tileGraphic->workingNext = workingHead;
+	if(workingHead) workingHead->workingPrevious = tileGraphic;
+	else workingTail = tileGraphic;
+	workingHead = tileGraphic;
+}
+void TileManager::UnlinkWorking(TileGraphic *tileGraphic) {
+	if(tileGraphic->workingPrevious) tileGraphic->workingPrevious->workingNext = tileGraphic->workingNext;
+	else workingHead = tileGraphic->workingNext;
+	if(tileGraphic->workingNext) tileGraphic->workingNext->workingPrevious = tileGraphic->workingPrevious;
+	else workingTail = tileGraphic->workingPrevious;
+	tileGraphic->workingPrevious = tileGraphic->workingNext = 0;
 }
 void TileManager::Flush() {
-	while(deletionQueue.size() > 0) {
-		TileGraphic *tileGraphic = deletionQueue.back();
-		if(tileGraphic->refcount <= 0)
-			delete tileGraphic;
-		deletionQueue.pop_back();
+	CollectReleased();
+	while(lruTail) Evict(lruTail);
+	UpdateGauges();
+}
+void TileManager::SetBudget(uint32 textureBytes_, uint32 memoryBytes_) {
+	textureBudget = textureBytes_;
+	memoryBudget = memoryBytes_;
+	CollectReleased();
+	Trim();
+}
+void TileManager::SetWorkingSetBudget(uint32 bytes) {
+	workingSetBudget = bytes;
+	TrimWorkingSet();
+}
+TileManager::Stats TileManager::GetStats() {
+	CollectReleased();
+	Stats stats;
+	stats.hits = hits;
+	stats.misses = misses;
+	stats.evictions = evictions;
+	stats.resident = resident;
+	stats.unreferenced = lruCount;
+	stats.textureBytes = textureBytes;
+	stats.memoryBytes = memoryBytes;
+	stats.workingSetBytes = workingSetBytes;
+	stats.slabs = pool.GetSlabCount();
+	return stats;
+}
+TileGraphic *TileManager::Register(uint32 index, int tileType, bool &created) {
+	CollectReleased();
+	vector<TileGraphic *> &table = tiles[tileType];
+	if(index >= table.size()) table.resize(max(index + 1, TileLoader::numTiles[tileType]), 0);
+	TileGraphic *tileGraphic = table[index];
+	created = (tileGraphic == 0);
+	if(!created) {
+		++hits;
+		STATS_COUNT_GL(CACHE_HITS, 1);
+		// The tile is about to be referenced again, so it can't be evicted anymore
+		if(tileGraphic->idle) UnlinkIdle(tileGraphic);
+		return tileGraphic;
 	}
+	++misses;
+	STATS_COUNT_GL(CACHE_MISSES, 1);
+	tileGraphic = table[index] = new TileGraphic(index, tileType);
+	++resident;
+	memoryBytes += GRAPHIC_BYTES;
+	return tileGraphic;
 }
 TileHandle TileManager::Request(uint32 index, int tileType) {
-	InternalHandle internalHandle = tiles[tileType].find(index);
-	TileGraphic *tileGraphic;
-	if(internalHandle == tiles[tileType].end()) {
-		tileGraphic = new TileGraphic(index, tileType);
-		tileGraphic->internalHandle = tiles[tileType].insert(make_pair(index, tileGraphic)).first;
-		tileGraphic->texture = tileLoader.Load(make_pair(index, tileType),
-			tileGraphic->width, tileGraphic->height);
-	} else tileGraphic = internalHandle->second;
+	bool created;
+	TileGraphic *tileGraphic = Register(index, tileType, created);
+	if(created || !tileGraphic->IsLoaded()) {
+		// Rather than wait on a pending decode, cancel it and load the tile right away
+		if(tileGraphic->task) asyncLoader.Cancel(tileGraphic->task);
+		tileGraphic->task = 0;
+		if(residency == RESIDENCY_INDEXED) {
+			LoadIndexed(vector<TileIdentifier>(1, make_pair(index, tileType)),
+				vector<TileGraphic *>(1, tileGraphic));
+		} else {
+			tileGraphic->slot = tileLoader.Load(make_pair(index, tileType),
+				tileGraphic->width, tileGraphic->height);
+			textureBytes += tileGraphic->GetTextureBytes();
+		}
+		Trim();
+	}
 	return TileHandle(tileGraphic);
 }
-TileManager::~TileManager() {
-	for(int i = 0; i < 2; ++i) {
-		while(tiles[i].size() != 0)
-			delete tiles[i].begin()->second;
+void TileManager::RequestBatch(const vector<TileIdentifier> &tileIdentifiers,
+	vector<TileHandle> &handles) {
+	handles.resize(tileIdentifiers.size());
+	vector<TileIdentifier> missing;
+	vector<TileGraphic *> created;
+	for(uint32 i = 0; i < tileIdentifiers.size(); ++i) {
+		// Register the graphic now so that duplicates in the batch are only loaded once
+		bool isNew;
+		TileGraphic *tileGraphic = Register(tileIdentifiers[i].first, tileIdentifiers[i].second, isNew);
+		if(isNew || tileGraphic->task) {
+			if(tileGraphic->task) asyncLoader.Cancel(tileGraphic->task);
+			tileGraphic->task = 0;
+			missing.push_back(tileIdentifiers[i]);
+			created.push_back(tileGraphic);
+		}
+		handles[i] = TileHandle(tileGraphic);
+	}
+	if(missing.empty()) return;
+	if(residency == RESIDENCY_INDEXED) {
+		LoadIndexed(missing, created);
+		Trim();
+		return;
+	}
+	vector<TextureAtlas::Slot> slots;
+	vector<TileLoader::TileMetrics> metrics;
+	tileLoader.LoadBatch(missing, slots, metrics);
+	for(uint32 i = 0; i < created.size(); ++i) {
+		created[i]->slot = slots[i];
+		created[i]->width = metrics[i].width;
+		created[i]->height = metrics[i].height;
+		textureBytes += created[i]->GetTextureBytes();
 	}
+	Trim();
 }
-
-#if 0
-// Abandoned code for an asynchronous loading component
-typedef std::pair<uint32, int> TileIdentifier;
-class TileManager::AsyncLoader {
-public:
-	AsyncLoader(TileManager *tileManager);
-	~AsyncLoader();
-	void Load(TileIdentifier tileIdentifier);
-private:
-	void LoadingThread();
-	thread loadingThread;
-	TileManager *tileManager;
-	condition pendingEvents;
-	mutex pendingLoadsMutex;
-	deque<TileIdentifier> pendingLoads;
-	mutex killMutex;
-	bool kill;
-};
-TileManager::AsyncLoader::AsyncLoader(TileManager *tileManager_) :
-	kill(false), tileManager(tileManager_),
-	loadingThread(bind(&TileManager::AsyncLoader::LoadingThread, this)) { }
-void TileManager::AsyncLoader::Load(TileIdentifier tileIdentifier) {
-	{
-		mutex::scoped_lock lock(pendingLoadsMutex);
-		pendingLoads.push_back(tileIdentifier);
+TileHandle TileManager::RequestAsync(uint32 index, int tileType, int priority) {
+	bool created;
+	TileGraphic *tileGraphic = Register(index, tileType, created);
+	if(created) tileGraphic->task = asyncLoader.Queue(make_pair(index, tileType), tileGraphic, priority,
+		residency == RESIDENCY_INDEXED);
+	else if(tileGraphic->task) asyncLoader.Promote(tileGraphic->task, priority);
+	UpdateGauges();
+	return TileHandle(tileGraphic);
+}
+void TileManager::RequestBatchAsync(const vector<TileIdentifier> &tileIdentifiers,
+	vector<TileHandle> &handles, int priority) {
+	handles.resize(tileIdentifiers.size());
+	vector<TileIdentifier> missing;
+	vector<TileGraphic *> created;
+	for(uint32 i = 0; i < tileIdentifiers.size(); ++i) {
+		bool isNew;
+		TileGraphic *tileGraphic = Register(tileIdentifiers[i].first, tileIdentifiers[i].second, isNew);
+		if(isNew) {
+			missing.push_back(tileIdentifiers[i]);
+			created.push_back(tileGraphic);
+		} else if(tileGraphic->task) asyncLoader.Promote(tileGraphic->task, priority);
+		handles[i] = TileHandle(tileGraphic);
 	}
+	// The new tiles go to a worker together, so that they're read in file order
+	vector<AsyncLoader::Task *> tasks;
+	asyncLoader.QueueBatch(missing, created, priority, residency == RESIDENCY_INDEXED, tasks);
+	for(uint32 i = 0; i < created.size(); ++i) created[i]->task = tasks[i];
+	UpdateGauges();
 }
-TileManager::AsyncLoader::~AsyncLoader() {
-	{
-		// Kill the loading thread
-		mutex::scoped_lock lock(killMutex);
-		kill = true;
-		pendingEvents.notify_all();
-	}
-	loadingThread.join();
-}
-void TileManager::AsyncLoader::LoadingThread() {
-	while(true) {
-		{
-			// See if we should terminate the thread
-			mutex::scoped_lock lock(killMutex);
-			if(kill) return;
-		}
-		TileIdentifier loadingTile;
-		{
-			// Get a tile to load from the deque
-			mutex::scoped_lock lock(pendingLoadsMutex);
-			if(pendingLoads.size() == 0)
-				pendingEvents.wait(lock);
-			{
-				// We may have been awakened to exit the thread
-				mutex::scoped_lock lock(killMutex);
-				if(kill) return;
-			}
-			loadingTile = pendingLoads.front();
-			pendingLoads.pop_front();
+uint32 TileManager::UploadCompleted(int budget) {
+	++frame;
+	if(!asyncLoader.HasCompleted()) return 0;
+	wxStopWatch stopWatch;
+	if(mainContext) mainContext->SetCurrent();
+	uint32 count = 0;
+	AsyncLoader::Task *task;
+	while(stopWatch.Time() < budget && (task = asyncLoader.PopCompleted())) {
+		TileGraphic *tileGraphic = task->tileGraphic;
+		if(task->indexed) {
+			// Nothing to upload until the tile is drawn
+			StoreIndexed(tileGraphic, task->width, task->height,
+				task->indices.empty()?0:&task->indices[0], task->palette);
+		} else {
+			tileGraphic->width = task->width;
+			tileGraphic->height = task->height;
+			if(task->width * task->height != 0)
+				tileGraphic->slot = textureAtlas.Insert(&task->pixels[0], task->width, task->height);
+			textureBytes += tileGraphic->GetTextureBytes();
 		}
-		int width, height;
-		GLuint texture;
-		texture = tileLoader.Load(loadingTile, width, height);
+		tileGraphic->task = 0;
+		delete task;
+		++count;
 	}
+	Trim();
+	return count;
 }
-#endif
\ No newline at end of file
+void TileManager::OnUploadNotify(wxTimerEvent &) {
+	// Handles dropped on other threads are picked up here, even while nothing is being requested
+	CollectReleased();
+	STATS_GAUGE(PENDING_DECODES, asyncLoader.GetPendingCount()); // This takes a lock, so not too often
+	// The listeners upload the tiles themselves when they draw their next frame
+	if(!asyncLoader.HasCompleted()) return;
+	for(vector<wxWindow *>::iterator i = listeners.begin(); i != listeners.end(); ++i)
+		(*i)->Refresh(false);
+}
+void TileManager::AddListener(wxWindow *window) { listeners.push_back(window); }
+void TileManager::RemoveListener(wxWindow *window) {
+	listeners.erase(remove(listeners.begin(), listeners.end(), window), listeners.end());
+}
+
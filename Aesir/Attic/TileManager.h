@@ -1,9 +1,11 @@
 #pragma once
-typedef unsigned int GLuint;
-#include <map>
 #include <utility>
 #include <vector>
+#include <algorithm>
 #include <wx/timer.h>
+#include <boost/atomic.hpp>
+#include "TextureAtlas.h"
+#include "AsyncLoader.h"
 #define TypeTile 0
 #define TypeObject 1
 
@@ -13,70 +15,265 @@ class TileGraphic {
 public:
 	uint32 index;
 	int tileType; // The type of the tile (Either TypeTile or TypeObject)
-	GLuint texture; // The GL texture
+	TextureAtlas::Slot slot; // Where the tile lives in the texture atlas
 	uint32 width, height; // The dimensions of the tile
-	~TileGraphic(); // Destructor frees the GL texture and unregisters the graphic
+	~TileGraphic(); // Destructor frees the atlas slot and unregisters the graphic
+	// Whether the tile has been decoded and uploaded; until then, Render draws a placeholder
+	inline bool IsLoaded() const { return (task == 0); }
+	/* Whether the tile is kept as palette indices; it only has a slot in the atlas while it's in
+	 * the manager's working set */
+	inline bool IsIndexed() const { return (indices != 0); }
+	// The atlas memory that the tile takes up; a slot is the same size no matter the tile
+	inline uint32 GetTextureBytes() const {
+		return (slot.page == TextureAtlas::NO_PAGE)?0:TextureAtlas::SLOT_SIZE * TextureAtlas::SLOT_SIZE * 4; }
+	/* The slot to draw the tile from. An indexed tile is expanded into the working set first, so
+	 * only ask for this when the tile is about to be drawn. */
+	inline const TextureAtlas::Slot &GetSlot();
+	// Draw the tile right away; SpriteBatch draws many tiles much faster
 	void Render(int x, int y);
 private:
-	typedef std::map<uint32, TileGraphic *>::iterator InternalHandle;
-	InternalHandle internalHandle;
+	// Graphics come out of TileManager's pool rather than off the heap
+	static void *operator new(size_t size);
+	static void operator delete(void *record);
+	// The neighbours of the tile in the LRU list, while nothing refers to it
+	TileGraphic *lruPrevious, *lruNext;
+	bool idle; // Whether the tile is in the LRU list
 	inline TileGraphic(uint32 index_, int tileType_) :
-		index(index_), tileType(tileType_), refcount(0) { }
+		index(index_), tileType(tileType_), width(0), height(0), lruPrevious(0), lruNext(0),
+		idle(false), indices(0), palette(0), workingPrevious(0), workingNext(0), drawnFrame(0),
+		releasedNext(0), task(0), refcount(0) { }
+	uint8 *indices; // The pixels of an indexed tile, or 0 if the tile was expanded when it loaded
+	const uint32 *palette; // The palette that the indices go through; this belongs to TileLoader
+	// The neighbours of an indexed tile in the working set, while it has a slot
+	TileGraphic *workingPrevious, *workingNext;
+	uint32 drawnFrame; // The last frame that an indexed tile was drawn in
+	TileGraphic *releasedNext; // The next graphic on TileManager's released stack
+	AsyncLoader::Task *task; // The pending decode of the tile, or 0 once it has been uploaded
 	friend class TileManager; // For access to ctor
 	friend class TileHandle; // For access to the refcount
-	uint32 refcount; // For refcounted resource management via TileHandle
+	/* Set in the refcount from the moment the last handle goes away until the manager has taken
+	 * the graphic off its released stack, so that the graphic is only ever on the stack once */
+	static const uint32 RELEASED = 0x80000000;
+	boost::atomic<uint32> refcount; // For refcounted resource management via TileHandle
 };
-// A handle to a tile...
+/* A counted reference to a tile. Handles can be copied, moved and dropped on any thread, and
+ * dropping the last one hands the tile back to the manager without taking a lock. Only the GL
+ * thread may draw the tile or request new ones, though. */
 class TileHandle {
 public:
-	// TODO: I probably should throw some asserts in here...
-	inline TileHandle(const TileHandle &copy) {
-		tileGraphic = copy.tileGraphic;
-		if(tileGraphic) ++tileGraphic->refcount;
-	}
+	inline TileHandle(const TileHandle &copy) : tileGraphic(copy.tileGraphic) { Acquire(); }
 	inline TileHandle &operator =(const TileHandle &assign) {
-		TileHandle::~TileHandle();
-		tileGraphic = assign.tileGraphic;
-		if(tileGraphic) ++tileGraphic->refcount;
+		// Copy first, so that assigning a handle to itself can't release it
+		TileHandle copy(assign);
+		swap(copy);
+		return *this;
+	}
+#ifndef BOOST_NO_CXX11_RVALUE_REFERENCES
+	// Moving a handle leaves the refcount alone, and leaves the source empty
+	inline TileHandle(TileHandle &&move) : tileGraphic(move.tileGraphic) { move.tileGraphic = 0; }
+	inline TileHandle &operator =(TileHandle &&move) {
+		swap(move); // The source releases what this handle referred to when it goes away
 		return *this;
 	}
+#endif
+	inline void swap(TileHandle &other) { std::swap(tileGraphic, other.tileGraphic); }
+	// Drop the reference, leaving an empty handle
+	inline void Reset() {
+		Release();
+		tileGraphic = 0;
+	}
 	inline TileHandle() : tileGraphic(0) { }
 	inline operator bool() { return (tileGraphic != 0); }
+	inline bool IsLoaded() { return tileGraphic && tileGraphic->IsLoaded(); }
 	inline TileGraphic &operator *() { return *tileGraphic; }
 	inline TileGraphic *operator ->() { return tileGraphic; }
 	inline operator TileGraphic *() { return tileGraphic; }
-	inline ~TileHandle();
+	inline ~TileHandle() { Release(); }
 private:
-	inline TileHandle(TileGraphic *tileGraphic_) :
-		tileGraphic(tileGraphic_) {
-			if(tileGraphic) ++tileGraphic->refcount; }
+	inline TileHandle(TileGraphic *tileGraphic_) : tileGraphic(tileGraphic_) { Acquire(); }
+	inline void Acquire() {
+		if(tileGraphic) tileGraphic->refcount.fetch_add(1, boost::memory_order_relaxed); }
+	inline void Release();
 	TileGraphic *tileGraphic;
 	friend class TileManager; // For access to ctor
 };
+/* Hands out records for graphics from slabs of SLAB_SIZE, so that registering a tile while
+ * scrolling doesn't go to the heap once the pool has grown to the working set. Freed records are
+ * reused before a new slab is made; slabs are only given back when the pool is destroyed, and
+ * any graphics still in them are destroyed first. */
+class TilePool {
+public:
+	static const uint32 SLAB_SIZE = 256;
+	void *Allocate();
+	void Free(void *record);
+	void DestroyAll(); // Destroy every graphic that hasn't been freed
+	inline uint32 GetSlabCount() const { return slabs.size(); }
+	~TilePool();
+	inline TilePool() : recordSize(sizeof(TileGraphic)), freeList(0), slabUsed(SLAB_SIZE) { }
+private:
+	struct FreeRecord { FreeRecord *next; };
+	size_t recordSize;
+	FreeRecord *freeList;
+	std::vector<char *> slabs;
+	uint32 slabUsed; // The number of records handed out of the newest slab
+};
 // Manages tiles! Duh!
+/* Tiles that nothing refers to anymore stay resident, so that scrolling back to them costs
+ * nothing, until the memory they use goes over budget; then the least recently released ones are
+ * destroyed first. Tiles that are still referenced are never evicted, so the budget can be
+ * overrun by what's actually on screen. */
 class TileManager : public wxEvtHandler {
 public:
-	// Every FLUSH_INTERVAL milliseconds, Flush() will be called
-	static const int FLUSH_INTERVAL = 1500;
+	// The default budgets, in bytes, for atlas memory and for the graphics themselves
+	static const uint32 DEFAULT_TEXTURE_BUDGET = 64 * 1024 * 1024;
+	static const uint32 DEFAULT_MEMORY_BUDGET = 4 * 1024 * 1024;
+	// How tiles are kept while they're resident
+	enum Residency {
+		RESIDENCY_RGBA, // Expanded into the atlas as soon as they're loaded
+		/* As 8-bit palette indices, which are a quarter of the size, or less for objects, whose
+		 * pixels are trimmed while their slot isn't. Indexed tiles are expanded into the atlas as
+		 * they're drawn, and only a working set of the most recently drawn ones keeps a slot. */
+		RESIDENCY_INDEXED
+	};
+	// The default budget for the atlas slots of indexed tiles, a few screens' worth
+	static const uint32 DEFAULT_WORKING_SET_BUDGET = 16 * 1024 * 1024;
+	// A memory budget that fits the whole of a tile set as indices
+	static const uint32 INDEXED_MEMORY_BUDGET = 256 * 1024 * 1024;
+	// Every UPLOAD_INTERVAL milliseconds, the listeners are refreshed if tiles finished decoding
+	static const int UPLOAD_INTERVAL = 15;
+	// The number of milliseconds that UploadCompleted may spend uploading, per frame
+	static const int UPLOAD_BUDGET = 4;
+	// Priorities for asynchronous requests; lower values are decoded first
+	static const int PRIORITY_VISIBLE = 0;
+	static const int PRIORITY_PREFETCH = 100;
 	// Request a tile; if the tile is not loaded, load the tile
 	TileHandle Request(uint32 index, int tileType);
-	void Flush(); // Empty the deletionQueue, destroying everything
-	~TileManager();
-	inline TileManager() : flushTimer(this, 0) {
-		flushTimer.Start(FLUSH_INTERVAL); }
+	/* Request many tiles at once; handles[i] refers to tileIdentifiers[i]. Every tile that
+	 * isn't loaded yet is loaded in a single batch by TileLoader::LoadBatch. */
+	void RequestBatch(const std::vector<std::pair<uint32, int> > &tileIdentifiers,
+		std::vector<TileHandle> &handles);
+	/* Request a tile without waiting for it. The tile is decoded in the background and the
+	 * handle draws a placeholder until then; requesting a pending tile again at a lower
+	 * priority value promotes it. A pending tile whose last handle goes away is cancelled. */
+	TileHandle RequestAsync(uint32 index, int tileType, int priority = PRIORITY_VISIBLE);
+	/* Request many tiles without waiting for them; handles[i] refers to tileIdentifiers[i]. The
+	 * tiles that are new are decoded together, as one batch, and each can still be promoted or
+	 * cancelled on its own. */
+	void RequestBatchAsync(const std::vector<std::pair<uint32, int> > &tileIdentifiers,
+		std::vector<TileHandle> &handles, int priority = PRIORITY_VISIBLE);
+	/* Upload tiles that have finished decoding, until budget milliseconds have passed. This has
+	 * to be called from the GL thread at the start of every frame, before it makes its own
+	 * context current; indexed tiles drawn since the last call keep their slots in the working
+	 * set. Returns the number of tiles that were completed. */
+	uint32 UploadCompleted(int budget = UPLOAD_BUDGET);
+	// Windows that get refreshed when tiles have finished decoding, so that they can upload them
+	void AddListener(wxWindow *window);
+	void RemoveListener(wxWindow *window);
+	// Set the residency budgets, evicting unreferenced tiles right away if they're now over
+	void SetBudget(uint32 textureBytes, uint32 memoryBytes);
+	/* Choose how the tiles that are loaded from now on are kept. Tiles that are already resident
+	 * stay the way that they were loaded; Flush first to load them again. The indices count
+	 * against the memory budget, and the working set only against its own budget. */
+	inline void SetResidency(Residency residency_) { residency = residency_; }
+	inline Residency GetResidency() const { return residency; }
+	/* Set the budget for the atlas slots of indexed tiles. Tiles drawn in the current frame keep
+	 * their slots regardless, so a screen full of tiles can overrun it. */
+	void SetWorkingSetBudget(uint32 bytes);
+	void Flush(); // Destroy every tile that nothing refers to, regardless of the budget
+	/* Stop decoding, destroy every tile and abandon the atlas, before the globals that the
+	 * workers use are destroyed and once the GL contexts are gone. No handle may be left, and
+	 * no tile may be requested afterwards. */
+	void Shutdown();
+	struct Stats {
+		uint32 hits, misses; // Requests that found the tile registered already, and those that didn't
+		uint32 evictions; // Unreferenced tiles destroyed to get back under budget
+		uint32 resident, unreferenced; // The number of registered tiles, and how many of them are idle
+		uint32 textureBytes, memoryBytes;
+		uint32 workingSetBytes; // The atlas slots that indexed tiles are drawn from
+		uint32 slabs; // The number of slabs that the graphics are allocated from
+	};
+	Stats GetStats();
+	inline void ResetCounters() { hits = misses = evictions = 0; }
+	inline TileManager() : uploadTimer(this, 1), resident(0), released(0), lruHead(0), lruTail(0), lruCount(0), textureBudget(DEFAULT_TEXTURE_BUDGET),
+		memoryBudget(DEFAULT_MEMORY_BUDGET), textureBytes(0), memoryBytes(0),
+		hits(0), misses(0), evictions(0), residency(RESIDENCY_RGBA), workingHead(0), workingTail(0),
+		workingSetBudget(DEFAULT_WORKING_SET_BUDGET), workingSetBytes(0), frame(0) {
+		uploadTimer.Start(UPLOAD_INTERVAL);
+	}
 private:
-	inline void OnFlushNotify(wxTimerEvent &) { Flush(); }
-	wxTimer flushTimer;
-	typedef std::map<uint32, TileGraphic *>::iterator InternalHandle;
-	std::map<uint32, TileGraphic *> tiles[2];
-	typedef std::vector<TileGraphic *> DeletionQueue;
-	DeletionQueue deletionQueue;
-	friend class TileGraphic; // For access to the tiles map
-	friend class TileHandle; // For access to the deletion queue
+	void OnUploadNotify(wxTimerEvent &);
+	wxTimer uploadTimer;
+	AsyncLoader asyncLoader;
+	std::vector<wxWindow *> listeners;
+	// Find a registered graphic, or register a new one; created is set if it's new
+	TileGraphic *Register(uint32 index, int tileType, bool &created);
+	/* The registered graphics of each type, indexed by tile index, or 0 where a tile isn't
+	 * registered. The tables are sized to TileLoader::numTiles as soon as they're first used. */
+	std::vector<TileGraphic *> tiles[2];
+	uint32 resident; // The number of registered graphics
+	// Push a graphic whose last handle went away onto the released stack; this is lock free
+	void PushReleased(TileGraphic *tileGraphic);
+	/* Take everything off the released stack, keeping the graphics that are still unreferenced in
+	 * the LRU list. This is done on the GL thread before anything looks at the LRU list. */
+	inline void CollectReleased() {
+		if(released.load(boost::memory_order_relaxed)) CollectReleasedSlow(); }
+	void CollectReleasedSlow();
+	void Release(TileGraphic *tileGraphic);
+	boost::atomic<TileGraphic *> released;
+	// Evict the least recently released tiles until the memory in use is back under budget
+	void Trim();
+	void Evict(TileGraphic *tileGraphic);
+	void UpdateGauges(); // Publish the tile counts and memory use to pipelineStats
+	void LinkIdle(TileGraphic *tileGraphic);
+	void UnlinkIdle(TileGraphic *tileGraphic);
+	// Unreferenced tiles, from the most recently released at the head to the least at the tail
+	TileGraphic *lruHead, *lruTail;
+	uint32 lruCount;
+	uint32 textureBudget, memoryBudget;
+	uint32 textureBytes, memoryBytes;
+	uint32 hits, misses, evictions;
+	Residency residency;
+	// Load tiles as indices; tileGraphics[i] gets the pixels of tileIdentifiers[i]
+	void LoadIndexed(const std::vector<TileIdentifier> &tileIdentifiers,
+		const std::vector<TileGraphic *> &tileGraphics);
+	// Keep the indices of a tile; they're copied, and may be 0 if the tile is empty
+	void StoreIndexed(TileGraphic *tileGraphic, uint32 width, uint32 height,
+		const uint8 *indices, const uint32 *palette);
+	/* Mark an indexed tile as drawn in this frame, first expanding it into the atlas if it isn't
+	 * in the working set */
+	void RequireSlot(TileGraphic *tileGraphic);
+	// Take slots away from the least recently drawn indexed tiles until the working set fits
+	void TrimWorkingSet();
+	void LinkWorking(TileGraphic *tileGraphic);
+	void UnlinkWorking(TileGraphic *tileGraphic);
+	// Indexed tiles with a slot, from the most recently drawn at the head to the least at the tail
+	TileGraphic *workingHead, *workingTail;
+	uint32 workingSetBudget, workingSetBytes;
+	uint32 frame; // The number of frames begun, as counted by UploadCompleted
+	std::vector<uint32> expansion; // Where an indexed tile is expanded on its way to the atlas
+	std::vector<uint8> indexedStaging; // Where LoadIndexed decodes to
+	/* Declared last, so that it's destroyed first: the graphics that are left when the manager
+	 * goes away are destroyed along with the pool, and they need the rest of the manager */
+	TilePool pool;
+	friend class TileGraphic; // For access to the tables, the pool and the memory counts
+	friend class TileHandle; // For access to PushReleased
 	DECLARE_EVENT_TABLE()
 };
 extern TileManager tileManager;
-TileHandle::~TileHandle() {
-	if(tileGraphic && --tileGraphic->refcount <= 0)
-		tileManager.deletionQueue.push_back(tileGraphic);
+const TextureAtlas::Slot &TileGraphic::GetSlot() {
+	if(indices) tileManager.RequireSlot(this);
+	return slot;
+}
+void TileHandle::Release() {
+	if(!tileGraphic) return;
+	/* Drop the reference and mark the graphic as released in the same step; otherwise the
+	 * manager could take the graphic back and free it before it's marked. The mark may still be
+	 * there from an earlier release if the graphic was requested again before the manager took
+	 * it off the stack; it's still on the stack then, and the manager clears the mark when it
+	 * does take it off, so it's only pushed by the release that sets the mark. */
+	uint32 refcount = tileGraphic->refcount.load(boost::memory_order_relaxed), next;
+	do next = ((refcount & ~TileGraphic::RELEASED) == 1)?TileGraphic::RELEASED:refcount - 1;
+	while(!tileGraphic->refcount.compare_exchange_weak(refcount, next,
+		boost::memory_order_acq_rel, boost::memory_order_relaxed));
+	if(next == TileGraphic::RELEASED && refcount == 1) tileManager.PushReleased(tileGraphic);
 }
\ No newline at end of file
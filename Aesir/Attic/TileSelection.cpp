@@ -0,0 +1,40 @@
+#include "stdwx.h"
+#include "TileSelection.h"
+#include "TileLoader.h"
+#include <algorithm>
+using namespace std;
+
+void TileSelection::SelectRect(uint32 firstCell, uint32 lastCell, uint32 columns, int tileType) {
+	Clear();
+	uint32 numTiles = TileLoader::numTiles[tileType];
+	if(columns == 0 || numTiles == 0) return;
+	uint32 left = min(firstCell % columns, lastCell % columns),
+		right = max(firstCell % columns, lastCell % columns);
+	uint32 top = min(firstCell / columns, lastCell / columns),
+		bottom = min(max(firstCell / columns, lastCell / columns), (numTiles - 1) / columns);
+	if(top > bottom) return; // The rectangle lies entirely past the last tile
+	uint32 rows = bottom - top + 1, width = right - left + 1;
+	stamp.resize(boost::extents[rows][width]);
+	if(members[tileType].size() < (numTiles + 31) / 32) members[tileType].resize((numTiles + 31) / 32, 0);
+	for(uint32 row = 0; row < rows; ++row) {
+		uint32 index = (top + row) * columns + left;
+		for(uint32 column = 0; column < width; ++column, ++index) {
+			if(index >= numTiles) {
+				stamp[row][column] = TileIdentifier(uint32(NO_TILE), tileType);
+				continue;
+			}
+			stamp[row][column] = TileIdentifier(index, tileType);
+			Set(stamp[row][column]);
+			++count;
+		}
+	}
+}
+void TileSelection::Clear() {
+	// Only the bits of the old stamp are set, so clearing them is enough
+	for(Stamp::element *i = stamp.data(); i != stamp.data() + stamp.num_elements(); ++i) {
+		if(i->first == NO_TILE) continue;
+		members[i->second][i->first / 32] &= ~(1U << (i->first % 32));
+	}
+	stamp.resize(boost::extents[0][0]);
+	count = 0;
+}
@@ -0,0 +1,35 @@
+#pragma once
+#include <vector>
+#include <utility>
+#include <boost/multi_array.hpp>
+typedef std::pair<uint32, int> TileIdentifier;
+
+/* The tiles that the user has picked out of the tile chooser. They're kept twice: as a stamp, a
+ * grid of tiles in the layout that they were picked in, ready to be painted onto a map; and as a
+ * bitset over the indices of each tile type, so that asking whether a tile is selected costs the
+ * same no matter how many tiles are. */
+class TileSelection {
+public:
+	typedef boost::multi_array<TileIdentifier, 2> Stamp; // Indexed by row, then column
+	// The index of a stamp cell that has no tile, past the last tile of its type
+	static const uint32 NO_TILE = 0xFFFFFFFF;
+	/* Select a rectangle of a grid that lays the tiles of a type out row by row, columns wide.
+	 * The rectangle runs between two cells, in either order; the old selection is replaced. */
+	void SelectRect(uint32 firstCell, uint32 lastCell, uint32 columns, int tileType);
+	void Clear();
+	inline bool IsSelected(TileIdentifier tileIdentifier) const {
+		const std::vector<uint32> &words = members[tileIdentifier.second];
+		uint32 word = tileIdentifier.first / 32;
+		return word < words.size() && (words[word] & (1U << (tileIdentifier.first % 32)));
+	}
+	inline bool IsEmpty() const { return (count == 0); }
+	inline uint32 GetCount() const { return count; } // The number of tiles selected
+	inline const Stamp &GetStamp() const { return stamp; }
+	inline TileSelection() : count(0) { }
+private:
+	Stamp stamp;
+	std::vector<uint32> members[2]; // One bit per tile index, for each type
+	uint32 count;
+	inline void Set(TileIdentifier tileIdentifier) {
+		members[tileIdentifier.second][tileIdentifier.first / 32] |= 1U << (tileIdentifier.first % 32); }
+};
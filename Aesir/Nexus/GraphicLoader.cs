@@ -125,13 +125,28 @@ namespace Aesir.Nexus {
 			graphicCount = 0;
 			// Precache the EPF header information
 			sourceHeaders = new GraphicCollectionHeader[sourceProvider.SourceCount];
+			sourceBases = new int[sourceProvider.SourceCount];
 			for(int index = 0; index < sourceProvider.SourceCount; ++index) {
 				using(Stream stream = sourceProvider.GetSourceStream(index))
 					sourceHeaders[index] = GraphicCollectionHeader.FromStream(stream);
+				sourceBases[index] = graphicCount;
 				graphicCount += sourceHeaders[index].GraphicCount;
 			}
 		}
 		private GraphicCollectionHeader[] sourceHeaders;
+		/// <summary>
+		///		The index of the first graphic in each source. Finding the source that contains a
+		///		graphic is a binary search over this array.
+		/// </summary>
+		private int[] sourceBases;
+		private int FindSource(int index) {
+			int sourceIndex = Array.BinarySearch(sourceBases, index);
+			if(sourceIndex < 0) return ~sourceIndex - 1;
+			// Skip over empty sources that share the same base index
+			while(sourceIndex + 1 < sourceBases.Length && sourceBases[sourceIndex + 1] == index)
+				++sourceIndex;
+			return sourceIndex;
+		}
 		private ISourceProvider sourceProvider;
 		private PaletteCollection paletteCollection;
 		private PaletteTable paletteTable;
@@ -147,14 +162,9 @@ namespace Aesir.Nexus {
 			}
 			if(index == 0) return bitmap;
 
-			GraphicCollectionHeader sourceHeader = sourceHeaders[0];
-			int baseIndex = 0, sourceIndex = 0;
-			while(true) {
-				if(index < (baseIndex + sourceHeader.GraphicCount)) break;
-				baseIndex += sourceHeader.GraphicCount;
-				sourceHeader = sourceHeaders[++sourceIndex];
-			}
-			int localIndex = index - baseIndex;
+			int sourceIndex = FindSource(index);
+			GraphicCollectionHeader sourceHeader = sourceHeaders[sourceIndex];
+			int localIndex = index - sourceBases[sourceIndex];
 			using(Stream sourceStream = sourceProvider.GetSourceStream(sourceIndex)) {
 				// Skip over the EPF header; offsets are relative to the end of the header
 				sourceStream.Seek(GraphicCollectionHeader.DataSize, SeekOrigin.Current);